@@ -73,18 +73,34 @@
 #ifndef __EXILE_BUDGETCONF_H
 #include "budgetconf.h"
 #endif
+#ifndef __EXILE_BUDGET_SUBS_H
+#include "budget_subc.h"
+#endif
+#ifndef __EXILE_BUDGET_OUT_H
+#include "budget_out.h"
+#endif
+#ifndef __EXILE_BUDGET_SPOOL_H
+#include "budget_spool.h"
+#endif
+#ifndef __EXILE_BUDGET_CHAIN_H
+#include "budget_chain.h"
+#endif
+#ifndef __EXILE_BUDGET_VAULT_H
+#include "budget_vault.h"
+#endif
 
 /* Flags */
 #define NOMASK 0x00 /* 0000 0000 */
 #define INITDB 0x01 /* 0000 0001 */
 #define HAVEDB 0x02 /* 0000 0010 */
-#define HAVSQL 0x03 /* 0000 0100 */
+#define HAVSQL 0x04 /* 0000 0100 */
 #define CONINT 0x08 /* 0000 1000 */
 #define HELPME 0x10 /* 0001 0000 */
 #define HAVKEY 0x20 /* 0010 0000 */
 #define HVPASS 0x40 /* 0100 0000 */
 #define HAVCFG 0x80 /* 1000 0000 */
 #define INITOK 0x07 /* 0000 0111 */
+#define INITPL 0x03 /* 0000 0011 */
 #define CKMASK 0xFF /* 1111 1111 */
 
 
@@ -97,6 +113,8 @@ extern bool noop;
 /* Initialize necessary externs */
 bool dbg = false;
 bool noop = false;
+/* Times -v was given, a second asks for the whole chain instead of what's after the last checkpoint */
+static int verify = 0;
 
 /* Only function specific to this file aside from main() */
 static void usage(void);
@@ -114,7 +132,8 @@ main(int ac, char **av) {
 	char *dbname, *cfgfile, *enckey, *initfile;
 	retc = 0;
 	flags = NOMASK;
-	while ((ch = getopt(ac, av, "hDId:ik:vf:C:")) != -1) {
+	dbname = initfile = enckey = NULL;
+	while ((ch = getopt(ac, av, "hDId:ik:vf:o:C:P:")) != -1) {
 		switch (ch) {
 			case 'C':
 				/* Config file, overrides defaults */
@@ -127,18 +146,28 @@ main(int ac, char **av) {
 				break;
 			case 'I':
 				/* Initialize the database */
-				notimp(ch);
 				flags |= INITDB;
 				break;
 			case 'd':
 				/* Database file, overrides default */
 				flags |= HAVEDB;
-				notimp(ch);
+				dbname = optarg;
 				break;
 			case 'f':
 				/* SQL file to read from or write to */
-				notimp(ch);
 				flags |= HAVSQL;
+				initfile = optarg;
+				break;
+			case 'o':
+				/* Report output format */
+				if (outparse(optarg, &outformat) != 0) {
+					flags = HELPME;
+					usage();
+				}
+				break;
+			case 'P':
+				/* Only print these report columns, in this order */
+				outcols = optarg;
 				break;
 			case 'h':
 				/* Do not force early termination, allow main() to cleanup properly */
@@ -151,9 +180,9 @@ main(int ac, char **av) {
 				flags |= CONINT;
 				break;
 			case 'k':
-				/* key to use for the database decryption (asymmetric cipher), may or may not be password protected */
+				/* key file for the sealed transactions in the vault */
 				flags |= HAVKEY;
-				notimp(ch);
+				enckey = optarg;
 				break;
 			case 'n':
 				/* Do not actually write anything, especially used for runtime tracing */
@@ -161,9 +190,8 @@ main(int ac, char **av) {
 				notimp(ch);
 				break;
 			case 'v':
-				/* TODO: Look at migration from bitmap flag values and a way to reliably check more han just the database file header */
-				/* Verify database headers look correct, may include checksums in later versions */
-				notimp(ch);
+				/* Verify the hash chain over the ledger before running any command */
+				verify++;
 				break;
 			default:
 				notimp(ch);
@@ -190,15 +218,41 @@ usage(void) {
 			"Flags:\n"
 			"\t-C  Specify the configuration file to use\n"
 			"\t-D  Enable debugging printouts\n"
-			"\t-I  Bootstrap the database for use in budgeting\n"
+			"\t-I  Bootstrap the database for use in budgeting (from -f if given, else the built-in template)\n"
 			"\t-d  Specify the budget database to use (Default: %s%s/%s)\n"
 			"\t-f  Specify a SQL file to use in bootstrap/interchange functions\n"
 			"\t-h  This help message\n"
 			"\t-i  Open the database for interactive use\n"
-			"\t-k  Asymmetric decryption key location\n"
-			"\t-v  Validate the database integrity\n"
+			"\t-k  Key file for the vault of sealed transactions\n"
+			"\t-o  Report output format, one of text, tsv, json or bin (Default: text)\n"
+			"\t-P  Comma separated list of report columns to print\n"
+			"\t-v  Verify the ledger's hash chain since the last checkpoint, give twice to verify all of it\n"
 			"Commands:\n"
-			"\t...Still Loading...\n"
+			"\tinsert [-c category] [-d YYYY-MM-DD] amount description...\n"
+			"\t\tRecord a transaction (negative amounts are expenses) through the write spool\n"
+			"\tflush\n"
+			"\t\tWait for the database and commit everything left in the write spool\n"
+			"\tsearch [-c category] [-y year] [-m month] [-n limit] terms...\n"
+			"\t\tFull-text search of descriptions, append * for a prefix match, quote for a phrase\n"
+			"\tarchive [-y year]\n"
+			"\t\tMove closed years (up to the given one) into per-year archive databases\n"
+			"\tanalyze snapshot | report [-g cat|type|month|catmonth] [-y year [-m month]]\n"
+			"\t\tBuild/refresh the columnar snapshot of the working database (archived years aside), or report count/sum/min/max from it\n"
+			"\timport [-p skip|flag|merge] statement\n"
+			"\t\tImport a date,amount,description[,category] statement, handling duplicates per -p (default: skip)\n"
+			"\tstats [-g cat|month|catmonth] [-c category] [-t type] [-y year [-m month]]\n"
+			"\t\tCount, mean, standard deviation, percentiles and trend of one transaction type (Default: expense)\n"
+			"\treconcile [-w days] [-f YYYY-MM-DD] [-t YYYY-MM-DD] statement\n"
+			"\t\tMatch a statement against the ledger, allowing dates to be off by -w days (Default: 3)\n"
+			"\tvault seal [-y year] | open [-c category] [-y year [-m month]]\n"
+			"\t\tEncrypt transactions (through -y, archived years included) into the vault with the -k key, or move them back out\n"
+			"\tvault report [-g cat|month|catmonth] [-c category] [-y year [-m month]] | list [...] [-n limit]\n"
+			"\t\tCount/sum/min/max of, or list, sealed transactions\n"
+			"\tcache stats | clear\n"
+			"\t\tShow hit rate and size of the report cache, or empty it\n"
+			"\tmigrate [-n] [-t seconds]\n"
+			"\t\tUpgrade an older database in small batches, -n estimates the cost, -t stops before a batch would run past it\n"
+			"\t\tand resumes next run (schema changes and index builds always run to completion, so it can be overshot)\n"
 			,__progname, __progname, DEFAULT_BUDGET_PARENTDIR, DEFAULT_BUDGET_DIR, DEFAULT_BUDGET_DB);
 }
 
@@ -224,23 +278,42 @@ cook(const char *dbname, const char *sqlfile, const char *cfgfile, const char *e
 
 	/* Branch off based on flag value */
 	switch (flags & CKMASK) {
+		case HAVKEY|HAVEDB:
+			/* the key only matters to the vault, everything else runs just as without one */
+			if (((retc = decrypt(dbname, enckey)) != 0) || ((retc = vaultopen(enckey)) != 0)) {
+				break;
+			}
+			/* FALLTHROUGH */
 		case HAVEDB:
-			if (connect(dbname, dbptr) == 0) {
+			if ((retc = connect(dbname, &dbptr)) == 0) {
+				if (verify > 0) {
+					retc = chainverify(dbptr, (verify > 1));
+				}
 				/* TODO: Pass to a function that either accepts or generates a transaction control structure */
-				if (argstr != NULL) {
+				if ((retc == 0) && (argstr != NULL) && ((verify == 0) || (*argstr != NULL))) {
 					retc = parsecmd(argstr,dbptr);
 				}
 			}
+			/* safe to call even if the open failed */
+			sqlite3_close(dbptr);
+			vaultclose();
 			break;
-		case HAVKEY|HAVEDB:
-			retc = decrypt(dbname, enckey);
+		case INITPL:
+			/* No SQL file given, write out the template built into the binary */
+			retc = bootstrap(dbname);
 			break;
 		case INITOK:
+			/* An explicit SQL file overrides the built-in template */
 			if ((retc = opensql(sqlfile, &sqlfd)) == 0) {
-				retc = initialize(dbptr, &sqlfd);
+				if ((retc = sqlite3_open_v2(dbname, &dbptr, SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE|SQLITE_OPEN_NOMUTEX, NULL)) != SQLITE_OK) {
+					nxerr(sqlite3_errstr(retc));
+				} else {
+					retc = initialize(dbptr, &sqlfd);
+				}
 				/* ensure the file descriptor is actually closed */
 				close(sqlfd);
 			}
+			break;
 		case HAVKEY|INITOK:
 			/* Bootstrap encrypted database */
 			nxwrn("The encrypted bootstrap process is not yet implemented");
@@ -299,7 +372,7 @@ readconfig(const char *conffile) {
  * Opens the database for use in other functions
  */
 int
-connect(const char *dbname, sqlite3 *dbptr) {
+connect(const char *dbname, sqlite3 **dbptr) {
 	int retc;
 	struct stat dbstat;
 	retc = 0;
@@ -315,13 +388,17 @@ connect(const char *dbname, sqlite3 *dbptr) {
 		fprintf(stderr, "ERR: %s [%s:%u] %s: Ensure that %s is an initialized budget database\n", __progname,__FILE__,__LINE__,__func__,dbname);
 		return(retc);
 	}
-	if (dbptr != NULL) {
-		retc = -1;
+	if ((dbptr == NULL) || (*dbptr != NULL)) {
 		nxerr("This should not have been possible");
+		return(-1);
 	}
 	/* XXX: The shared caching mode may not be of any benefit, revisit later on in development */
-	if ((retc = sqlite3_open_v2(dbname, &dbptr, SQLITE_OPEN_READWRITE|SQLITE_OPEN_NOMUTEX|SQLITE_OPEN_SHAREDCACHE, NULL)) != SQLITE_OK) {
+	if ((retc = sqlite3_open_v2(dbname, dbptr, SQLITE_OPEN_READWRITE|SQLITE_OPEN_NOMUTEX|SQLITE_OPEN_SHAREDCACHE, NULL)) != SQLITE_OK) {
 		nxerr(sqlite3_errstr(retc));
+	} else {
+		/* other invocations may be writing, back off and retry rather than failing outright */
+		sqlite3_busy_handler(*dbptr, busywait, NULL);
+		schemacheck(*dbptr);
 	}
 	if (dbg) {
 		nxexit();
@@ -393,11 +470,23 @@ initialize(sqlite3 *dbptr, int *sqlfd) {
 			nxinf("Initializing budgeting database...");
 			for (;sqlinit < (sqlstart + sqlstat.st_size); sqlinit = (char * const)sqltail) {
 				retc = sqlite3_prepare_v2(dbptr,sqlinit,-1,&budgetq,&sqltail); /* pass -1 as length to read up to NULL terminator */
+				/* a statement that doesn't prepare also leaves budgetq NULL, so check that first */
+				if (retc != SQLITE_OK) {
+					nxerr(sqlite3_errmsg(dbptr));
+					break;
+				}
+				/* only comments or whitespace were left */
+				if (budgetq == NULL) {
+					retc = SQLITE_DONE;
+					break;
+				}
 				retc = sqlite3_step(budgetq);
+				sqlite3_finalize(budgetq);
+				/* stop at the first failure, anything after it likely depends on it */
 				if (retc != SQLITE_DONE) {
-					nxerr(sqlite3_errstr(retc));
+					nxerr(sqlite3_errmsg(dbptr));
+					break;
 				}
-				sqlite3_finalize(budgetq);
 			}
 		}
 	}
@@ -407,9 +496,93 @@ initialize(sqlite3 *dbptr, int *sqlfd) {
 	}
 	/* Close the database connection */
 	sqlite3_close(dbptr);
+	return((retc == SQLITE_DONE) ? 0 : retc);
+}
+
+/* 
+ * Write the template database embedded at build time out to dbname.
+ * The image is deserialized first so the schema version can be checked without
+ * touching the disk, after that it's a single write(2) of the whole thing.
+ */
+int
+bootstrap(const char *dbname) {
+	int retc, dbfd, version;
+	sqlite3 *tmpl;
+	sqlite3_stmt *verq;
+	retc = 0;
+	version = -1;
+	tmpl = NULL; verq = NULL;
+
+	if (dbg) {
+		nxentr();
+	}
+	if (dbname == NULL) {
+		nxerr("No database given to bootstrap");
+		return(-1);
+	}
+	/* SQLITE_DESERIALIZE_READONLY lets the connection use the image in place, no copy needed */
+	if (((retc = sqlite3_open_v2(":memory:", &tmpl, SQLITE_OPEN_READWRITE|SQLITE_OPEN_NOMUTEX, NULL)) != SQLITE_OK)
+			|| ((retc = sqlite3_deserialize(tmpl, "main", (unsigned char *)(uintptr_t)budget_tmpl, (sqlite3_int64)budget_tmpl_len,
+						(sqlite3_int64)budget_tmpl_len, SQLITE_DESERIALIZE_READONLY)) != SQLITE_OK)) {
+		nxerr(sqlite3_errstr(retc));
+	} else if ((sqlite3_prepare_v2(tmpl, "PRAGMA user_version;", -1, &verq, NULL) == SQLITE_OK) && (sqlite3_step(verq) == SQLITE_ROW)) {
+		version = sqlite3_column_int(verq, 0);
+	}
+	sqlite3_finalize(verq);
+	sqlite3_close(tmpl);
+	if ((retc == SQLITE_OK) && ((version != BUDGET_SCHEMA) || (version != budget_tmpl_version))) {
+		fprintf(stderr, "ERR: %s [%s:%u] %s: Built-in template is schema version %d, expected %d, rebuild budget_tmpl.c\n",
+				__progname, __FILE__, __LINE__, __func__, version, BUDGET_SCHEMA);
+		retc = -1;
+	}
+
+	/* never clobber an existing database */
+	if ((retc == 0) && ((dbfd = open(dbname, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, S_IRUSR|S_IWUSR)) == -1)) {
+		nxerr(strerror(errno));
+		retc = -1;
+	}
+	if (retc == 0) {
+		if (write(dbfd, budget_tmpl, budget_tmpl_len) != (ssize_t)budget_tmpl_len) {
+			nxerr(strerror(errno));
+			retc = -1;
+		}
+		if ((retc == 0) && (fsync(dbfd) != 0)) {
+			nxerr(strerror(errno));
+			retc = -1;
+		}
+		close(dbfd);
+		/* don't leave a truncated database behind */
+		if (retc != 0) {
+			unlink(dbname);
+		}
+	}
+	if (dbg) {
+		nxexit();
+	}
 	return(retc);
 }
 
+/* 
+ * Warn when the database was made by an older version of budget.sql
+ */
+int
+schemacheck(sqlite3 *dbptr) {
+	int version;
+	sqlite3_stmt *verq;
+	version = -1;
+	verq = NULL;
+
+	if ((sqlite3_prepare_v2(dbptr, "PRAGMA main.user_version;", -1, &verq, NULL) == SQLITE_OK) && (sqlite3_step(verq) == SQLITE_ROW)) {
+		version = sqlite3_column_int(verq, 0);
+	}
+	sqlite3_finalize(verq);
+	if (version < BUDGET_SCHEMA) {
+		fprintf(stderr, "WRN: %s [%s:%u] %s: Database schema is version %d, this build expects %d, run migrate to upgrade it\n",
+				__progname, __FILE__, __LINE__, __func__, version, BUDGET_SCHEMA);
+	}
+	return(version);
+}
+
 /* 
  * This function opens the file passed to it and assigns the fd to the pointer passed in
  */
@@ -68,6 +68,13 @@
 #define DEFAULT_BUDGET_DIR "/.local"
 #define DEFAULT_BUDGET_DB ".budget"
 
+/* 
+ * Schema version this binary expects, kept in PRAGMA user_version
+ */
+#ifndef BUDGET_SCHEMA
+#define BUDGET_SCHEMA 4
+#endif
+
 /* 
  * Transaction ID size 
  */
@@ -83,7 +90,17 @@ typedef enum __dbcmds {
 	update = 3, /* update an existing entry */
 	create = 4, /* create new xcats or xtypes */
 	balance = 5, /* get the current estimated balance */
-	show = 6 /* like query, but only accepts a category */
+	show = 6, /* like query, but only accepts a category */
+	search = 7, /* full-text search over transaction descriptions */
+	archive_years = 8, /* move closed years out into their own databases */
+	analysis = 9, /* build or report from the columnar snapshot */
+	import_stmt = 10, /* load a bank statement, skipping rows already in the ledger */
+	cache_cmd = 11, /* report cache statistics and maintenance */
+	flush_spool = 12, /* commit transactions waiting in the write spool */
+	reconcile_stmt = 13, /* match a bank statement against the ledger */
+	stats_report = 14, /* moments and percentiles per category and month */
+	vault_cmd = 15, /* seal transactions into, or report from, the encrypted vault */
+	migrate_schema = 16 /* bring an older database up to BUDGET_SCHEMA */
 } dbaction;
 
 /*
@@ -125,10 +142,16 @@ typedef struct __dbcmd {
 int cook(const char *dbname, const char *sqlfile, const char *cfgfile, const char *enckey, char **argstr, uint8_t flags);
 int readconfig(const char *conffile);
 int initialize(sqlite3 *dbptr, int *sqlfd);
+int bootstrap(const char *dbname);
+int schemacheck(sqlite3 *dbptr);
+/* The prebuilt database from budget.sql, generated into budget_tmpl.c by mktmpl */
+extern const int budget_tmpl_version;
+extern const size_t budget_tmpl_len;
+extern const unsigned char budget_tmpl[];
 int opensql(const char *sqlfile, int *sqlfd);
 int mkexpense_category(cmdargs *dbdata, const char *category);
 int insert_transaction(cmdargs *dbdata, const char *category, int cost);
 /* this function may not be necessary any longer */
 int buildcommand(const char **av, cmdargs *dbdata);
-int connect(const char *dbname, sqlite3 *dbptr);
+int connect(const char *dbname, sqlite3 **dbptr);
 int decrypt(const char *dbname, const char *enckey);
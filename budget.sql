@@ -57,6 +57,8 @@ CREATE TABLE IF NOT EXISTS transactions (
 	amount numeric, -- Amount paid/recieved
 	category integer, -- The category of the transaction
 	desc text NOT NULL, -- Description of the transaction, default determined by other fields prior to being inserted
+	fprint integer, -- Hash of the date, type, amount and normalized description, used to catch duplicate imports
+	dupof varchar(64), -- tid of the transaction this one duplicates, if it was imported anyway
 	-- These constraints do not appear to work as desired yet
 	-- more work needed to ensure they work properly
 	CHECK ( year > 0 ),
@@ -67,6 +69,14 @@ CREATE TABLE IF NOT EXISTS transactions (
 );
 
 
+-- Closed years moved out of transactions by the archive command
+-- Each one is a separate database with the same transactions schema
+CREATE TABLE IF NOT EXISTS archives (
+	year integer PRIMARY KEY, -- The archived year
+	path text NOT NULL, -- Archive file, relative to the directory holding this database
+	rows integer -- Number of transactions moved into it
+);
+
 -- Populate valid days in each given month
 -- JAN
 BEGIN;
@@ -121,9 +131,101 @@ CREATE INDEX IF NOT EXISTS trans_types ON transactions (tid,type,amount,desc);
 CREATE INDEX IF NOT EXISTS trans_cats ON transactions (tid,category,amount,desc);
 CREATE INDEX IF NOT EXISTS trans_by_year ON transactions (tid,year,amount,desc);
 CREATE INDEX IF NOT EXISTS trans_by_month ON transactions (tid,month,amount,desc);
+-- These lead with the filtered columns, the tid-leading indexes above only help tid lookups
+CREATE INDEX IF NOT EXISTS trans_by_date ON transactions (year,month,day);
+CREATE INDEX IF NOT EXISTS trans_by_cat ON transactions (category,year,month);
+CREATE INDEX IF NOT EXISTS trans_fprint ON transactions (fprint);
+
+-- Full-text index over the transaction descriptions
+-- This is an external content table, so the text itself is only stored once in transactions
+-- and the triggers below are what keep the two in sync.
+-- transactions has no INTEGER PRIMARY KEY, so the rowids the index is keyed on are implicit
+-- and VACUUM is free to renumber them; every VACUUM has to be followed by a 'rebuild'
+CREATE VIRTUAL TABLE IF NOT EXISTS trans_fts USING fts5("desc", content='transactions', content_rowid='rowid', prefix='2 3');
+CREATE TRIGGER IF NOT EXISTS trans_fts_ins AFTER INSERT ON transactions BEGIN
+	INSERT INTO trans_fts (rowid, "desc") VALUES (new.rowid, new.desc);
+END;
+CREATE TRIGGER IF NOT EXISTS trans_fts_del AFTER DELETE ON transactions BEGIN
+	INSERT INTO trans_fts (trans_fts, rowid, "desc") VALUES ('delete', old.rowid, old.desc);
+END;
+CREATE TRIGGER IF NOT EXISTS trans_fts_upd AFTER UPDATE OF desc ON transactions BEGIN
+	INSERT INTO trans_fts (trans_fts, rowid, "desc") VALUES ('delete', old.rowid, old.desc);
+	INSERT INTO trans_fts (rowid, "desc") VALUES (new.rowid, new.desc);
+END;
+-- Pick up any rows that were inserted before the index existed
+INSERT INTO trans_fts (trans_fts) VALUES ('rebuild');
+
+-- Generation counter for the report cache, any write a report could see bumps it
+-- Cached results are only served while the generation they were computed at is still current
+CREATE TABLE IF NOT EXISTS ledger_gen (
+	gen integer NOT NULL
+);
+INSERT INTO ledger_gen SELECT 0 WHERE NOT EXISTS (SELECT 1 FROM ledger_gen);
+CREATE TRIGGER IF NOT EXISTS gen_trans_ins AFTER INSERT ON transactions BEGIN UPDATE ledger_gen SET gen = gen + 1; END;
+CREATE TRIGGER IF NOT EXISTS gen_trans_upd AFTER UPDATE ON transactions BEGIN UPDATE ledger_gen SET gen = gen + 1; END;
+CREATE TRIGGER IF NOT EXISTS gen_trans_del AFTER DELETE ON transactions BEGIN UPDATE ledger_gen SET gen = gen + 1; END;
+CREATE TRIGGER IF NOT EXISTS gen_cats_ins AFTER INSERT ON xcats BEGIN UPDATE ledger_gen SET gen = gen + 1; END;
+CREATE TRIGGER IF NOT EXISTS gen_cats_upd AFTER UPDATE ON xcats BEGIN UPDATE ledger_gen SET gen = gen + 1; END;
+CREATE TRIGGER IF NOT EXISTS gen_cats_del AFTER DELETE ON xcats BEGIN UPDATE ledger_gen SET gen = gen + 1; END;
+CREATE TRIGGER IF NOT EXISTS gen_types_ins AFTER INSERT ON xtypes BEGIN UPDATE ledger_gen SET gen = gen + 1; END;
+CREATE TRIGGER IF NOT EXISTS gen_types_upd AFTER UPDATE ON xtypes BEGIN UPDATE ledger_gen SET gen = gen + 1; END;
+CREATE TRIGGER IF NOT EXISTS gen_types_del AFTER DELETE ON xtypes BEGIN UPDATE ledger_gen SET gen = gen + 1; END;
+
+-- Per month statistics for the stats report, kept for months that are over so they never need scanning again
+-- A month only counts as folded in while it has a row in stats_closed, any write to it removes that
+CREATE TABLE IF NOT EXISTS stats_closed (
+	year integer,
+	month integer,
+	PRIMARY KEY (year, month)
+);
+CREATE TABLE IF NOT EXISTS stats_months (
+	category integer, -- -1 for transactions without one
+	type integer,
+	year integer,
+	month integer,
+	n integer, -- Welford accumulator: count, mean and sum of squared deviations, in cents
+	mean real,
+	m2 real,
+	min integer,
+	max integer,
+	sum integer,
+	digest blob, -- t-digest centroids, native (mean, weight) double pairs
+	PRIMARY KEY (category, type, year, month)
+);
+CREATE TRIGGER IF NOT EXISTS stats_trans_ins AFTER INSERT ON transactions BEGIN
+	DELETE FROM stats_closed WHERE year = new.year AND month = new.month;
+END;
+CREATE TRIGGER IF NOT EXISTS stats_trans_upd AFTER UPDATE ON transactions BEGIN
+	DELETE FROM stats_closed WHERE (year = old.year AND month = old.month) OR (year = new.year AND month = new.month);
+END;
+CREATE TRIGGER IF NOT EXISTS stats_trans_del AFTER DELETE ON transactions BEGIN
+	DELETE FROM stats_closed WHERE year = old.year AND month = old.month;
+END;
+
+-- Hash chain over the ledger, each link hashes the one before it and a row's content (category aside)
+CREATE TABLE IF NOT EXISTS chain_spec (name text NOT NULL); -- digest the chain is built with
+CREATE TABLE IF NOT EXISTS chain_pending (seq integer PRIMARY KEY, tid varchar(64) NOT NULL);
+CREATE TABLE IF NOT EXISTS chain (seq integer PRIMARY KEY, tid varchar(64) UNIQUE NOT NULL, hash blob NOT NULL);
+-- HMAC signed chain heads, the key is kept next to the database in <db>.chainkey
+CREATE TABLE IF NOT EXISTS chain_ckpt (seq integer PRIMARY KEY, hash blob NOT NULL, mac blob NOT NULL, made integer);
+CREATE TRIGGER IF NOT EXISTS chain_trans_ins AFTER INSERT ON transactions BEGIN
+	INSERT INTO chain_pending (tid) VALUES (new.tid);
+END;
+
+-- Sealed transactions, amount/date/category and description each in a ChaCha20-Poly1305 box
+-- mtok and ctok are keyed HMAC tokens of the month and category so filtering doesn't need to decrypt
+CREATE TABLE IF NOT EXISTS vault_meta (salt blob NOT NULL, rounds integer NOT NULL, spec text NOT NULL, verifier blob NOT NULL); -- PBKDF2 parameters for the -k key file
+CREATE TABLE IF NOT EXISTS vault (tid varchar(64) PRIMARY KEY, type integer, mtok blob NOT NULL, ctok blob NOT NULL, abox blob NOT NULL, dbox blob NOT NULL);
+CREATE INDEX IF NOT EXISTS vault_month ON vault (mtok, ctok, abox, tid);
+CREATE INDEX IF NOT EXISTS vault_cat ON vault (ctok, mtok, abox, tid);
+
+-- Schema version, bump this (and BUDGET_SCHEMA in budget.h) whenever existing databases need to catch up,
+-- and add the step that gets them there to migrations[] in budget_migrate.c
+-- 1: fingerprints and archives, 2: full-text index, 3: report cache, stats, hash chain and vault,
+-- 4: fingerprints include the type
+PRAGMA user_version = 4;
 
 -- PRAGMA foreign_keys = ON;
--- NOTE: Later versions should make it possible to encrypt or hash this data on-disk so it's not possible to determine exactly what rows mean anything
 
 -- Reminders on how to collect certain types of data
 -- Balance according to tracked data:
@@ -132,3 +234,5 @@ CREATE INDEX IF NOT EXISTS trans_by_month ON transactions (tid,month,amount,desc
 --	select sum(tx.amount) from transactions as tx where category=(select key from xcats where cat='PAID');
 -- Type by name:
 --	select sum(amount) from transactions where type=(select key from xtypes where type='EXPENSE');
+-- Description search, ranked by relevance:
+--	select tx.* from trans_fts join transactions as tx on tx.rowid=trans_fts.rowid where trans_fts match '"hardware"*' order by rank;
@@ -0,0 +1,363 @@
+/*
+ * Copyright (c) 2019, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* 
+ * Year-partitioned archives, the working database only keeps the open years
+ * so its tables and indexes stay small. Archived years are attached only when a 
+ * query's date range reaches back into them. Commands that need a schema's own rowids or
+ * columns (search, stats, import, vault) go through archeach(), the rest read the temp view
+ * "ledger", which unions whatever is attached with main.transactions (reconcile does).
+ * The analyze snapshot only ever covers the working database.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+#include <time.h>
+
+#ifndef __EXILE_BUDGET_H
+#include "budget.h"
+#endif
+#ifndef __EXILE_BUDGET_SUBS_H
+#include "budget_subc.h"
+#endif
+#ifndef __EXILE_BUDGET_ARCHIVE_H
+#include "budget_archive.h"
+#endif
+
+extern char *__progname;
+extern bool dbg;
+
+/* Kept in sync with budget.sql, older databases won't have it yet */
+static const char arcdef[] = 
+	"CREATE TABLE IF NOT EXISTS main.archives (year integer PRIMARY KEY, path text NOT NULL, rows integer);";
+
+/* 
+ * Only the pieces of the schema that live entirely within the transactions table are copied,
+ * anything else (triggers touching other tables) would fail once it fired inside the archive
+ */
+static const char arcschema[] = 
+	"SELECT sql FROM main.sqlite_master WHERE sql NOT NULL AND tbl_name IN ('transactions', 'trans_fts') "
+	"AND (type IN ('table', 'index') OR name GLOB 'trans_fts_*') ORDER BY rowid;";
+
+static int archinit(sqlite3 *dbptr, const char *path);
+static int archyear(sqlite3 *dbptr, long long year);
+static int archview(const char *schema, void *arg);
+static char *archcols(sqlite3 *dbptr, const char *schema);
+
+/* 
+ * Archives are recorded relative to the directory of the working database,
+ * so moving the whole set of files together doesn't break anything
+ */
+char *
+archpath(sqlite3 *dbptr, const char *file) {
+	const char *dbfile, *slash;
+
+	if (((dbfile = sqlite3_db_filename(dbptr, "main")) == NULL) || ((slash = strrchr(dbfile, '/')) == NULL)) {
+		return(sqlite3_mprintf("%s", file));
+	}
+	return(sqlite3_mprintf("%.*s/%s", (int)(slash - dbfile), dbfile, file));
+}
+
+/* 
+ * Create the transactions schema in a new archive file, done on a separate
+ * connection so the statements from sqlite_master can be used verbatim
+ */
+static int
+archinit(sqlite3 *dbptr, const char *path) {
+	int retc;
+	sqlite3 *arcdb;
+	sqlite3_stmt *schemaq, *existq;
+	arcdb = NULL; schemaq = NULL; existq = NULL;
+
+	if ((retc = sqlite3_open_v2(path, &arcdb, SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE|SQLITE_OPEN_NOMUTEX, NULL)) != SQLITE_OK) {
+		nxerr(sqlite3_errstr(retc));
+		sqlite3_close(arcdb);
+		return(retc);
+	}
+	/* a year that was archived before only needs the late rows appended */
+	if ((retc = sqlite3_prepare_v2(arcdb, "SELECT count(*) FROM sqlite_master WHERE name = 'transactions';", -1, &existq, NULL)) == SQLITE_OK) {
+		if ((sqlite3_step(existq) == SQLITE_ROW) && (sqlite3_column_int(existq, 0) > 0)) {
+			retc = SQLITE_DONE;
+		}
+	}
+	sqlite3_finalize(existq);
+	if ((retc == SQLITE_OK) && ((retc = sqlite3_prepare_v2(dbptr, arcschema, -1, &schemaq, NULL)) == SQLITE_OK)) {
+		sqlite3_exec(arcdb, "BEGIN;", NULL, NULL, NULL);
+		while ((retc = sqlite3_step(schemaq)) == SQLITE_ROW) {
+			if ((retc = sqlite3_exec(arcdb, (const char *)sqlite3_column_text(schemaq, 0), NULL, NULL, NULL)) != SQLITE_OK) {
+				nxerr(sqlite3_errmsg(arcdb));
+				break;
+			}
+		}
+		sqlite3_exec(arcdb, (retc == SQLITE_DONE) ? "COMMIT;" : "ROLLBACK;", NULL, NULL, NULL);
+	}
+	sqlite3_finalize(schemaq);
+	sqlite3_close(arcdb);
+	return((retc == SQLITE_DONE) ? 0 : retc);
+}
+
+/* 
+ * Quoted list of the transactions columns main shares with an attached archive,
+ * one made before a column was added to main won't have it
+ */
+static char *
+archcols(sqlite3 *dbptr, const char *schema) {
+	char *cols;
+	sqlite3_stmt *colq;
+	cols = NULL;
+	colq = NULL;
+
+	if ((sqlite3_prepare_v2(dbptr, "SELECT group_concat('\"' || replace(m.name, '\"', '\"\"') || '\"', ', ') FROM pragma_table_info('transactions', 'main') AS m "
+					"WHERE m.name IN (SELECT a.name FROM pragma_table_info('transactions', ?1) AS a);", -1, &colq, NULL) == SQLITE_OK)
+			&& (sqlite3_bind_text(colq, 1, schema, -1, SQLITE_STATIC) == SQLITE_OK)
+			&& (sqlite3_step(colq) == SQLITE_ROW) && (sqlite3_column_type(colq, 0) != SQLITE_NULL)) {
+		cols = sqlite3_mprintf("%s", (const char *)sqlite3_column_text(colq, 0));
+	}
+	sqlite3_finalize(colq);
+	return(cols);
+}
+
+/* 
+ * Move a single year into its archive, the copy, delete and registry update 
+ * all happen in one transaction so an interrupted run leaves the rows where they were
+ */
+static int
+archyear(sqlite3 *dbptr, long long year) {
+	int retc;
+	const char *dbfile, *base;
+	char *file, *path, *sql, *schema, *cols;
+	retc = 0;
+	sql = schema = cols = NULL;
+
+	/* the archive is named after the working database, with the year as a suffix */
+	if (((dbfile = sqlite3_db_filename(dbptr, "main")) == NULL) || (*dbfile == '\0')) {
+		base = DEFAULT_BUDGET_DB;
+	} else {
+		base = ((base = strrchr(dbfile, '/')) != NULL) ? base + 1 : dbfile;
+	}
+	file = sqlite3_mprintf("%s.%lld", base, year);
+	path = archpath(dbptr, file);
+	if ((file == NULL) || (path == NULL)) {
+		nxerr("Unable to allocate archive path");
+		retc = -1;
+	}
+	if ((retc == 0) && ((retc = archinit(dbptr, path)) == 0)) {
+		sql = sqlite3_mprintf("ATTACH %Q AS \"arc%lld\";", path, year);
+		schema = sqlite3_mprintf("arc%lld", year);
+		if ((retc = sqlite3_exec(dbptr, sql, NULL, NULL, NULL)) != SQLITE_OK) {
+			nxerr(sqlite3_errmsg(dbptr));
+		} else if ((cols = archcols(dbptr, schema)) == NULL) {
+			nxerr("Archive has no transactions columns in common with the database");
+			retc = -1;
+		}
+		sqlite3_free(sql);
+		sql = NULL;
+	}
+	if ((retc == 0) && (cols != NULL)) {
+		/* late rows of a year archived before may be going into an older layout, so name the columns */
+		sql = sqlite3_mprintf(
+				"BEGIN IMMEDIATE;"
+				"INSERT INTO \"%w\".transactions (%s) SELECT %s FROM main.transactions WHERE year = %lld;"
+				"INSERT INTO main.archives (year, path, rows) VALUES (%lld, %Q, changes()) "
+				"ON CONFLICT (year) DO UPDATE SET rows = rows + excluded.rows;"
+				"DELETE FROM main.transactions WHERE year = %lld;"
+				"COMMIT;",
+				schema, cols, cols, year, year, file, year);
+		if ((retc = sqlite3_exec(dbptr, sql, NULL, NULL, NULL)) != SQLITE_OK) {
+			nxerr(sqlite3_errmsg(dbptr));
+			sqlite3_exec(dbptr, "ROLLBACK;", NULL, NULL, NULL);
+		} else {
+			fprintf(stdout, "%lld archived to %s\n", year, path);
+		}
+		sqlite3_free(sql);
+	}
+	if (schema != NULL) {
+		sql = sqlite3_mprintf("DETACH \"%w\";", schema);
+		sqlite3_exec(dbptr, sql, NULL, NULL, NULL);
+		sqlite3_free(sql);
+	}
+	sqlite3_free(cols);
+	sqlite3_free(schema);
+	sqlite3_free(path);
+	sqlite3_free(file);
+	return(retc);
+}
+
+/* 
+ * archive [-y year]
+ * Moves every closed year up to and including the given one (default: all of them)
+ */
+int
+archive(char **argstr, sqlite3 *dbptr) {
+	int retc;
+	long long last, year;
+	time_t now;
+	struct tm today;
+	sqlite3_stmt *yearq;
+	retc = 0;
+	yearq = NULL;
+
+	if (dbg) {
+		nxentr();
+	}
+	now = time(NULL);
+	localtime_r(&now, &today);
+	/* the current year is never closed */
+	last = (long long)today.tm_year + 1900 - 1;
+	for (; (argstr != NULL) && (*argstr != NULL) && (retc == 0); argstr++) {
+		if ((strcmp(*argstr, "-y") == 0) && (argstr[1] != NULL)) {
+			retc = numarg(*++argstr, &last);
+		}
+	}
+	if ((retc == 0) && (last > (long long)today.tm_year + 1900 - 1)) {
+		nxerr("Only closed years can be archived");
+		retc = -1;
+	}
+	if ((retc == 0) && ((retc = sqlite3_exec(dbptr, arcdef, NULL, NULL, NULL)) != SQLITE_OK)) {
+		nxerr(sqlite3_errmsg(dbptr));
+	}
+	/* trans_by_date makes this a walk over the distinct index prefixes */
+	if ((retc == 0) && ((retc = sqlite3_prepare_v2(dbptr, "SELECT DISTINCT year FROM main.transactions WHERE year <= ?1 ORDER BY year;", -1, &yearq, NULL)) == SQLITE_OK)) {
+		sqlite3_bind_int64(yearq, 1, last);
+		/* reset before each move, the archived year drops out of the next lookup */
+		while ((retc == 0) && (sqlite3_step(yearq) == SQLITE_ROW)) {
+			year = sqlite3_column_int64(yearq, 0);
+			sqlite3_reset(yearq);
+			retc = archyear(dbptr, year);
+		}
+	}
+	sqlite3_finalize(yearq);
+	if (dbg) {
+		nxexit();
+	}
+	return(retc);
+}
+
+/* 
+ * Call fn for main and every archive currently attached, stopping at the first nonzero return
+ */
+int
+archeach(sqlite3 *dbptr, int (*fn)(const char *schema, void *arg), void *arg) {
+	int retc;
+	sqlite3_stmt *dblist;
+	dblist = NULL;
+
+	if ((retc = fn("main", arg)) != 0) {
+		return(retc);
+	}
+	if ((retc = sqlite3_prepare_v2(dbptr, "SELECT name FROM pragma_database_list WHERE name GLOB 'arc[0-9]*' ORDER BY name;", -1, &dblist, NULL)) == SQLITE_OK) {
+		while ((retc == 0) && (sqlite3_step(dblist) == SQLITE_ROW)) {
+			retc = fn((const char *)sqlite3_column_text(dblist, 0), arg);
+		}
+	}
+	sqlite3_finalize(dblist);
+	return(retc);
+}
+
+static int
+archview(const char *schema, void *arg) {
+	sqlite3_str *view;
+	view = arg;
+
+	if (strcmp(schema, "main") != 0) {
+		sqlite3_str_appendall(view, " UNION ALL");
+	}
+	/* archives made before a column was added won't have it, so stick to the common ones */
+	sqlite3_str_appendf(view, " SELECT tid, year, month, day, type, amount, category, desc FROM \"%w\".transactions", schema);
+	return(0);
+}
+
+/* 
+ * Attach every archived year within [from, to], either bound can be 0 to leave it open.
+ * The ledger view is rebuilt afterwards so it always reflects what is attached,
+ * it has no rowid worth using since those repeat from one file to the next
+ */
+int
+archattach(sqlite3 *dbptr, long long from, long long to) {
+	int retc, attached;
+	char *sql, *path;
+	sqlite3_str *view;
+	sqlite3_stmt *arcq;
+	retc = attached = 0;
+	arcq = NULL;
+
+	if (dbg) {
+		nxentr();
+	}
+	/* no registry means nothing has been archived yet, which is not an error */
+	if (sqlite3_table_column_metadata(dbptr, "main", "archives", "path", NULL, NULL, NULL, NULL, NULL) == SQLITE_OK) {
+		/* newest first, so a too-wide range loses the oldest years rather than the most relevant */
+		if ((retc = sqlite3_prepare_v2(dbptr, 
+						"SELECT year, path FROM main.archives WHERE (?1 = 0 OR year >= ?1) AND (?2 = 0 OR year <= ?2) "
+						"AND ('arc' || year) NOT IN (SELECT name FROM pragma_database_list) ORDER BY year DESC;", 
+						-1, &arcq, NULL)) != SQLITE_OK) {
+			nxerr(sqlite3_errmsg(dbptr));
+		} 
+		sqlite3_bind_int64(arcq, 1, from);
+		sqlite3_bind_int64(arcq, 2, to);
+		while ((retc == SQLITE_OK) && (sqlite3_step(arcq) == SQLITE_ROW)) {
+			if (++attached > ARCHIVE_MAX) {
+				nxwrn("Too many archives in range, the oldest years are left out");
+				break;
+			}
+			path = archpath(dbptr, (const char *)sqlite3_column_text(arcq, 1));
+			sql = sqlite3_mprintf("ATTACH %Q AS \"arc%lld\";", path, sqlite3_column_int64(arcq, 0));
+			if ((retc = sqlite3_exec(dbptr, sql, NULL, NULL, NULL)) != SQLITE_OK) {
+				nxerr(sqlite3_errmsg(dbptr));
+			}
+			sqlite3_free(sql);
+			sqlite3_free(path);
+		}
+		sqlite3_finalize(arcq);
+	}
+	if (retc == SQLITE_OK) {
+		view = sqlite3_str_new(dbptr);
+		sqlite3_str_appendall(view, "DROP VIEW IF EXISTS temp.ledger; CREATE TEMP VIEW ledger AS");
+		archeach(dbptr, archview, view);
+		sqlite3_str_appendchar(view, 1, ';');
+		sql = sqlite3_str_finish(view);
+		if ((retc = sqlite3_exec(dbptr, sql, NULL, NULL, NULL)) != SQLITE_OK) {
+			nxerr(sqlite3_errmsg(dbptr));
+		}
+		sqlite3_free(sql);
+	}
+	if (dbg) {
+		nxexit();
+	}
+	return(retc);
+}
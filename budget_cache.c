@@ -0,0 +1,434 @@
+/*
+ * Copyright (c) 2019, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* 
+ * Report result cache.
+ * Results are stored keyed on the normalized command line, and every entry is tagged
+ * with the ledger generation it was computed at. ledger_gen is bumped by triggers on
+ * every write to the tables reports read from, so a write anywhere invalidates the
+ * whole cache without anyone having to remember to clear it. 
+ * The cache lives in its own file rather than a table, so serving a hit never writes
+ * to the database and never touches transactions.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifndef __EXILE_BUDGET_H
+#include "budget.h"
+#endif
+#ifndef __EXILE_BUDGET_SUBS_H
+#include "budget_subc.h"
+#endif
+#ifndef __EXILE_BUDGET_CACHE_H
+#include "budget_cache.h"
+#endif
+
+extern char *__progname;
+extern bool dbg;
+
+FILE *rptout = NULL;
+
+/* The capture rptout points at while a report is being cached, and how much it may hold */
+static FILE *rptcap = NULL;
+static char *rptres = NULL;
+static size_t rptlen = 0;
+static size_t rptmax = 0;
+
+#define CACHE_DATAOFF (((sizeof(cachehdr)) + 63) & ~((size_t)63))
+
+static int cachelock(rcache *cache, short type);
+static uint64_t cachehash(const char *key, size_t len);
+static void cachereset(rcache *cache);
+static char *cachepath(sqlite3 *dbptr);
+static int cachepair(const void *a, const void *b);
+
+static int
+cachelock(rcache *cache, short type) {
+	struct flock lk;
+
+	memset(&lk, 0, sizeof(lk));
+	lk.l_type = type;
+	lk.l_whence = SEEK_SET;
+	/* l_len of 0 covers the whole file */
+	return(fcntl(cache->fd, F_SETLKW, &lk));
+}
+
+static uint64_t
+cachehash(const char *key, size_t len) {
+	uint64_t hash;
+	size_t i;
+	hash = 0xcbf29ce484222325ULL;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (uint8_t)key[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return(hash);
+}
+
+static void
+cachereset(rcache *cache) {
+	cache->hdr->used = 0;
+	cache->hdr->nent = 0;
+	cache->hdr->gen = cache->gen;
+}
+
+static char *
+cachepath(sqlite3 *dbptr) {
+	const char *dbfile;
+
+	if (((dbfile = sqlite3_db_filename(dbptr, "main")) == NULL) || (*dbfile == '\0')) {
+		return(NULL);
+	}
+	return(sqlite3_mprintf("%s.cache", dbfile));
+}
+
+/* 
+ * Map the cache for the given database. A nonzero return just means there's no cache
+ * to be had, most likely a database from before ledger_gen existed, and isn't an error
+ */
+int
+cacheopen(sqlite3 *dbptr, rcache *cache) {
+	int retc;
+	struct stat st;
+	char *path;
+	sqlite3_stmt *genq;
+	retc = -1;
+	genq = NULL;
+	memset(cache, 0, sizeof(rcache));
+	cache->fd = -1;
+
+	if ((sqlite3_prepare_v2(dbptr, "SELECT gen FROM main.ledger_gen;", -1, &genq, NULL) == SQLITE_OK) && (sqlite3_step(genq) == SQLITE_ROW)) {
+		cache->gen = sqlite3_column_int64(genq, 0);
+		retc = 0;
+	}
+	sqlite3_finalize(genq);
+	if (retc != 0) {
+		if (dbg) { nxdbg("No ledger_gen table, report caching is disabled"); }
+		return(retc);
+	}
+	if ((path = cachepath(dbptr)) == NULL) {
+		return(-1);
+	}
+	cache->size = CACHE_DATAOFF + CACHE_DATA;
+	if ((cache->fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR)) < 0) {
+		nxerr(strerror(errno));
+		retc = -1;
+	}
+	sqlite3_free(path);
+	/* a fresh or foreign file gets sized and stamped under the write lock */
+	if ((retc == 0) && ((cachelock(cache, F_WRLCK) != 0) || (fstat(cache->fd, &st) != 0))) {
+		nxerr(strerror(errno));
+		retc = -1;
+	}
+	if ((retc == 0) && ((size_t)st.st_size != cache->size) && (ftruncate(cache->fd, (off_t)cache->size) != 0)) {
+		nxerr(strerror(errno));
+		retc = -1;
+	}
+	if ((retc == 0) && ((cache->hdr = mmap(NULL, cache->size, PROT_READ|PROT_WRITE, MAP_SHARED, cache->fd, 0)) == MAP_FAILED)) {
+		nxerr(strerror(errno));
+		cache->hdr = NULL;
+		retc = -1;
+	}
+	if (retc == 0) {
+		cache->data = (uint8_t *)cache->hdr + CACHE_DATAOFF;
+		if ((memcmp(cache->hdr->magic, CACHE_MAGIC, sizeof(cache->hdr->magic)) != 0) || (cache->hdr->nent > CACHE_SLOTS) || (cache->hdr->used > CACHE_DATA)) {
+			memset(cache->hdr, 0, sizeof(cachehdr));
+			memcpy(cache->hdr->magic, CACHE_MAGIC, sizeof(cache->hdr->magic));
+			cachereset(cache);
+		}
+	}
+	if (cache->fd >= 0) {
+		cachelock(cache, F_UNLCK);
+	}
+	if (retc != 0) {
+		cacheclose(cache);
+	}
+	return(retc);
+}
+
+void
+cacheclose(rcache *cache) {
+	if (cache->hdr != NULL) {
+		munmap(cache->hdr, cache->size);
+		cache->hdr = NULL;
+	}
+	if (cache->fd >= 0) {
+		close(cache->fd);
+		cache->fd = -1;
+	}
+}
+
+/* Drop every entry, for when a report's inputs changed somewhere ledger_gen can't see */
+void
+cacheinval(sqlite3 *dbptr) {
+	rcache cache;
+
+	if (cacheopen(dbptr, &cache) == 0) {
+		if (cachelock(&cache, F_WRLCK) == 0) {
+			cachereset(&cache);
+			cachelock(&cache, F_UNLCK);
+		}
+		cacheclose(&cache);
+	}
+}
+
+/* 
+ * Write a cached result to out, returns 1 on a hit.
+ * Entries from an older generation are never served, whatever their key
+ */
+int
+cacheget(rcache *cache, const char *key, size_t keylen, FILE *out) {
+	uint64_t hash, i;
+	cacheent *ent;
+	int hit;
+	hit = 0;
+
+	if ((cache->hdr == NULL) || (cachelock(cache, F_RDLCK) != 0)) {
+		return(0);
+	}
+	hash = cachehash(key, keylen);
+	for (i = 0; (cache->hdr->gen == cache->gen) && (i < cache->hdr->nent); i++) {
+		ent = &cache->hdr->ent[i];
+		if ((ent->hash == hash) && (ent->keylen == keylen) && (memcmp(cache->data + ent->off, key, keylen) == 0)) {
+			fwrite(cache->data + ent->off + keylen, 1, (size_t)ent->len, out);
+			ent->hits++;
+			hit = 1;
+			break;
+		}
+	}
+	if (hit) {
+		cache->hdr->hits++;
+	} else {
+		cache->hdr->misses++;
+	}
+	cachelock(cache, F_UNLCK);
+	return(hit);
+}
+
+/* 
+ * Store a result, dropping the oldest entries until it fits.
+ * Entries are appended in order, so the oldest ones are always at the front of both arrays
+ */
+int
+cacheput(rcache *cache, const char *key, size_t keylen, const char *result, size_t len) {
+	uint64_t drop, shift, i;
+	cacheent *ent;
+
+	if ((cache->hdr == NULL) || ((keylen + len) > CACHE_ENTMAX) || (cachelock(cache, F_WRLCK) != 0)) {
+		return(-1);
+	}
+	if (cache->hdr->gen != cache->gen) {
+		cachereset(cache);
+	}
+	for (drop = 0; (drop < cache->hdr->nent) 
+			&& (((cache->hdr->nent - drop) >= CACHE_SLOTS) || ((cache->hdr->used - cache->hdr->ent[drop].off) + keylen + len > CACHE_DATA)); drop++) {}
+	if (drop > 0) {
+		shift = (drop < cache->hdr->nent) ? cache->hdr->ent[drop].off : cache->hdr->used;
+		memmove(cache->data, cache->data + shift, (size_t)(cache->hdr->used - shift));
+		memmove(cache->hdr->ent, cache->hdr->ent + drop, (size_t)(cache->hdr->nent - drop) * sizeof(cacheent));
+		cache->hdr->nent -= drop;
+		cache->hdr->used -= shift;
+		cache->hdr->evictions += drop;
+		for (i = 0; i < cache->hdr->nent; i++) {
+			cache->hdr->ent[i].off -= shift;
+		}
+	}
+	ent = &cache->hdr->ent[cache->hdr->nent];
+	ent->hash = cachehash(key, keylen);
+	ent->off = cache->hdr->used;
+	ent->keylen = keylen;
+	ent->len = len;
+	ent->hits = 0;
+	memcpy(cache->data + ent->off, key, keylen);
+	memcpy(cache->data + ent->off + keylen, result, len);
+	cache->hdr->used += keylen + len;
+	cache->hdr->nent++;
+	cachelock(cache, F_UNLCK);
+	return(0);
+}
+
+/* flag/value pairs sort on the flag, everything else keeps its order */
+struct cacheopt {
+	const char *flag;
+	const char *val;
+};
+
+static int
+cachepair(const void *a, const void *b) {
+	return(strcmp(((const struct cacheopt *)a)->flag, ((const struct cacheopt *)b)->flag));
+}
+
+/* 
+ * Build the lookup key for a command, flags are sorted so the same report asked for
+ * with its options in a different order still hits. Fields are separated by NUL bytes,
+ * scope goes in front to keep apart the same report rendered in different ways
+ */
+char *
+cachekey(const char *scope, char **argstr, size_t *len) {
+	size_t argc, npair, i;
+	struct cacheopt *pairs;
+	char *key;
+	sqlite3_str *buf;
+	npair = 0;
+
+	for (argc = 0; argstr[argc] != NULL; argc++) {}
+	if ((pairs = calloc(argc + 1, sizeof(struct cacheopt))) == NULL) {
+		return(NULL);
+	}
+	buf = sqlite3_str_new(NULL);
+	sqlite3_str_append(buf, scope, (int)strlen(scope) + 1);
+	sqlite3_str_append(buf, argstr[0], (int)strlen(argstr[0]) + 1);
+	/* positional arguments first, in order */
+	for (i = 1; i < argc; i++) {
+		if ((argstr[i][0] == '-') && (argstr[i][1] != '\0') && ((i + 1) < argc)) {
+			pairs[npair].flag = argstr[i++];
+			pairs[npair++].val = argstr[i];
+		} else {
+			sqlite3_str_append(buf, argstr[i], (int)strlen(argstr[i]) + 1);
+		}
+	}
+	/* then the sorted flags, each followed by its value */
+	qsort(pairs, npair, sizeof(struct cacheopt), cachepair);
+	for (i = 0; i < npair; i++) {
+		sqlite3_str_append(buf, pairs[i].flag, (int)strlen(pairs[i].flag) + 1);
+		sqlite3_str_append(buf, pairs[i].val, (int)strlen(pairs[i].val) + 1);
+	}
+	*len = (size_t)sqlite3_str_length(buf);
+	key = sqlite3_str_finish(buf);
+	free(pairs);
+	return(key);
+}
+
+/* Point rptout at a memory stream until rptrelease(), holding at most limit bytes */
+int
+rptcapture(size_t limit) {
+	if ((rptcap = open_memstream(&rptres, &rptlen)) == NULL) {
+		return(-1);
+	}
+	rptmax = limit;
+	rptout = rptcap;
+	return(0);
+}
+
+/* 
+ * Called with each chunk of report output written to sink, returns where the rest should go.
+ * A capture that's outgrown what the cache will take is written out and replaced by stdout
+ */
+FILE *
+rptspill(FILE *sink) {
+	if ((sink == NULL) || (sink != rptcap) || (fflush(rptcap) != 0) || (rptlen <= rptmax)) {
+		return(sink);
+	}
+	fclose(rptcap);
+	fwrite(rptres, 1, rptlen, stdout);
+	free(rptres);
+	rptcap = NULL;
+	rptres = NULL;
+	rptlen = 0;
+	rptout = stdout;
+	return(stdout);
+}
+
+/* End the capture, returning what it holds, or NULL if it spilled and there's nothing to keep */
+char *
+rptrelease(size_t *len) {
+	char *res;
+
+	if (rptcap != NULL) {
+		fclose(rptcap);
+	}
+	res = rptres;
+	*len = rptlen;
+	rptcap = NULL;
+	rptres = NULL;
+	rptlen = 0;
+	rptout = stdout;
+	return(res);
+}
+
+/* 
+ * cache stats | clear
+ */
+int
+cachecmd(char **argstr, sqlite3 *dbptr) {
+	int retc;
+	uint64_t i, bytes;
+	rcache cache;
+	retc = 0;
+
+	if ((argstr == NULL) || (*argstr == NULL)) {
+		nxerr("Expected either 'stats' or 'clear'");
+		return(-1);
+	}
+	if (cacheopen(dbptr, &cache) != 0) {
+		nxerr("This database has no report cache");
+		return(-1);
+	}
+	if (strcmp(*argstr, "stats") == 0) {
+		cachelock(&cache, F_RDLCK);
+		bytes = 0;
+		for (i = 0; (cache.hdr->gen == cache.gen) && (i < cache.hdr->nent); i++) {
+			bytes += cache.hdr->ent[i].keylen + cache.hdr->ent[i].len;
+		}
+		fprintf(stdout, "entries\t%llu\nbytes\t%llu\nlimit\t%llu\nhits\t%llu\nmisses\t%llu\nevictions\t%llu\nhitrate\t%.1f%%\nvalid\t%s\n",
+				(unsigned long long)((cache.hdr->gen == cache.gen) ? cache.hdr->nent : 0), (unsigned long long)bytes,
+				(unsigned long long)CACHE_DATA, (unsigned long long)cache.hdr->hits, (unsigned long long)cache.hdr->misses,
+				(unsigned long long)cache.hdr->evictions,
+				((cache.hdr->hits + cache.hdr->misses) > 0) ? (100.0 * (double)cache.hdr->hits) / (double)(cache.hdr->hits + cache.hdr->misses) : 0.0,
+				(cache.hdr->gen == cache.gen) ? "yes" : "no, the ledger changed since");
+		cachelock(&cache, F_UNLCK);
+	} else if (strcmp(*argstr, "clear") == 0) {
+		cachelock(&cache, F_WRLCK);
+		cachereset(&cache);
+		cache.hdr->hits = cache.hdr->misses = cache.hdr->evictions = 0;
+		cachelock(&cache, F_UNLCK);
+	} else {
+		fprintf(stderr, "ERR: %s [%s:%u] %s: Unknown cache command %s\n", __progname, __FILE__, __LINE__, __func__, *argstr);
+		retc = -1;
+	}
+	cacheclose(&cache);
+	return(retc);
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2019, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* 
+ * Declarations for the report result cache, kept in a mmap(2)'d file next to the database
+ */
+#define __EXILE_BUDGET_CACHE_H
+
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CACHE_MAGIC "BDGCACH1"
+/* Most results that will be kept at once */
+#ifndef CACHE_SLOTS
+#define CACHE_SLOTS 128
+#endif
+/* Bytes available for keys and results, the file never grows past this */
+#ifndef CACHE_DATA
+#define CACHE_DATA (4 * 1024 * 1024)
+#endif
+/* Anything bigger than this isn't worth evicting everything else for */
+#define CACHE_ENTMAX (CACHE_DATA / 4)
+
+typedef struct __cacheent {
+	uint64_t hash;
+	uint64_t off; /* key then result, from the start of the data area */
+	uint64_t keylen;
+	uint64_t len;
+	uint64_t hits;
+} cacheent;
+
+typedef struct __cachehdr {
+	char magic[8];
+	int64_t gen; /* ledger generation all of the entries were computed at */
+	/* hits are counted under a shared lock, so they're approximate */
+	uint64_t hits, misses, evictions;
+	uint64_t used; /* bytes of the data area in use */
+	uint64_t nent;
+	cacheent ent[CACHE_SLOTS];
+} cachehdr;
+
+typedef struct __rcache {
+	int fd;
+	int64_t gen; /* current generation of the database */
+	cachehdr *hdr;
+	uint8_t *data;
+	size_t size;
+} rcache;
+
+/* Report output goes through this, it's swapped for a memory stream while a result is being cached */
+extern FILE *rptout;
+
+int cacheopen(sqlite3 *dbptr, rcache *cache);
+int cacheget(rcache *cache, const char *key, size_t keylen, FILE *out);
+int cacheput(rcache *cache, const char *key, size_t keylen, const char *result, size_t len);
+void cacheclose(rcache *cache);
+void cacheinval(sqlite3 *dbptr);
+char *cachekey(const char *scope, char **argstr, size_t *len);
+int cachecmd(char **argstr, sqlite3 *dbptr);
+int rptcapture(size_t limit);
+FILE *rptspill(FILE *sink);
+char *rptrelease(size_t *len);
@@ -0,0 +1,629 @@
+/*
+ * Copyright (c) 2019, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* 
+ * Hash chain over the ledger.
+ * A trigger queues every new transaction in chain_pending, which keeps working no matter what
+ * wrote the row, and the queue is folded into the chain by whoever commits next. Each link is
+ * a digest, using the configured hashspec, of the previous link and the row's content. Every
+ * CHAIN_CKPT links, and after every clean verification, the head of the chain is signed with an
+ * HMAC keyed from a file kept beside the database rather than in it.
+ * Verification trusts the newest checkpoint with a good signature and only rechecks the links
+ * after it. Links are checked against the stored hash of the one before, so the work splits
+ * into independent ranges, one per thread. Full verification starts from nothing instead.
+ * The category isn't part of what's hashed, duplicate merging legitimately rewrites it.
+ * Sealed rows can't be rehashed without the vault key, their boxes are authenticated on
+ * their own, so the chain only checks they're still there.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#ifndef __EXILE_BUDGET_H
+#include "budget.h"
+#endif
+#ifndef __EXILE_BUDGETCONF_H
+#include "budgetconf.h"
+#endif
+#ifndef __EXILE_BUDGET_ARCHIVE_H
+#include "budget_archive.h"
+#endif
+#ifndef __EXILE_BUDGET_SPOOL_H
+#include "budget_spool.h"
+#endif
+#ifndef __EXILE_BUDGET_CHAIN_H
+#include "budget_chain.h"
+#endif
+
+extern char *__progname;
+extern bool dbg;
+
+/* Verification of one range of links, on its own connection */
+typedef struct __chainthr {
+	pthread_t thread;
+	const char *path;
+	const EVP_MD *md;
+	int64_t lo, hi; /* links (lo, hi] */
+	unsigned char prev[EVP_MAX_MD_SIZE];
+	bool haveprev; /* otherwise the link at lo is looked up */
+	bool started;
+	uint64_t rows, bad, sealed;
+	int retc;
+} chainthr;
+
+/* One archived year, opened on its own so there's no limit on how many can be searched */
+typedef struct __chainarc {
+	sqlite3 *conn;
+	sqlite3_stmt *rowq;
+} chainarc;
+
+/* Kept in step with budget.sql, for databases made before these existed */
+static const char chainschema[] = 
+	"CREATE TABLE IF NOT EXISTS main.chain_spec (name text NOT NULL);"
+	"CREATE TABLE IF NOT EXISTS main.chain_pending (seq integer PRIMARY KEY, tid varchar(64) NOT NULL);"
+	"CREATE TABLE IF NOT EXISTS main.chain (seq integer PRIMARY KEY, tid varchar(64) UNIQUE NOT NULL, hash blob NOT NULL);"
+	"CREATE TABLE IF NOT EXISTS main.chain_ckpt (seq integer PRIMARY KEY, hash blob NOT NULL, mac blob NOT NULL, made integer);";
+/* Only run when the trigger is new, anything already in the ledger gets queued in insert order */
+static const char chaintrigger[] = 
+	"CREATE TRIGGER main.chain_trans_ins AFTER INSERT ON transactions BEGIN INSERT INTO chain_pending (tid) VALUES (new.tid); END;"
+	"INSERT INTO main.chain_pending (tid) SELECT tid FROM main.transactions AS tx "
+	"WHERE NOT EXISTS (SELECT 1 FROM main.chain AS c WHERE c.tid = tx.tid) ORDER BY rowid;";
+static const char chainqueue[] = 
+	"SELECT p.tid, tx.year, tx.month, tx.day, tx.type, CAST(round(tx.amount * 100) AS INTEGER), tx.desc "
+	"FROM main.chain_pending AS p JOIN main.transactions AS tx ON tx.tid = p.tid "
+	"WHERE NOT EXISTS (SELECT 1 FROM main.chain AS c WHERE c.tid = p.tid) ORDER BY p.seq;";
+static const char chainrange[] = 
+	"SELECT c.tid, tx.year, tx.month, tx.day, tx.type, CAST(round(tx.amount * 100) AS INTEGER), tx.desc, c.hash, c.seq "
+	"FROM main.chain AS c LEFT JOIN main.transactions AS tx ON tx.tid = c.tid WHERE c.seq > ?1 AND c.seq <= ?2 ORDER BY c.seq;";
+/* rows moved out by archive are still in the chain, each archive file is searched in turn */
+static const char chainarchived[] = 
+	"SELECT tid, year, month, day, type, CAST(round(amount * 100) AS INTEGER), desc FROM main.transactions WHERE tid = ?1;";
+static const char chainsealed[] = 
+	"SELECT 1 FROM main.vault WHERE tid = ?1;";
+
+static const EVP_MD *chainmd(sqlite3 *dbptr);
+static int chainkey(sqlite3 *dbptr, unsigned char *key, bool create);
+static void chainmac(const EVP_MD *md, const unsigned char *key, int64_t seq, const unsigned char *hash, int len, unsigned char *mac, unsigned int *maclen);
+static int chaindigest(EVP_MD_CTX *ctx, const EVP_MD *md, const unsigned char *prev, sqlite3_stmt *row, unsigned char *out);
+static size_t chainarcopen(sqlite3 *conn, chainarc **arcs);
+static void chainarcfree(chainarc *arcs, size_t narc);
+static int chainseal(sqlite3 *dbptr, const EVP_MD *md, int64_t seq, const unsigned char *hash);
+static void *chainworker(void *arg);
+
+static const EVP_MD *
+chainmd(sqlite3 *dbptr) {
+	const EVP_MD *md;
+	sqlite3_stmt *specq;
+	md = NULL;
+	specq = NULL;
+
+	if (sqlite3_prepare_v2(dbptr, "SELECT name FROM main.chain_spec LIMIT 1;", -1, &specq, NULL) == SQLITE_OK) {
+		if ((sqlite3_step(specq) == SQLITE_ROW) && ((md = EVP_get_digestbyname((const char *)sqlite3_column_text(specq, 0))) == NULL)) {
+			fprintf(stderr, "ERR: %s [%s:%u] %s: The chain's hash %s isn't available\n", __progname, __FILE__, __LINE__, __func__, (const char *)sqlite3_column_text(specq, 0));
+		}
+	}
+	sqlite3_finalize(specq);
+	return(md);
+}
+
+/* 
+ * The checkpoint key lives in <db>.chainkey, it's only ever made for a chain without
+ * checkpoints, so losing it can't quietly replace the key the old ones were signed with
+ */
+static int
+chainkey(sqlite3 *dbptr, unsigned char *key, bool create) {
+	int fd, retc;
+	const char *dbfile;
+	char *path;
+	retc = -1;
+
+	if (((dbfile = sqlite3_db_filename(dbptr, "main")) == NULL) || (*dbfile == '\0') || ((path = sqlite3_mprintf("%s.chainkey", dbfile)) == NULL)) {
+		return(-1);
+	}
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) >= 0) {
+		retc = (read(fd, key, CHAIN_KEYLEN) == CHAIN_KEYLEN) ? 0 : -1;
+		close(fd);
+	} else if (create && (errno == ENOENT) && ((fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, S_IRUSR|S_IWUSR)) >= 0)) {
+		arc4random_buf(key, CHAIN_KEYLEN);
+		if ((write(fd, key, CHAIN_KEYLEN) == CHAIN_KEYLEN) && (fsync(fd) == 0)) {
+			retc = 0;
+		} else {
+			nxerr(strerror(errno));
+			unlink(path);
+		}
+		close(fd);
+	}
+	sqlite3_free(path);
+	return(retc);
+}
+
+static void
+chainmac(const EVP_MD *md, const unsigned char *key, int64_t seq, const unsigned char *hash, int len, unsigned char *mac, unsigned int *maclen) {
+	unsigned char msg[8 + 8 + EVP_MAX_MD_SIZE];
+	int i;
+
+	memcpy(msg, "BDGCHAIN", 8);
+	for (i = 0; i < 8; i++) {
+		msg[8 + i] = (unsigned char)(((uint64_t)seq >> (i * 8)) & 0xFF);
+	}
+	memcpy(msg + 16, hash, (size_t)len);
+	HMAC(md, key, CHAIN_KEYLEN, msg, (size_t)(16 + len), mac, maclen);
+}
+
+/* 
+ * Link digest over the previous link and columns 0 - 6 of row: tid, year, month, day, type,
+ * amount in cents and description. Strings are length prefixed and integers little endian
+ */
+static int
+chaindigest(EVP_MD_CTX *ctx, const EVP_MD *md, const unsigned char *prev, sqlite3_stmt *row, unsigned char *out) {
+	unsigned char le[8];
+	uint64_t num;
+	int col, i;
+
+	if (EVP_DigestInit_ex(ctx, md, NULL) != 1) {
+		return(-1);
+	}
+	EVP_DigestUpdate(ctx, prev, (size_t)EVP_MD_size(md));
+	for (col = 0; col < 7; col++) {
+		if ((col == 0) || (col == 6)) {
+			num = (uint64_t)sqlite3_column_bytes(row, col);
+			for (i = 0; i < 4; i++) {
+				le[i] = (unsigned char)((num >> (i * 8)) & 0xFF);
+			}
+			EVP_DigestUpdate(ctx, le, 4);
+			EVP_DigestUpdate(ctx, sqlite3_column_text(row, col), (size_t)num);
+		} else {
+			num = (uint64_t)sqlite3_column_int64(row, col);
+			for (i = 0; i < 8; i++) {
+				le[i] = (unsigned char)((num >> (i * 8)) & 0xFF);
+			}
+			EVP_DigestUpdate(ctx, le, 8);
+		}
+	}
+	return((EVP_DigestFinal_ex(ctx, out, NULL) == 1) ? 0 : -1);
+}
+
+/* Sign the chain up to seq, has to be called inside a write transaction */
+static int
+chainseal(sqlite3 *dbptr, const EVP_MD *md, int64_t seq, const unsigned char *hash) {
+	int retc;
+	unsigned int maclen;
+	unsigned char key[CHAIN_KEYLEN], mac[EVP_MAX_MD_SIZE];
+	sqlite3_stmt *sealq;
+	sealq = NULL;
+
+	retc = sqlite3_prepare_v2(dbptr, "SELECT count(*) = 0 FROM main.chain_ckpt;", -1, &sealq, NULL);
+	if ((retc != SQLITE_OK) || (sqlite3_step(sealq) != SQLITE_ROW) || (chainkey(dbptr, key, (sqlite3_column_int(sealq, 0) != 0)) != 0)) {
+		nxwrn("No checkpoint key, the chain can't be checkpointed");
+		sqlite3_finalize(sealq);
+		return(-1);
+	}
+	sqlite3_finalize(sealq);
+	sealq = NULL;
+	chainmac(md, key, seq, hash, EVP_MD_size(md), mac, &maclen);
+	explicit_bzero(key, sizeof(key));
+	if ((retc = sqlite3_prepare_v2(dbptr, "INSERT OR REPLACE INTO main.chain_ckpt VALUES (?1, ?2, ?3, strftime('%s', 'now'));", -1, &sealq, NULL)) == SQLITE_OK) {
+		sqlite3_bind_int64(sealq, 1, seq);
+		sqlite3_bind_blob(sealq, 2, hash, EVP_MD_size(md), SQLITE_STATIC);
+		sqlite3_bind_blob(sealq, 3, mac, (int)maclen, SQLITE_STATIC);
+		retc = (sqlite3_step(sealq) == SQLITE_DONE) ? SQLITE_OK : sqlite3_errcode(dbptr);
+	}
+	if (retc != SQLITE_OK) {
+		nxerr(sqlite3_errmsg(dbptr));
+	}
+	sqlite3_finalize(sealq);
+	return(retc);
+}
+
+int
+chaininit(sqlite3 *dbptr) {
+	int retc;
+	sqlite3_stmt *trigq;
+	trigq = NULL;
+
+	if ((retc = sqlite3_exec(dbptr, chainschema, NULL, NULL, NULL)) == SQLITE_OK) {
+		retc = sqlite3_prepare_v2(dbptr, "SELECT 1 FROM main.sqlite_master WHERE type = 'trigger' AND name = 'chain_trans_ins';", -1, &trigq, NULL);
+	}
+	if ((retc == SQLITE_OK) && (sqlite3_step(trigq) != SQLITE_ROW)) {
+		retc = sqlite3_exec(dbptr, chaintrigger, NULL, NULL, NULL);
+	}
+	sqlite3_finalize(trigq);
+	if (retc == SQLITE_OK) {
+		trigq = NULL;
+		if ((retc = sqlite3_prepare_v2(dbptr, "INSERT INTO main.chain_spec SELECT ?1 WHERE NOT EXISTS (SELECT 1 FROM main.chain_spec);", -1, &trigq, NULL)) == SQLITE_OK) {
+			sqlite3_bind_text(trigq, 1, hashname(DEFAULT_HASHSPEC), -1, SQLITE_STATIC);
+			retc = (sqlite3_step(trigq) == SQLITE_DONE) ? SQLITE_OK : sqlite3_errcode(dbptr);
+		}
+		sqlite3_finalize(trigq);
+	}
+	if (retc != SQLITE_OK) {
+		nxerr(sqlite3_errmsg(dbptr));
+	}
+	return(retc);
+}
+
+/* 
+ * Link everything waiting in chain_pending onto the chain, meant to be called just before
+ * a write transaction commits. If it fails the rows simply stay queued for the next one
+ */
+int
+chainextend(sqlite3 *dbptr) {
+	int retc;
+	int64_t seq, sealed;
+	uint64_t added;
+	const EVP_MD *md;
+	EVP_MD_CTX *ctx;
+	unsigned char prev[EVP_MAX_MD_SIZE];
+	sqlite3_stmt *headq, *queueq, *linkq;
+	headq = queueq = linkq = NULL;
+	seq = sealed = 0;
+	added = 0;
+	ctx = NULL;
+
+	if (((retc = chaininit(dbptr)) != SQLITE_OK) || ((md = chainmd(dbptr)) == NULL) || ((ctx = EVP_MD_CTX_new()) == NULL)) {
+		nxwrn("New transactions stay queued for the hash chain");
+		return(-1);
+	}
+	memset(prev, 0, sizeof(prev));
+	if ((retc = sqlite3_prepare_v2(dbptr, "SELECT (SELECT ifnull(max(seq), 0) FROM main.chain_ckpt), seq, hash FROM main.chain ORDER BY seq DESC LIMIT 1;", -1, &headq, NULL)) == SQLITE_OK
+			&& (sqlite3_step(headq) == SQLITE_ROW)) {
+		sealed = sqlite3_column_int64(headq, 0);
+		seq = sqlite3_column_int64(headq, 1);
+		memcpy(prev, sqlite3_column_blob(headq, 2), (size_t)((sqlite3_column_bytes(headq, 2) < EVP_MAX_MD_SIZE) ? sqlite3_column_bytes(headq, 2) : EVP_MAX_MD_SIZE));
+	}
+	if ((retc == SQLITE_OK) && (((retc = sqlite3_prepare_v2(dbptr, chainqueue, -1, &queueq, NULL)) != SQLITE_OK)
+				|| ((retc = sqlite3_prepare_v2(dbptr, "INSERT INTO main.chain (tid, hash) VALUES (?1, ?2);", -1, &linkq, NULL)) != SQLITE_OK))) {
+		nxerr(sqlite3_errmsg(dbptr));
+	}
+	while ((retc == SQLITE_OK) && (sqlite3_step(queueq) == SQLITE_ROW)) {
+		if (chaindigest(ctx, md, prev, queueq, prev) != 0) {
+			retc = -1;
+			break;
+		}
+		sqlite3_bind_text(linkq, 1, (const char *)sqlite3_column_text(queueq, 0), -1, SQLITE_TRANSIENT);
+		sqlite3_bind_blob(linkq, 2, prev, EVP_MD_size(md), SQLITE_STATIC);
+		if ((retc = sqlite3_step(linkq)) == SQLITE_DONE) {
+			retc = SQLITE_OK;
+			seq = sqlite3_last_insert_rowid(dbptr);
+			added++;
+		}
+		sqlite3_reset(linkq);
+		if ((retc == SQLITE_OK) && ((seq - sealed) >= CHAIN_CKPT) && (chainseal(dbptr, md, seq, prev) == SQLITE_OK)) {
+			sealed = seq;
+		}
+	}
+	if (retc == SQLITE_OK) {
+		retc = sqlite3_exec(dbptr, "DELETE FROM main.chain_pending;", NULL, NULL, NULL);
+	}
+	if (retc != SQLITE_OK) {
+		nxwrn("New transactions stay queued for the hash chain");
+	} else if (dbg) {
+		fprintf(stderr, "DBG: %s [%s:%u] %s: %llu rows chained, head is now %lld\n", __progname, __FILE__, __LINE__, __func__, (unsigned long long)added, (long long)seq);
+	}
+	EVP_MD_CTX_free(ctx);
+	sqlite3_finalize(headq);
+	sqlite3_finalize(queueq);
+	sqlite3_finalize(linkq);
+	return(retc);
+}
+
+/* 
+ * Open every archive in the registry, newest first, returning how many are usable.
+ * Attaching would stop at ARCHIVE_MAX and leave the oldest years out
+ */
+static size_t
+chainarcopen(sqlite3 *conn, chainarc **arcs) {
+	size_t narc, cap;
+	char *path;
+	chainarc *grow;
+	sqlite3_stmt *arcq;
+	narc = cap = 0;
+	arcq = NULL;
+	*arcs = NULL;
+
+	if ((sqlite3_table_column_metadata(conn, "main", "archives", "path", NULL, NULL, NULL, NULL, NULL) != SQLITE_OK)
+			|| (sqlite3_prepare_v2(conn, "SELECT path FROM main.archives ORDER BY year DESC;", -1, &arcq, NULL) != SQLITE_OK)) {
+		sqlite3_finalize(arcq);
+		return(0);
+	}
+	while (sqlite3_step(arcq) == SQLITE_ROW) {
+		if (narc == cap) {
+			cap = (cap > 0) ? cap * 2 : 16;
+			if ((grow = realloc(*arcs, cap * sizeof(chainarc))) == NULL) {
+				nxerr(strerror(errno));
+				break;
+			}
+			*arcs = grow;
+		}
+		memset(&(*arcs)[narc], 0, sizeof(chainarc));
+		if ((path = archpath(conn, (const char *)sqlite3_column_text(arcq, 0))) == NULL) {
+			continue;
+		}
+		/* a missing archive just means its links show up as missing rows */
+		if ((sqlite3_open_v2(path, &(*arcs)[narc].conn, SQLITE_OPEN_READONLY|SQLITE_OPEN_NOMUTEX, NULL) == SQLITE_OK)
+				&& (sqlite3_busy_handler((*arcs)[narc].conn, busywait, NULL) == SQLITE_OK)
+				&& (sqlite3_prepare_v2((*arcs)[narc].conn, chainarchived, -1, &(*arcs)[narc].rowq, NULL) == SQLITE_OK)) {
+			narc++;
+		} else {
+			fprintf(stderr, "WRN: %s [%s:%u] %s: Can't search archive %s: %s\n", __progname, __FILE__, __LINE__, __func__, path, sqlite3_errmsg((*arcs)[narc].conn));
+			sqlite3_close((*arcs)[narc].conn);
+		}
+		sqlite3_free(path);
+	}
+	sqlite3_finalize(arcq);
+	return(narc);
+}
+
+static void
+chainarcfree(chainarc *arcs, size_t narc) {
+	size_t i;
+
+	for (i = 0; i < narc; i++) {
+		sqlite3_finalize(arcs[i].rowq);
+		sqlite3_close(arcs[i].conn);
+	}
+	free(arcs);
+}
+
+/* Check the links in one range, each against the stored link before it */
+static void *
+chainworker(void *arg) {
+	int len;
+	bool opened;
+	size_t narc, i;
+	unsigned char link[EVP_MAX_MD_SIZE];
+	chainthr *thr;
+	chainarc *arcs;
+	EVP_MD_CTX *ctx;
+	sqlite3 *conn;
+	sqlite3_stmt *rangeq, *vaultq, *row;
+	thr = arg;
+	conn = NULL;
+	rangeq = vaultq = NULL;
+	arcs = NULL;
+	narc = 0;
+	opened = false;
+	len = EVP_MD_size(thr->md);
+
+	if ((ctx = EVP_MD_CTX_new()) == NULL) {
+		thr->retc = -1;
+		return(NULL);
+	}
+	if (((thr->retc = sqlite3_open_v2(thr->path, &conn, SQLITE_OPEN_READONLY|SQLITE_OPEN_NOMUTEX, NULL)) != SQLITE_OK)
+			|| (sqlite3_busy_handler(conn, busywait, NULL) != SQLITE_OK)
+			|| ((thr->retc = sqlite3_prepare_v2(conn, chainrange, -1, &rangeq, NULL)) != SQLITE_OK)) {
+		fprintf(stderr, "ERR: %s [%s:%u] %s: %s\n", __progname, __FILE__, __LINE__, __func__, sqlite3_errmsg(conn));
+	}
+	if ((thr->retc == SQLITE_OK) && !thr->haveprev) {
+		memset(thr->prev, 0, sizeof(thr->prev));
+		sqlite3_bind_int64(rangeq, 1, thr->lo - 1);
+		sqlite3_bind_int64(rangeq, 2, thr->lo);
+		if (sqlite3_step(rangeq) == SQLITE_ROW) {
+			memcpy(thr->prev, sqlite3_column_blob(rangeq, 7), (size_t)((sqlite3_column_bytes(rangeq, 7) < len) ? sqlite3_column_bytes(rangeq, 7) : len));
+		}
+		sqlite3_reset(rangeq);
+	}
+	if (thr->retc == SQLITE_OK) {
+		sqlite3_bind_int64(rangeq, 1, thr->lo);
+		sqlite3_bind_int64(rangeq, 2, thr->hi);
+	}
+	while ((thr->retc == SQLITE_OK) && (sqlite3_step(rangeq) == SQLITE_ROW)) {
+		thr->rows++;
+		row = rangeq;
+		if (sqlite3_column_type(rangeq, 1) == SQLITE_NULL) {
+			/* only worth opening the archives once something turns out to be missing */
+			if (!opened) {
+				opened = true;
+				narc = chainarcopen(conn, &arcs);
+				if (sqlite3_prepare_v2(conn, chainsealed, -1, &vaultq, NULL) != SQLITE_OK) {
+					vaultq = NULL;
+				}
+			}
+			row = NULL;
+			for (i = 0; (row == NULL) && (i < narc); i++) {
+				sqlite3_reset(arcs[i].rowq);
+				sqlite3_bind_text(arcs[i].rowq, 1, (const char *)sqlite3_column_text(rangeq, 0), -1, SQLITE_TRANSIENT);
+				row = (sqlite3_step(arcs[i].rowq) == SQLITE_ROW) ? arcs[i].rowq : NULL;
+			}
+			if ((row == NULL) && (vaultq != NULL)) {
+				sqlite3_reset(vaultq);
+				sqlite3_bind_text(vaultq, 1, (const char *)sqlite3_column_text(rangeq, 0), -1, SQLITE_TRANSIENT);
+				if (sqlite3_step(vaultq) == SQLITE_ROW) {
+					thr->sealed++;
+					memcpy(thr->prev, sqlite3_column_blob(rangeq, 7), (size_t)((sqlite3_column_bytes(rangeq, 7) < len) ? sqlite3_column_bytes(rangeq, 7) : len));
+					continue;
+				}
+			}
+		}
+		if ((row != NULL) && (chaindigest(ctx, thr->md, thr->prev, row, link) != 0)) {
+			thr->retc = -1;
+			break;
+		}
+		if ((row == NULL) || (sqlite3_column_bytes(rangeq, 7) != len) || (memcmp(link, sqlite3_column_blob(rangeq, 7), (size_t)len) != 0)) {
+			if (thr->bad++ < CHAIN_REPORT) {
+				fprintf(stderr, "ERR: %s [%s:%u] %s: Link %lld (tid %s) %s\n", __progname, __FILE__, __LINE__, __func__,
+						(long long)sqlite3_column_int64(rangeq, 8), (const char *)sqlite3_column_text(rangeq, 0),
+						(row == NULL) ? "points at a transaction that no longer exists" : "doesn't match the transaction");
+			}
+		}
+		memcpy(thr->prev, sqlite3_column_blob(rangeq, 7), (size_t)((sqlite3_column_bytes(rangeq, 7) < len) ? sqlite3_column_bytes(rangeq, 7) : len));
+	}
+	EVP_MD_CTX_free(ctx);
+	chainarcfree(arcs, narc);
+	sqlite3_finalize(vaultq);
+	sqlite3_finalize(rangeq);
+	sqlite3_close(conn);
+	return(NULL);
+}
+
+/* 
+ * Verify the chain from the newest good checkpoint, or all of it when full is set,
+ * then checkpoint the head if everything checked out
+ */
+int
+chainverify(sqlite3 *dbptr, bool full) {
+	int retc, len;
+	int64_t from, last, span;
+	long cpus;
+	size_t nthr, i;
+	uint64_t rows, bad, sealed;
+	unsigned int maclen;
+	bool havekey;
+	const EVP_MD *md;
+	unsigned char key[CHAIN_KEYLEN], mac[EVP_MAX_MD_SIZE], prev[EVP_MAX_MD_SIZE];
+	chainthr *thr;
+	sqlite3_stmt *ckptq;
+	from = last = 0;
+	rows = bad = sealed = 0;
+	thr = NULL;
+	ckptq = NULL;
+	memset(prev, 0, sizeof(prev));
+
+	if (dbg) {
+		nxentr();
+	}
+	/* bring the chain up to date first, a read-only database just gets what's already linked */
+	if ((sqlite3_exec(dbptr, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK) || (chainextend(dbptr) != SQLITE_OK)
+			|| (sqlite3_exec(dbptr, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)) {
+		nxwrn("Couldn't link new transactions, only verifying what's already on the chain");
+		sqlite3_exec(dbptr, "ROLLBACK;", NULL, NULL, NULL);
+	}
+	if ((md = chainmd(dbptr)) == NULL) {
+		nxerr("No hash chain in this database");
+		return(-1);
+	}
+	len = EVP_MD_size(md);
+	if (!(havekey = (chainkey(dbptr, key, false) == 0))) {
+		nxwrn("No checkpoint key, verifying the whole chain");
+	}
+
+	/* newest first, incremental checking stops at the first checkpoint that holds up */
+	retc = sqlite3_prepare_v2(dbptr, "SELECT k.seq, k.hash, k.mac, c.hash FROM main.chain_ckpt AS k LEFT JOIN main.chain AS c ON c.seq = k.seq ORDER BY k.seq DESC;", -1, &ckptq, NULL);
+	while (havekey && (retc == SQLITE_OK) && (sqlite3_step(ckptq) == SQLITE_ROW)) {
+		chainmac(md, key, sqlite3_column_int64(ckptq, 0), sqlite3_column_blob(ckptq, 1), len, mac, &maclen);
+		if ((sqlite3_column_bytes(ckptq, 1) != len) || (sqlite3_column_bytes(ckptq, 2) != (int)maclen) || (sqlite3_column_bytes(ckptq, 3) != len)
+				|| (memcmp(mac, sqlite3_column_blob(ckptq, 2), maclen) != 0) || (memcmp(sqlite3_column_blob(ckptq, 1), sqlite3_column_blob(ckptq, 3), (size_t)len) != 0)) {
+			if (bad++ < CHAIN_REPORT) {
+				fprintf(stderr, "ERR: %s [%s:%u] %s: Checkpoint at link %lld doesn't hold up\n", __progname, __FILE__, __LINE__, __func__, (long long)sqlite3_column_int64(ckptq, 0));
+			}
+		} else if (!full) {
+			from = sqlite3_column_int64(ckptq, 0);
+			memcpy(prev, sqlite3_column_blob(ckptq, 1), (size_t)len);
+			break;
+		}
+	}
+	sqlite3_finalize(ckptq);
+	explicit_bzero(key, sizeof(key));
+	ckptq = NULL;
+	if ((retc == SQLITE_OK) && ((retc = sqlite3_prepare_v2(dbptr, "SELECT ifnull(max(seq), 0) FROM main.chain;", -1, &ckptq, NULL)) == SQLITE_OK)
+			&& (sqlite3_step(ckptq) == SQLITE_ROW)) {
+		last = sqlite3_column_int64(ckptq, 0);
+	}
+	sqlite3_finalize(ckptq);
+
+	/* split what's left into ranges, a thread each */
+	span = (last > from) ? last - from : 0;
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nthr = (size_t)(span / CHAIN_MINRANGE);
+	nthr = (nthr > (size_t)((cpus > 0) ? cpus : 1)) ? (size_t)((cpus > 0) ? cpus : 1) : nthr;
+	nthr = (nthr > CHAIN_THREADS) ? CHAIN_THREADS : ((nthr < 1) ? 1 : nthr);
+	if ((retc == SQLITE_OK) && (span > 0) && ((thr = calloc(nthr, sizeof(chainthr))) == NULL)) {
+		nxerr(strerror(errno));
+		retc = -1;
+	}
+	for (i = 0; (retc == SQLITE_OK) && (span > 0) && (i < nthr); i++) {
+		thr[i].path = sqlite3_db_filename(dbptr, "main");
+		thr[i].md = md;
+		thr[i].lo = from + ((span * (int64_t)i) / (int64_t)nthr);
+		thr[i].hi = from + ((span * (int64_t)(i + 1)) / (int64_t)nthr);
+		/* the first range starts from the checkpoint, or from nothing */
+		if ((thr[i].haveprev = (i == 0))) {
+			memcpy(thr[i].prev, prev, sizeof(prev));
+		}
+		if ((i > 0) && !(thr[i].started = (pthread_create(&thr[i].thread, NULL, chainworker, &thr[i]) == 0))) {
+			chainworker(&thr[i]);
+		}
+	}
+	if ((retc == SQLITE_OK) && (span > 0)) {
+		chainworker(&thr[0]);
+	}
+	for (i = 0; (thr != NULL) && (i < nthr); i++) {
+		if (thr[i].started) {
+			pthread_join(thr[i].thread, NULL);
+		}
+		retc = (thr[i].retc != SQLITE_OK) ? -1 : retc;
+		rows += thr[i].rows;
+		bad += thr[i].bad;
+		sealed += thr[i].sealed;
+	}
+	free(thr);
+
+	if ((retc == SQLITE_OK) && (bad == 0)) {
+		fprintf(stdout, "Hash chain intact, %llu links verified %s (%s)\n", (unsigned long long)rows, (from > 0) ? "since the last checkpoint" : "from the start", EVP_MD_name(md));
+		if (sealed > 0) {
+			fprintf(stdout, "%llu of them are sealed in the vault and were only checked for presence\n", (unsigned long long)sealed);
+		}
+		if ((last > from) && (sqlite3_exec(dbptr, "BEGIN IMMEDIATE;", NULL, NULL, NULL) == SQLITE_OK)) {
+			if ((sqlite3_prepare_v2(dbptr, "SELECT hash FROM main.chain WHERE seq = ?1;", -1, &ckptq, NULL) == SQLITE_OK)) {
+				sqlite3_bind_int64(ckptq, 1, last);
+				if ((sqlite3_step(ckptq) == SQLITE_ROW) && (sqlite3_column_bytes(ckptq, 0) == len)) {
+					memcpy(prev, sqlite3_column_blob(ckptq, 0), (size_t)len);
+					chainseal(dbptr, md, last, prev);
+				}
+			}
+			sqlite3_finalize(ckptq);
+			sqlite3_exec(dbptr, "COMMIT;", NULL, NULL, NULL);
+		}
+	} else if (retc == SQLITE_OK) {
+		fprintf(stdout, "Hash chain broken, %llu problems found in %llu links\n", (unsigned long long)bad, (unsigned long long)rows);
+		retc = -1;
+	}
+	if (dbg) {
+		nxexit();
+	}
+	return(retc);
+}
@@ -0,0 +1,478 @@
+/*
+ * Copyright (c) 2019, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* 
+ * Statement import with duplicate detection.
+ * Every transaction carries a fingerprint of its date, type, amount and normalized description
+ * in the indexed fprint column. Before importing, the existing fingerprints are loaded into
+ * a Bloom filter so the usual case, a row that isn't in the ledger yet, never touches the
+ * database at all. Only filter hits go on to the exact lookup through the index.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+
+#ifndef __EXILE_BUDGET_H
+#include "budget.h"
+#endif
+#ifndef __EXILE_BUDGET_SUBS_H
+#include "budget_subc.h"
+#endif
+#ifndef __EXILE_BUDGET_STMT_H
+#include "budget_stmt.h"
+#endif
+#ifndef __EXILE_BUDGET_CHAIN_H
+#include "budget_chain.h"
+#endif
+#ifndef __EXILE_BUDGET_ARCHIVE_H
+#include "budget_archive.h"
+#endif
+#ifndef __EXILE_BUDGET_IMPORT_H
+#include "budget_import.h"
+#endif
+
+extern char *__progname;
+extern bool dbg;
+
+/* The queries import runs over main and each attached archive, built up by impunion() */
+typedef struct __impparts {
+	sqlite3_str *count, *load, *confirm;
+} impparts;
+
+static uint64_t fpmix(uint64_t key);
+static void sqlfprint(sqlite3_context *ctx, int argc, sqlite3_value **argv);
+static int impunion(const char *schema, void *arg);
+
+/* Amounts in the ledger are unsigned, the statement's sign only picks the type */
+static const char impinsert[] = 
+	"INSERT INTO main.transactions (tid, year, month, day, type, amount, category, desc, fprint, dupof) "
+	"VALUES (?1, ?2, ?3, ?4, ?5, ?6, (SELECT key FROM main.xcats WHERE cat = upper(?7)), ?8, ?9, ?10);";
+/* Only rows that were there before the import started count as originals */
+static const char impconfirm[] = 
+	"SELECT tid, 'main' FROM main.transactions WHERE fprint = ?1 AND rowid <= ?2 "
+	"AND year = ?3 AND month = ?4 AND day = ?5 AND type = ?7 AND CAST(round(amount * 100) AS INTEGER) = ?6";
+/* 
+ * migrate never touches the archives, so their stored fingerprints may be missing or predate
+ * the type being hashed. They're computed afresh instead, for the archived years in range only
+ */
+static const char imparchived[] = 
+	"SELECT tid, %Q FROM \"%w\".transactions WHERE year = ?3 AND month = ?4 AND day = ?5 AND type = ?7 "
+	"AND CAST(round(amount * 100) AS INTEGER) = ?6 AND fprint(year, month, day, type, amount, desc) = ?1";
+/* Categories were checked before the import started, the schema is wherever the original was found */
+static const char impmerge[] = 
+	"UPDATE \"%w\".transactions SET category = (SELECT key FROM main.xcats WHERE cat = upper(?2)) WHERE tid = ?1;";
+
+/* splitmix64 finalizer, spreads the FNV state out over all 64 bits */
+static uint64_t
+fpmix(uint64_t key) {
+	key ^= key >> 30;
+	key *= 0xbf58476d1ce4e5b9ULL;
+	key ^= key >> 27;
+	key *= 0x94d049bb133111ebULL;
+	key ^= key >> 31;
+	return(key);
+}
+
+/* 
+ * Descriptions are lowercased and every run of anything that isn't a letter
+ * or digit counts as a single space, so "ACME  CO." and "Acme Co" match.
+ * Amounts are unsigned in the ledger, the type is what tells a refund from the purchase
+ */
+uint64_t
+fingerprint(int year, int month, int day, int type, int64_t cents, const char *desc, size_t len) {
+	uint64_t hash;
+	size_t i;
+	bool gap, text;
+	unsigned char c;
+	hash = 0xcbf29ce484222325ULL;
+	gap = text = false;
+
+#define FNV(byte) do { hash ^= (uint64_t)(byte); hash *= 0x100000001b3ULL; } while (0)
+	FNV(year & 0xFF); FNV((year >> 8) & 0xFF);
+	FNV(month); FNV(day);
+	FNV(type & 0xFF);
+	cents = (cents < 0) ? -cents : cents;
+	for (i = 0; i < sizeof(cents); i++) {
+		FNV(((uint64_t)cents >> (i * 8)) & 0xFF);
+	}
+	for (i = 0; (desc != NULL) && (i < len); i++) {
+		c = (unsigned char)desc[i];
+		if ((c >= 'A') && (c <= 'Z')) {
+			c = (unsigned char)(c - 'A' + 'a');
+		}
+		if (((c >= 'a') && (c <= 'z')) || ((c >= '0') && (c <= '9'))) {
+			if (gap) { FNV(' '); }
+			FNV(c);
+			gap = false;
+			text = true;
+		} else {
+			/* leading and trailing separators never turn into a space */
+			gap = text;
+		}
+	}
+#undef FNV
+	return(fpmix(hash));
+}
+
+/* fprint(year, month, day, type, amount, desc), used to backfill rows that predate the column */
+static void
+sqlfprint(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+	double amount;
+
+	(void)argc;
+	amount = sqlite3_value_double(argv[4]);
+	amount = (amount < 0) ? -amount : amount;
+	sqlite3_result_int64(ctx, (sqlite3_int64)fingerprint(sqlite3_value_int(argv[0]), sqlite3_value_int(argv[1]), sqlite3_value_int(argv[2]),
+				sqlite3_value_int(argv[3]), (int64_t)((amount * 100.0) + 0.5), (const char *)sqlite3_value_text(argv[5]), (size_t)sqlite3_value_bytes(argv[5])));
+}
+
+/* Register fprint() on the connection */
+int
+fprintfunc(sqlite3 *dbptr) {
+	return(sqlite3_create_function(dbptr, "fprint", 6, SQLITE_UTF8|SQLITE_DETERMINISTIC, NULL, sqlfprint, NULL, NULL));
+}
+
+static int
+impunion(const char *schema, void *arg) {
+	impparts *parts;
+	parts = arg;
+
+	if (strcmp(schema, "main") == 0) {
+		sqlite3_str_appendall(parts->count, "SELECT count(*) AS n FROM main.transactions");
+		sqlite3_str_appendall(parts->load, "SELECT fprint FROM main.transactions WHERE fprint NOT NULL");
+		sqlite3_str_appendall(parts->confirm, impconfirm);
+	} else {
+		sqlite3_str_appendf(parts->count, " UNION ALL SELECT count(*) FROM \"%w\".transactions", schema);
+		sqlite3_str_appendf(parts->load, " UNION ALL SELECT fprint(year, month, day, type, amount, desc) FROM \"%w\".transactions", schema);
+		sqlite3_str_appendall(parts->confirm, " UNION ALL ");
+		sqlite3_str_appendf(parts->confirm, imparchived, schema, schema);
+	}
+	return(0);
+}
+
+int
+bloominit(bloom *filter, uint64_t count) {
+	uint64_t nbits;
+
+	for (nbits = BLOOM_MINBITS; nbits < (count * BLOOM_BITS); nbits <<= 1) {}
+	filter->mask = nbits - 1;
+	if ((filter->bits = calloc((size_t)(nbits / 64), sizeof(uint64_t))) == NULL) {
+		nxerr(strerror(errno));
+		return(-1);
+	}
+	return(0);
+}
+
+/* Probes are derived from the one fingerprint by double hashing, no rehashing of the row */
+void
+bloomadd(bloom *filter, uint64_t key) {
+	uint64_t h2, bit;
+	int i;
+
+	h2 = fpmix(key) | 1;
+	for (i = 0; i < BLOOM_PROBES; i++) {
+		bit = (key + ((uint64_t)i * h2)) & filter->mask;
+		filter->bits[bit >> 6] |= (1ULL << (bit & 63));
+	}
+}
+
+int
+bloomhas(const bloom *filter, uint64_t key) {
+	uint64_t h2, bit;
+	int i;
+
+	h2 = fpmix(key) | 1;
+	for (i = 0; i < BLOOM_PROBES; i++) {
+		bit = (key + ((uint64_t)i * h2)) & filter->mask;
+		if ((filter->bits[bit >> 6] & (1ULL << (bit & 63))) == 0) {
+			return(0);
+		}
+	}
+	return(1);
+}
+
+void
+bloomfree(bloom *filter) {
+	free(filter->bits);
+	filter->bits = NULL;
+}
+
+/* 
+ * import [-p skip|flag|merge] statement
+ * The statement is read in first so its years and categories are known before anything is
+ * written, then the whole of it goes in as a single transaction
+ */
+int
+import(char **argstr, sqlite3 *dbptr) {
+	int retc, loyear, hiyear;
+	int64_t start;
+	uint64_t fp, nread, added, dups, hits;
+	size_t nrows, caprows, i;
+	duppolicy policy;
+	const char *path;
+	char tid[TID_LEN], orig[TID_LEN], origdb[64];
+	char *sql;
+	bool isdup;
+	bloom filter;
+	stmtfile stmt;
+	stmtrow *row, *rows, *grow;
+	impparts parts;
+	sqlite3_stmt *loadq, *insq, *confq, *mergeq;
+	retc = 0;
+	start = 0;
+	nread = added = dups = hits = 0;
+	nrows = caprows = 0;
+	loyear = INT32_MAX;
+	hiyear = 0;
+	policy = dupskip;
+	path = NULL;
+	sql = NULL;
+	rows = NULL;
+	filter.bits = NULL;
+	loadq = insq = confq = mergeq = NULL;
+	memset(&stmt, 0, sizeof(stmt));
+	memset(&parts, 0, sizeof(parts));
+
+	if (dbg) {
+		nxentr();
+	}
+	for (; (argstr != NULL) && (*argstr != NULL) && (retc == 0); argstr++) {
+		if ((strcmp(*argstr, "-p") == 0) && (argstr[1] != NULL)) {
+			argstr++;
+			if (strcmp(*argstr, "skip") == 0) { policy = dupskip; }
+			else if (strcmp(*argstr, "flag") == 0) { policy = dupflag; }
+			else if (strcmp(*argstr, "merge") == 0) { policy = dupmerge; }
+			else {
+				fprintf(stderr, "ERR: %s [%s:%u] %s: Unknown duplicate policy %s\n", __progname, __FILE__, __LINE__, __func__, *argstr);
+				retc = -1;
+			}
+		} else {
+			path = *argstr;
+		}
+	}
+	if ((retc == 0) && (path == NULL)) {
+		nxerr("No statement file given");
+		retc = -1;
+	}
+	/* 
+	 * Fingerprints are filled in, and computed the way this build does, by migrate's batched
+	 * backfills. Doing it here would hold the write lock for a pass over the whole table
+	 */
+	if ((retc == 0) && (sqlite3_prepare_v2(dbptr, "PRAGMA main.user_version;", -1, &loadq, NULL) == SQLITE_OK) && (sqlite3_step(loadq) == SQLITE_ROW)
+			&& (sqlite3_column_int(loadq, 0) < BUDGET_SCHEMA)) {
+		fprintf(stderr, "ERR: %s [%s:%u] %s: Database schema is version %d, run '%s migrate' before importing\n",
+				__progname, __FILE__, __LINE__, __func__, sqlite3_column_int(loadq, 0), __progname);
+		retc = -1;
+	}
+	sqlite3_finalize(loadq);
+	loadq = NULL;
+
+	/* rows point into the statement's private mapping, so holding on to them costs little */
+	if ((retc == 0) && ((retc = stmtopen(path, &stmt)) == 0)
+			&& ((retc = sqlite3_prepare_v2(dbptr, "SELECT 1 FROM main.xcats WHERE cat = upper(?1);", -1, &loadq, NULL)) != SQLITE_OK)) {
+		nxerr(sqlite3_errmsg(dbptr));
+	}
+	while (retc == 0) {
+		if (nrows == caprows) {
+			caprows = (caprows > 0) ? caprows * 2 : 256;
+			if ((grow = realloc(rows, caprows * sizeof(stmtrow))) == NULL) {
+				nxerr(strerror(errno));
+				retc = -1;
+				break;
+			}
+			rows = grow;
+		}
+		if (stmtnext(&stmt, &rows[nrows]) != 1) {
+			break;
+		}
+		row = &rows[nrows++];
+		loyear = (row->year < loyear) ? row->year : loyear;
+		hiyear = (row->year > hiyear) ? row->year : hiyear;
+		/* an unknown category would go in as NULL, or be silently left alone by a merge */
+		if (row->catlen > 0) {
+			sqlite3_bind_text(loadq, 1, row->cat, (int)row->catlen, SQLITE_STATIC);
+			if (sqlite3_step(loadq) != SQLITE_ROW) {
+				fprintf(stderr, "ERR: %s [%s:%u] %s: No such category %.*s on line %zu\n", __progname, __FILE__, __LINE__, __func__,
+						(int)row->catlen, row->cat, row->line);
+				retc = -1;
+			}
+			sqlite3_reset(loadq);
+		}
+	}
+	sqlite3_finalize(loadq);
+	loadq = NULL;
+
+	/* re-importing a closed year has to find the originals in its archive */
+	if ((retc == 0) && (nrows > 0)) {
+		retc = archattach(dbptr, loyear, hiyear);
+	}
+	if ((retc == SQLITE_OK) && ((retc = fprintfunc(dbptr)) != SQLITE_OK)) {
+		nxerr(sqlite3_errmsg(dbptr));
+	}
+	if (retc == SQLITE_OK) {
+		parts.count = sqlite3_str_new(dbptr);
+		parts.load = sqlite3_str_new(dbptr);
+		parts.confirm = sqlite3_str_new(dbptr);
+		archeach(dbptr, impunion, &parts);
+	}
+	/* size the filter from the table, then fill it with a scan of the fingerprint index */
+	sql = (retc == SQLITE_OK) ? sqlite3_mprintf("SELECT sum(n), (SELECT ifnull(max(rowid), 0) FROM main.transactions) FROM (%s);", sqlite3_str_value(parts.count)) : NULL;
+	if ((retc == SQLITE_OK) && (sql != NULL) && (sqlite3_prepare_v2(dbptr, sql, -1, &loadq, NULL) == SQLITE_OK) && (sqlite3_step(loadq) == SQLITE_ROW)) {
+		retc = bloominit(&filter, (uint64_t)sqlite3_column_int64(loadq, 0));
+		start = sqlite3_column_int64(loadq, 1);
+	} else if (retc == SQLITE_OK) {
+		nxerr(sqlite3_errmsg(dbptr));
+		retc = -1;
+	}
+	sqlite3_finalize(loadq);
+	sqlite3_free(sql);
+	loadq = NULL;
+	sql = (retc == SQLITE_OK) ? sqlite3_mprintf("%s;", sqlite3_str_value(parts.load)) : NULL;
+	if ((retc == 0) && ((retc = sqlite3_prepare_v2(dbptr, sql, -1, &loadq, NULL)) != SQLITE_OK)) {
+		nxerr(sqlite3_errmsg(dbptr));
+	}
+	while ((retc == 0) && (sqlite3_step(loadq) == SQLITE_ROW)) {
+		bloomadd(&filter, (uint64_t)sqlite3_column_int64(loadq, 0));
+	}
+	sqlite3_finalize(loadq);
+	sqlite3_free(sql);
+	sql = (retc == SQLITE_OK) ? sqlite3_mprintf("%s LIMIT 1;", sqlite3_str_value(parts.confirm)) : NULL;
+
+	if ((retc == SQLITE_OK) && (((retc = sqlite3_prepare_v2(dbptr, impinsert, -1, &insq, NULL)) != SQLITE_OK)
+				|| ((retc = sqlite3_prepare_v2(dbptr, sql, -1, &confq, NULL)) != SQLITE_OK)
+				|| ((retc = sqlite3_exec(dbptr, "BEGIN IMMEDIATE;", NULL, NULL, NULL)) != SQLITE_OK))) {
+		nxerr(sqlite3_errmsg(dbptr));
+	}
+	sqlite3_free(sql);
+	for (i = 0; (retc == SQLITE_OK) && (i < nrows); i++) {
+		row = &rows[i];
+		nread++;
+		isdup = false;
+		fp = fingerprint(row->year, row->month, row->day, (row->cents < 0) ? expense : deposit, row->cents, row->desc, row->desclen);
+		if (bloomhas(&filter, fp)) {
+			hits++;
+			sqlite3_bind_int64(confq, 1, (sqlite3_int64)fp);
+			sqlite3_bind_int64(confq, 2, start);
+			sqlite3_bind_int(confq, 3, row->year);
+			sqlite3_bind_int(confq, 4, row->month);
+			sqlite3_bind_int(confq, 5, row->day);
+			sqlite3_bind_int64(confq, 6, (row->cents < 0) ? -row->cents : row->cents);
+			sqlite3_bind_int(confq, 7, (row->cents < 0) ? expense : deposit);
+			if ((isdup = (sqlite3_step(confq) == SQLITE_ROW))) {
+				snprintf(orig, sizeof(orig), "%s", (const char *)sqlite3_column_text(confq, 0));
+				snprintf(origdb, sizeof(origdb), "%s", (const char *)sqlite3_column_text(confq, 1));
+			}
+			sqlite3_reset(confq);
+		}
+		if (isdup) {
+			dups++;
+			if (dbg) {
+				fprintf(stderr, "DBG: %s [%s:%u] %s: Line %zu duplicates %s in %s\n", __progname, __FILE__, __LINE__, __func__, row->line, orig, origdb);
+			}
+			/* the original may sit in an archive, which is where its category gets updated */
+			if ((policy == dupmerge) && (row->catlen > 0)) {
+				sql = sqlite3_mprintf(impmerge, origdb);
+				if ((retc = sqlite3_prepare_v2(dbptr, sql, -1, &mergeq, NULL)) == SQLITE_OK) {
+					sqlite3_bind_text(mergeq, 1, orig, -1, SQLITE_STATIC);
+					sqlite3_bind_text(mergeq, 2, row->cat, (int)row->catlen, SQLITE_STATIC);
+					if ((retc = sqlite3_step(mergeq)) == SQLITE_DONE) {
+						retc = SQLITE_OK;
+					}
+				}
+				sqlite3_finalize(mergeq);
+				sqlite3_free(sql);
+				mergeq = NULL;
+			}
+			if (policy != dupflag) {
+				continue;
+			}
+		}
+		mktid(tid);
+		sqlite3_bind_text(insq, 1, tid, -1, SQLITE_STATIC);
+		sqlite3_bind_int(insq, 2, row->year);
+		sqlite3_bind_int(insq, 3, row->month);
+		sqlite3_bind_int(insq, 4, row->day);
+		sqlite3_bind_int(insq, 5, (row->cents < 0) ? expense : deposit);
+		sqlite3_bind_double(insq, 6, (double)((row->cents < 0) ? -row->cents : row->cents) / 100.0);
+		if (row->catlen > 0) {
+			sqlite3_bind_text(insq, 7, row->cat, (int)row->catlen, SQLITE_STATIC);
+		} else {
+			sqlite3_bind_null(insq, 7);
+		}
+		sqlite3_bind_text(insq, 8, row->desc, (int)row->desclen, SQLITE_STATIC);
+		sqlite3_bind_int64(insq, 9, (sqlite3_int64)fp);
+		if (isdup) {
+			sqlite3_bind_text(insq, 10, orig, -1, SQLITE_STATIC);
+		} else {
+			sqlite3_bind_null(insq, 10);
+		}
+		if ((retc = sqlite3_step(insq)) == SQLITE_DONE) {
+			retc = SQLITE_OK;
+			added++;
+		}
+		sqlite3_reset(insq);
+	}
+	/* not being able to chain isn't fatal, the rows stay queued for the next commit */
+	if (retc == SQLITE_OK) {
+		chainextend(dbptr);
+	}
+	if (retc != SQLITE_OK) {
+		if (retc > 0) {
+			nxerr(sqlite3_errmsg(dbptr));
+		}
+		sqlite3_exec(dbptr, "ROLLBACK;", NULL, NULL, NULL);
+	} else if ((retc = sqlite3_exec(dbptr, "COMMIT;", NULL, NULL, NULL)) != SQLITE_OK) {
+		nxerr(sqlite3_errmsg(dbptr));
+	} else {
+		fprintf(stdout, "%llu read, %llu imported, %llu duplicates (%llu filter hits)\n", (unsigned long long)nread,
+				(unsigned long long)added, (unsigned long long)dups, (unsigned long long)hits);
+	}
+	sqlite3_finalize(insq);
+	sqlite3_finalize(confq);
+	sqlite3_free(sqlite3_str_finish(parts.count));
+	sqlite3_free(sqlite3_str_finish(parts.load));
+	sqlite3_free(sqlite3_str_finish(parts.confirm));
+	bloomfree(&filter);
+	free(rows);
+	stmtclose(&stmt);
+	if (dbg) {
+		nxexit();
+	}
+	return(retc);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2019, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* 
+ * Declarations for importing statements and the duplicate detection around it
+ */
+#define __EXILE_BUDGET_IMPORT_H
+
+#include <sqlite3.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bits per expected fingerprint and probes per lookup, about a 1% false positive rate */
+#define BLOOM_BITS 10
+#define BLOOM_PROBES 7
+#ifndef BLOOM_MINBITS
+#define BLOOM_MINBITS 65536
+#endif
+
+typedef enum __duppolicy {
+	dupskip = 0, /* leave duplicates out */
+	dupflag = 1, /* insert them anyway, with dupof pointing at the original */
+	dupmerge = 2 /* fill in the category of the original from the statement */
+} duppolicy;
+
+typedef struct __bloom {
+	uint64_t *bits;
+	uint64_t mask; /* bit count - 1, the size is always a power of two */
+} bloom;
+
+int import(char **argstr, sqlite3 *dbptr);
+int fprintfunc(sqlite3 *dbptr);
+uint64_t fingerprint(int year, int month, int day, int type, int64_t cents, const char *desc, size_t len);
+int bloominit(bloom *filter, uint64_t count);
+void bloomadd(bloom *filter, uint64_t key);
+int bloomhas(const bloom *filter, uint64_t key);
+void bloomfree(bloom *filter);
@@ -0,0 +1,578 @@
+/*
+ * Copyright (c) 2019, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* 
+ * Schema migrations.
+ * Every migration the binary knows about is listed in migrations[] below, in order, and
+ * PRAGMA user_version records how far a database has come. Adding columns and tables is
+ * cheap in SQLite, filling them in for every existing row isn't, so backfills walk the
+ * rows a rowid range at a time. Each range is its own short transaction, sized to take about
+ * MIGRATE_SLICE, with a pause after it so other writers get a turn. The walk's position is
+ * committed along with each range in schema_progress, so an interrupted or time-boxed run
+ * (-t) resumes where it stopped. A dry run (-n) does the schema changes and one sample batch
+ * in a transaction that's rolled back, and extrapolates from that.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef __EXILE_BUDGET_H
+#include "budget.h"
+#endif
+#ifndef __EXILE_BUDGET_SUBS_H
+#include "budget_subc.h"
+#endif
+#ifndef __EXILE_BUDGET_IMPORT_H
+#include "budget_import.h"
+#endif
+#ifndef __EXILE_BUDGET_STATS_H
+#include "budget_stats.h"
+#endif
+#ifndef __EXILE_BUDGET_CHAIN_H
+#include "budget_chain.h"
+#endif
+#ifndef __EXILE_BUDGET_MIGRATE_H
+#include "budget_migrate.h"
+#endif
+
+extern char *__progname;
+extern bool dbg;
+
+static const char migprogress[] = 
+	"CREATE TABLE IF NOT EXISTS main.schema_progress (version integer PRIMARY KEY, cursor integer NOT NULL, target integer NOT NULL);";
+
+/* 
+ * 1: databases from before the schema was versioned, fingerprints and archives.
+ * Every row is fingerprinted the way version 4 wants, whatever was there before, so 4 is
+ * recorded as started with nothing to walk and only has to bump the version
+ */
+static const char mig1ddl[] = 
+	"CREATE TABLE IF NOT EXISTS main.archives (year integer PRIMARY KEY, path text NOT NULL, rows integer);"
+	"INSERT OR IGNORE INTO main.schema_progress VALUES (4, 0, 0);";
+static const char mig1fill[] = 
+	"UPDATE main.transactions SET fprint = fprint(year, month, day, type, amount, desc) WHERE rowid > ?1 AND rowid <= ?2;";
+/* index builds can't be split up, left until the column they cover is filled in */
+static const char mig1finish[] = 
+	"CREATE INDEX IF NOT EXISTS main.trans_by_date ON transactions (year,month,day);"
+	"CREATE INDEX IF NOT EXISTS main.trans_by_cat ON transactions (category,year,month);"
+	"CREATE INDEX IF NOT EXISTS main.trans_fprint ON transactions (fprint);";
+
+/* 
+ * 2: full-text index, filled a range at a time instead of budget.sql's single 'rebuild'.
+ * Removing a row the backfill hasn't reached yet from an external content index corrupts it,
+ * so until the walk is done the delete/update triggers leave those rows to the backfill
+ */
+static const char mig2ddl[] = 
+	"CREATE VIRTUAL TABLE IF NOT EXISTS main.trans_fts USING fts5(\"desc\", content='transactions', content_rowid='rowid', prefix='2 3');"
+	"CREATE TRIGGER IF NOT EXISTS main.trans_fts_ins AFTER INSERT ON transactions BEGIN "
+	"INSERT INTO trans_fts (rowid, \"desc\") VALUES (new.rowid, new.desc); END;"
+	"CREATE TRIGGER IF NOT EXISTS main.trans_fts_del AFTER DELETE ON transactions "
+	"WHEN NOT EXISTS (SELECT 1 FROM schema_progress WHERE version = 2 AND old.rowid > cursor AND old.rowid <= target) BEGIN "
+	"INSERT INTO trans_fts (trans_fts, rowid, \"desc\") VALUES ('delete', old.rowid, old.desc); END;"
+	"CREATE TRIGGER IF NOT EXISTS main.trans_fts_upd AFTER UPDATE OF desc ON transactions "
+	"WHEN NOT EXISTS (SELECT 1 FROM schema_progress WHERE version = 2 AND old.rowid > cursor AND old.rowid <= target) BEGIN "
+	"INSERT INTO trans_fts (trans_fts, rowid, \"desc\") VALUES ('delete', old.rowid, old.desc); "
+	"INSERT INTO trans_fts (rowid, \"desc\") VALUES (new.rowid, new.desc); END;";
+static const char mig2fill[] = 
+	"INSERT INTO main.trans_fts (rowid, \"desc\") SELECT rowid, desc FROM main.transactions WHERE rowid > ?1 AND rowid <= ?2;";
+/* with every row indexed the triggers go back to the plain ones budget.sql makes */
+static const char mig2finish[] = 
+	"DROP TRIGGER IF EXISTS main.trans_fts_del;"
+	"DROP TRIGGER IF EXISTS main.trans_fts_upd;"
+	"CREATE TRIGGER main.trans_fts_del AFTER DELETE ON transactions BEGIN "
+	"INSERT INTO trans_fts (trans_fts, rowid, \"desc\") VALUES ('delete', old.rowid, old.desc); END;"
+	"CREATE TRIGGER main.trans_fts_upd AFTER UPDATE OF desc ON transactions BEGIN "
+	"INSERT INTO trans_fts (trans_fts, rowid, \"desc\") VALUES ('delete', old.rowid, old.desc); "
+	"INSERT INTO trans_fts (rowid, \"desc\") VALUES (new.rowid, new.desc); END;";
+
+/* 3: report cache generation, hash chain and vault, stats comes from statsinit() */
+static const char mig3ddl[] = 
+	"CREATE TABLE IF NOT EXISTS main.ledger_gen (gen integer NOT NULL);"
+	"INSERT INTO main.ledger_gen SELECT 0 WHERE NOT EXISTS (SELECT 1 FROM main.ledger_gen);"
+	"CREATE TRIGGER IF NOT EXISTS main.gen_trans_ins AFTER INSERT ON transactions BEGIN UPDATE ledger_gen SET gen = gen + 1; END;"
+	"CREATE TRIGGER IF NOT EXISTS main.gen_trans_upd AFTER UPDATE ON transactions BEGIN UPDATE ledger_gen SET gen = gen + 1; END;"
+	"CREATE TRIGGER IF NOT EXISTS main.gen_trans_del AFTER DELETE ON transactions BEGIN UPDATE ledger_gen SET gen = gen + 1; END;"
+	"CREATE TRIGGER IF NOT EXISTS main.gen_cats_ins AFTER INSERT ON xcats BEGIN UPDATE ledger_gen SET gen = gen + 1; END;"
+	"CREATE TRIGGER IF NOT EXISTS main.gen_cats_upd AFTER UPDATE ON xcats BEGIN UPDATE ledger_gen SET gen = gen + 1; END;"
+	"CREATE TRIGGER IF NOT EXISTS main.gen_cats_del AFTER DELETE ON xcats BEGIN UPDATE ledger_gen SET gen = gen + 1; END;"
+	"CREATE TRIGGER IF NOT EXISTS main.gen_types_ins AFTER INSERT ON xtypes BEGIN UPDATE ledger_gen SET gen = gen + 1; END;"
+	"CREATE TRIGGER IF NOT EXISTS main.gen_types_upd AFTER UPDATE ON xtypes BEGIN UPDATE ledger_gen SET gen = gen + 1; END;"
+	"CREATE TRIGGER IF NOT EXISTS main.gen_types_del AFTER DELETE ON xtypes BEGIN UPDATE ledger_gen SET gen = gen + 1; END;"
+	"CREATE TABLE IF NOT EXISTS main.chain_spec (name text NOT NULL);"
+	"CREATE TABLE IF NOT EXISTS main.chain_pending (seq integer PRIMARY KEY, tid varchar(64) NOT NULL);"
+	"CREATE TABLE IF NOT EXISTS main.chain (seq integer PRIMARY KEY, tid varchar(64) UNIQUE NOT NULL, hash blob NOT NULL);"
+	"CREATE TABLE IF NOT EXISTS main.chain_ckpt (seq integer PRIMARY KEY, hash blob NOT NULL, mac blob NOT NULL, made integer);"
+	"CREATE TRIGGER IF NOT EXISTS main.chain_trans_ins AFTER INSERT ON transactions BEGIN INSERT INTO chain_pending (tid) VALUES (new.tid); END;"
+	"CREATE TABLE IF NOT EXISTS main.vault_meta (salt blob NOT NULL, rounds integer NOT NULL, spec text NOT NULL, verifier blob NOT NULL);"
+	"CREATE TABLE IF NOT EXISTS main.vault (tid varchar(64) PRIMARY KEY, type integer, mtok blob NOT NULL, ctok blob NOT NULL, abox blob NOT NULL, dbox blob NOT NULL);"
+	"CREATE INDEX IF NOT EXISTS main.vault_month ON vault (mtok, ctok, abox, tid);"
+	"CREATE INDEX IF NOT EXISTS main.vault_cat ON vault (ctok, mtok, abox, tid);";
+/* with the trigger already in place, chaininit() leaves queueing the existing rows to this */
+static const char mig3fill[] = 
+	"INSERT INTO main.chain_pending (tid) SELECT tid FROM main.transactions AS tx WHERE tx.rowid > ?1 AND tx.rowid <= ?2 "
+	"AND NOT EXISTS (SELECT 1 FROM main.chain AS c WHERE c.tid = tx.tid) "
+	"AND NOT EXISTS (SELECT 1 FROM main.chain_pending AS p WHERE p.tid = tx.tid) ORDER BY tx.rowid;";
+
+/* 4: fingerprints cover the type, so a refund isn't taken for a duplicate of the purchase, skipped after 1 */
+static const char mig4fill[] = 
+	"UPDATE main.transactions SET fprint = fprint(year, month, day, type, amount, desc) WHERE rowid > ?1 AND rowid <= ?2;";
+
+static int migcolumns(sqlite3 *dbptr, bool *walk);
+static int migfts(sqlite3 *dbptr, bool *walk);
+static int migderived(sqlite3 *dbptr, bool *walk);
+static int migfprint(sqlite3 *dbptr, int64_t lo, int64_t hi);
+static int migftsfill(sqlite3 *dbptr, int64_t lo, int64_t hi);
+static int migchain(sqlite3 *dbptr, int64_t lo, int64_t hi);
+static int migrefprint(sqlite3 *dbptr, int64_t lo, int64_t hi);
+static int migrange(sqlite3 *dbptr, const char *sql, int64_t lo, int64_t hi);
+static int64_t migms(void);
+static int migversion(sqlite3 *dbptr);
+static int migstart(sqlite3 *dbptr, const migration *mig, int64_t *cursor, int64_t *target);
+static int migbatch(sqlite3 *dbptr, const migration *mig, int64_t *cursor, int64_t target, int64_t limit, int64_t *rows);
+static int migfinish(sqlite3 *dbptr, const migration *mig);
+static int migestimate(sqlite3 *dbptr, int from);
+
+/* In order, the last one has to match BUDGET_SCHEMA */
+static const migration migrations[] = {
+	{ 1, "fingerprint columns and archives", migcolumns, mig1ddl, "transactions", migfprint, mig1finish },
+	{ 2, "full-text index", migfts, mig2ddl, "transactions", migftsfill, mig2finish },
+	{ 3, "report cache, stats, hash chain and vault tables", migderived, mig3ddl, "transactions", migchain, NULL },
+	{ 4, "fingerprints by type", NULL, NULL, "transactions", migrefprint, NULL },
+	{ 0, NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+/* ALTER TABLE ... ADD COLUMN only touches the schema, existing rows read the new column as NULL */
+static int
+migcolumns(sqlite3 *dbptr, bool *walk) {
+	int retc;
+	retc = SQLITE_OK;
+
+	*walk = true;
+	if (sqlite3_table_column_metadata(dbptr, "main", "transactions", "fprint", NULL, NULL, NULL, NULL, NULL) != SQLITE_OK) {
+		retc = sqlite3_exec(dbptr, "ALTER TABLE main.transactions ADD COLUMN fprint integer;", NULL, NULL, NULL);
+	}
+	if ((retc == SQLITE_OK) && (sqlite3_table_column_metadata(dbptr, "main", "transactions", "dupof", NULL, NULL, NULL, NULL, NULL) != SQLITE_OK)) {
+		retc = sqlite3_exec(dbptr, "ALTER TABLE main.transactions ADD COLUMN dupof varchar(64);", NULL, NULL, NULL);
+	}
+	return(retc);
+}
+
+/* An index that's already there was kept up to date by its triggers, only a new one needs filling */
+static int
+migfts(sqlite3 *dbptr, bool *walk) {
+	int retc;
+	sqlite3_stmt *ftsq;
+	ftsq = NULL;
+
+	if ((retc = sqlite3_prepare_v2(dbptr, "SELECT 1 FROM main.sqlite_master WHERE name = 'trans_fts';", -1, &ftsq, NULL)) == SQLITE_OK) {
+		*walk = (sqlite3_step(ftsq) != SQLITE_ROW);
+	}
+	sqlite3_finalize(ftsq);
+	return(retc);
+}
+
+static int
+migderived(sqlite3 *dbptr, bool *walk) {
+	*walk = true;
+	return(statsinit(dbptr));
+}
+
+static int
+migfprint(sqlite3 *dbptr, int64_t lo, int64_t hi) {
+	return(migrange(dbptr, mig1fill, lo, hi));
+}
+
+static int
+migftsfill(sqlite3 *dbptr, int64_t lo, int64_t hi) {
+	return(migrange(dbptr, mig2fill, lo, hi));
+}
+
+/* Queue the range, then link it, a batch is never more than the chain has to hash in one go */
+static int
+migchain(sqlite3 *dbptr, int64_t lo, int64_t hi) {
+	int retc;
+
+	if ((retc = migrange(dbptr, mig3fill, lo, hi)) == SQLITE_OK) {
+		/* failures leave the rows queued, which chainextend() already warns about */
+		chainextend(dbptr);
+	}
+	return(retc);
+}
+
+static int
+migrefprint(sqlite3 *dbptr, int64_t lo, int64_t hi) {
+	return(migrange(dbptr, mig4fill, lo, hi));
+}
+
+static int
+migrange(sqlite3 *dbptr, const char *sql, int64_t lo, int64_t hi) {
+	int retc;
+	sqlite3_stmt *fillq;
+	fillq = NULL;
+
+	if ((retc = sqlite3_prepare_v2(dbptr, sql, -1, &fillq, NULL)) == SQLITE_OK) {
+		sqlite3_bind_int64(fillq, 1, lo);
+		sqlite3_bind_int64(fillq, 2, hi);
+		retc = (sqlite3_step(fillq) == SQLITE_DONE) ? SQLITE_OK : sqlite3_errcode(dbptr);
+	}
+	sqlite3_finalize(fillq);
+	return(retc);
+}
+
+static int64_t
+migms(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return(((int64_t)now.tv_sec * 1000) + (now.tv_nsec / 1000000));
+}
+
+static int
+migversion(sqlite3 *dbptr) {
+	int version;
+	sqlite3_stmt *verq;
+	version = -1;
+	verq = NULL;
+
+	if ((sqlite3_prepare_v2(dbptr, "PRAGMA main.user_version;", -1, &verq, NULL) == SQLITE_OK) && (sqlite3_step(verq) == SQLITE_ROW)) {
+		version = sqlite3_column_int(verq, 0);
+	}
+	sqlite3_finalize(verq);
+	return(version);
+}
+
+/* 
+ * Pick up a migration that was already started, or make its schema changes and fix the
+ * range its backfill covers, in the caller's transaction
+ */
+static int
+migstart(sqlite3 *dbptr, const migration *mig, int64_t *cursor, int64_t *target) {
+	int retc;
+	bool walk;
+	char *sql;
+	sqlite3_stmt *progq;
+	progq = NULL;
+	sql = NULL;
+	walk = (mig->walk != NULL);
+	*cursor = *target = 0;
+
+	if (((retc = sqlite3_exec(dbptr, migprogress, NULL, NULL, NULL)) == SQLITE_OK)
+			&& ((retc = sqlite3_prepare_v2(dbptr, "SELECT cursor, target FROM main.schema_progress WHERE version = ?1;", -1, &progq, NULL)) == SQLITE_OK)) {
+		sqlite3_bind_int(progq, 1, mig->version);
+		if (sqlite3_step(progq) == SQLITE_ROW) {
+			*cursor = sqlite3_column_int64(progq, 0);
+			*target = sqlite3_column_int64(progq, 1);
+			sqlite3_finalize(progq);
+			return(SQLITE_OK);
+		}
+	}
+	sqlite3_finalize(progq);
+	progq = NULL;
+	if ((retc == SQLITE_OK) && (mig->prepare != NULL)) {
+		retc = mig->prepare(dbptr, &walk);
+	}
+	if ((retc == SQLITE_OK) && (mig->ddl != NULL)) {
+		retc = sqlite3_exec(dbptr, mig->ddl, NULL, NULL, NULL);
+	}
+	/* rows past this point arrive with the new schema's triggers in place */
+	if ((retc == SQLITE_OK) && walk && (mig->walk != NULL) && ((sql = sqlite3_mprintf("SELECT ifnull(max(rowid), 0) FROM main.\"%w\";", mig->walk)) != NULL)
+			&& ((retc = sqlite3_prepare_v2(dbptr, sql, -1, &progq, NULL)) == SQLITE_OK) && (sqlite3_step(progq) == SQLITE_ROW)) {
+		*target = sqlite3_column_int64(progq, 0);
+	}
+	sqlite3_finalize(progq);
+	sqlite3_free(sql);
+	progq = NULL;
+	if ((retc == SQLITE_OK) && ((retc = sqlite3_prepare_v2(dbptr, "INSERT INTO main.schema_progress VALUES (?1, 0, ?2);", -1, &progq, NULL)) == SQLITE_OK)) {
+		sqlite3_bind_int(progq, 1, mig->version);
+		sqlite3_bind_int64(progq, 2, *target);
+		retc = (sqlite3_step(progq) == SQLITE_DONE) ? SQLITE_OK : sqlite3_errcode(dbptr);
+	}
+	sqlite3_finalize(progq);
+	return(retc);
+}
+
+/* Backfill up to limit more rows and record how far it got, in the caller's transaction */
+static int
+migbatch(sqlite3 *dbptr, const migration *mig, int64_t *cursor, int64_t target, int64_t limit, int64_t *rows) {
+	int retc;
+	int64_t hi;
+	char *sql;
+	sqlite3_stmt *rangeq;
+	rangeq = NULL;
+	*rows = 0;
+	hi = target;
+
+	if ((mig->walk == NULL) || (*cursor >= target)) {
+		return(SQLITE_OK);
+	}
+	if (((sql = sqlite3_mprintf("SELECT max(rowid), count(*) FROM (SELECT rowid FROM main.\"%w\" WHERE rowid > ?1 AND rowid <= ?2 ORDER BY rowid LIMIT ?3);", mig->walk)) == NULL)
+			|| ((retc = sqlite3_prepare_v2(dbptr, sql, -1, &rangeq, NULL)) != SQLITE_OK)) {
+		sqlite3_free(sql);
+		return((sql == NULL) ? SQLITE_NOMEM : retc);
+	}
+	sqlite3_bind_int64(rangeq, 1, *cursor);
+	sqlite3_bind_int64(rangeq, 2, target);
+	sqlite3_bind_int64(rangeq, 3, limit);
+	if ((sqlite3_step(rangeq) == SQLITE_ROW) && ((*rows = sqlite3_column_int64(rangeq, 1)) > 0)) {
+		hi = sqlite3_column_int64(rangeq, 0);
+	}
+	sqlite3_finalize(rangeq);
+	sqlite3_free(sql);
+	rangeq = NULL;
+
+	/* nothing left in range means done, the cursor jumps straight to the target */
+	retc = (*rows > 0) ? mig->backfill(dbptr, *cursor, hi) : SQLITE_OK;
+	if ((retc == SQLITE_OK) && ((retc = sqlite3_prepare_v2(dbptr, "UPDATE main.schema_progress SET cursor = ?2 WHERE version = ?1;", -1, &rangeq, NULL)) == SQLITE_OK)) {
+		sqlite3_bind_int(rangeq, 1, mig->version);
+		sqlite3_bind_int64(rangeq, 2, hi);
+		retc = (sqlite3_step(rangeq) == SQLITE_DONE) ? SQLITE_OK : sqlite3_errcode(dbptr);
+	}
+	sqlite3_finalize(rangeq);
+	if (retc == SQLITE_OK) {
+		*cursor = hi;
+	}
+	return(retc);
+}
+
+static int
+migfinish(sqlite3 *dbptr, const migration *mig) {
+	int retc;
+	char *sql;
+	retc = SQLITE_OK;
+
+	if (mig->finish != NULL) {
+		retc = sqlite3_exec(dbptr, mig->finish, NULL, NULL, NULL);
+	}
+	if ((retc == SQLITE_OK) && ((sql = sqlite3_mprintf("PRAGMA main.user_version = %d; DELETE FROM main.schema_progress WHERE version = %d;", mig->version, mig->version)) != NULL)) {
+		retc = sqlite3_exec(dbptr, sql, NULL, NULL, NULL);
+		sqlite3_free(sql);
+	}
+	return(retc);
+}
+
+/* 
+ * Everything a real run would do up to the first batch of each migration, timed and then
+ * rolled back. The write lock is held for the schema changes and one batch per migration
+ */
+static int
+migestimate(sqlite3 *dbptr, int from) {
+	int retc;
+	int64_t cursor, target, rows, left, start, took, batches;
+	const migration *mig;
+	sqlite3_stmt *leftq;
+	char *sql;
+	leftq = NULL;
+
+	if ((retc = sqlite3_exec(dbptr, "BEGIN IMMEDIATE;", NULL, NULL, NULL)) != SQLITE_OK) {
+		nxerr(sqlite3_errmsg(dbptr));
+		return(retc);
+	}
+	for (mig = migrations; (retc == SQLITE_OK) && (mig->version > 0); mig++) {
+		if (mig->version <= from) {
+			continue;
+		}
+		left = rows = took = 0;
+		if ((retc = migstart(dbptr, mig, &cursor, &target)) != SQLITE_OK) {
+			break;
+		}
+		if ((mig->walk != NULL) && ((sql = sqlite3_mprintf("SELECT count(*) FROM main.\"%w\" WHERE rowid > ?1 AND rowid <= ?2;", mig->walk)) != NULL)) {
+			if ((retc = sqlite3_prepare_v2(dbptr, sql, -1, &leftq, NULL)) == SQLITE_OK) {
+				sqlite3_bind_int64(leftq, 1, cursor);
+				sqlite3_bind_int64(leftq, 2, target);
+				left = (sqlite3_step(leftq) == SQLITE_ROW) ? sqlite3_column_int64(leftq, 0) : 0;
+			}
+			sqlite3_finalize(leftq);
+			sqlite3_free(sql);
+			leftq = NULL;
+		}
+		start = migms();
+		if ((retc == SQLITE_OK) && ((retc = migbatch(dbptr, mig, &cursor, target, MIGRATE_BATCH, &rows)) == SQLITE_OK)) {
+			took = migms() - start;
+		}
+		if ((retc == SQLITE_OK) && (left == 0)) {
+			fprintf(stdout, "%d %s: schema changes only\n", mig->version, mig->name);
+		} else if (retc == SQLITE_OK) {
+			took = (took > 0) ? took : 1;
+			batches = (left * took) / ((int64_t)rows * MIGRATE_SLICE) + 1;
+			fprintf(stdout, "%d %s: %lld rows to backfill, about %lld batches and %.1fs (%lld rows sampled in %lldms)\n", mig->version, mig->name,
+					(long long)left, (long long)batches, (double)(((left * took) / rows) + (batches * MIGRATE_PAUSE)) / 1000.0, (long long)rows, (long long)took);
+		}
+		if ((retc == SQLITE_OK) && (mig->finish != NULL) && (strstr(mig->finish, "CREATE INDEX") != NULL)) {
+			fprintf(stdout, "%d %s: finishes with index builds, the one step that holds the write lock throughout\n", mig->version, mig->name);
+		}
+	}
+	if (retc != SQLITE_OK) {
+		nxerr(sqlite3_errmsg(dbptr));
+	}
+	sqlite3_exec(dbptr, "ROLLBACK;", NULL, NULL, NULL);
+	return(retc);
+}
+
+/* 
+ * migrate [-n] [-t seconds]
+ */
+int
+migrate(char **argstr, sqlite3 *dbptr) {
+	int retc, from;
+	long long budget;
+	int64_t cursor, target, rows, done, batch, start, began, took, deadline;
+	bool dry, paused;
+	const migration *mig;
+	retc = from = 0;
+	budget = 0;
+	dry = paused = false;
+
+	if (dbg) {
+		nxentr();
+	}
+	for (; (argstr != NULL) && (*argstr != NULL) && (retc == 0); argstr++) {
+		if (strcmp(*argstr, "-n") == 0) {
+			dry = true;
+		} else if ((strcmp(*argstr, "-t") == 0) && (argstr[1] != NULL)) {
+			retc = numarg(*++argstr, &budget);
+		} else {
+			fprintf(stderr, "ERR: %s [%s:%u] %s: Unexpected argument %s\n", __progname, __FILE__, __LINE__, __func__, *argstr);
+			retc = -1;
+		}
+	}
+	for (mig = migrations; mig[1].version > 0; mig++) {}
+	if ((retc == 0) && (mig->version != BUDGET_SCHEMA)) {
+		fprintf(stderr, "ERR: %s [%s:%u] %s: Migrations stop at version %d, this build expects %d\n", __progname, __FILE__, __LINE__, __func__, mig->version, BUDGET_SCHEMA);
+		retc = -1;
+	}
+	if ((retc == 0) && ((from = migversion(dbptr)) >= BUDGET_SCHEMA)) {
+		fprintf(stdout, "Schema is already at version %d\n", from);
+		if (dbg) { nxexit(); }
+		return(0);
+	}
+	/* the fingerprint backfill calls it from SQL */
+	if ((retc == 0) && ((retc = fprintfunc(dbptr)) != SQLITE_OK)) {
+		nxerr(sqlite3_errmsg(dbptr));
+	}
+	if ((retc == 0) && dry) {
+		retc = migestimate(dbptr, from);
+		if (dbg) { nxexit(); }
+		return(retc);
+	}
+
+	deadline = (budget > 0) ? migms() + (budget * 1000) : 0;
+	for (mig = migrations; (retc == 0) && (mig->version > 0); mig++) {
+		if (mig->version <= from) {
+			continue;
+		}
+		if ((deadline > 0) && (migms() >= deadline)) {
+			fprintf(stdout, "%d %s: not started, run migrate again to carry on\n", mig->version, mig->name);
+			break;
+		}
+		began = migms();
+		took = 0;
+		done = 0;
+		batch = MIGRATE_BATCH;
+		if ((retc = sqlite3_exec(dbptr, "BEGIN IMMEDIATE;", NULL, NULL, NULL)) != SQLITE_OK) {
+			nxerr(sqlite3_errmsg(dbptr));
+			break;
+		}
+		if (((retc = migstart(dbptr, mig, &cursor, &target)) != SQLITE_OK) || ((retc = sqlite3_exec(dbptr, "COMMIT;", NULL, NULL, NULL)) != SQLITE_OK)) {
+			nxerr(sqlite3_errmsg(dbptr));
+			sqlite3_exec(dbptr, "ROLLBACK;", NULL, NULL, NULL);
+			break;
+		}
+		/* 
+		 * Stop before a batch that would likely run past the deadline, judging by the last one.
+		 * The schema changes, index builds and the first batch can't be cut short
+		 */
+		while ((retc == SQLITE_OK) && (cursor < target)) {
+			if ((deadline > 0) && ((migms() + took) >= deadline)) {
+				paused = true;
+				break;
+			}
+			start = migms();
+			if ((retc = sqlite3_exec(dbptr, "BEGIN IMMEDIATE;", NULL, NULL, NULL)) != SQLITE_OK) {
+				nxerr(sqlite3_errmsg(dbptr));
+				break;
+			}
+			if (((retc = migbatch(dbptr, mig, &cursor, target, batch, &rows)) != SQLITE_OK)
+					|| ((retc = sqlite3_exec(dbptr, "COMMIT;", NULL, NULL, NULL)) != SQLITE_OK)) {
+				nxerr(sqlite3_errmsg(dbptr));
+				sqlite3_exec(dbptr, "ROLLBACK;", NULL, NULL, NULL);
+				break;
+			}
+			done += rows;
+			/* aim each transaction at MIGRATE_SLICE, whatever the rows cost */
+			took = migms() - start;
+			if ((took < (MIGRATE_SLICE / 2)) && (batch < MIGRATE_MAXBATCH)) {
+				batch *= 2;
+				took *= 2;
+			} else if ((took > MIGRATE_SLICE) && (batch > MIGRATE_MINBATCH)) {
+				batch /= 2;
+				took /= 2;
+			}
+			if (dbg) {
+				fprintf(stderr, "DBG: %s [%s:%u] %s: Version %d at row %lld of %lld, next batch %lld\n", __progname, __FILE__, __LINE__, __func__,
+						mig->version, (long long)cursor, (long long)target, (long long)batch);
+			}
+			if (cursor < target) {
+				usleep(MIGRATE_PAUSE * 1000);
+			}
+		}
+		if (retc != SQLITE_OK) {
+			break;
+		}
+		/* a finish step that builds indexes is better left to the next run than started late */
+		paused = paused || ((deadline > 0) && (mig->finish != NULL) && (migms() >= deadline));
+		if (paused) {
+			fprintf(stdout, "%d %s: paused at row %lld of %lld, run migrate again to carry on\n", mig->version, mig->name, (long long)cursor, (long long)target);
+			break;
+		}
+		/* the version only moves once the backfill is complete */
+		if (((retc = sqlite3_exec(dbptr, "BEGIN IMMEDIATE;", NULL, NULL, NULL)) != SQLITE_OK) || ((retc = migfinish(dbptr, mig)) != SQLITE_OK)
+				|| ((retc = sqlite3_exec(dbptr, "COMMIT;", NULL, NULL, NULL)) != SQLITE_OK)) {
+			nxerr(sqlite3_errmsg(dbptr));
+			sqlite3_exec(dbptr, "ROLLBACK;", NULL, NULL, NULL);
+			break;
+		}
+		fprintf(stdout, "%d %s: %lld rows backfilled in %.1fs\n", mig->version, mig->name, (long long)done, (double)(migms() - began) / 1000.0);
+	}
+	if (dbg) {
+		nxexit();
+	}
+	return(retc);
+}
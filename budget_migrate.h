@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2019, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* 
+ * Declarations for the schema migrations
+ */
+#define __EXILE_BUDGET_MIGRATE_H
+
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Rows in the first backfill batch, later ones are sized to take about MIGRATE_SLICE */
+#ifndef MIGRATE_BATCH
+#define MIGRATE_BATCH 1000
+#endif
+#define MIGRATE_MINBATCH 64
+#define MIGRATE_MAXBATCH 65536
+/* Milliseconds each backfill transaction aims for, and the gap left for other writers between them */
+#ifndef MIGRATE_SLICE
+#define MIGRATE_SLICE 50
+#endif
+#ifndef MIGRATE_PAUSE
+#define MIGRATE_PAUSE 20
+#endif
+
+/* 
+ * One step up in PRAGMA user_version.
+ * Schema changes run in a single short transaction first, then the rows of the walk table
+ * that existed at that point are handed to backfill a rowid range at a time, each range its
+ * own transaction. Rows added in the meantime are the new schema's triggers' problem.
+ * finish runs last, alongside the version bump. It holds the write lock for as long as it
+ * takes, so it's only for what SQLite can't do in pieces, like building an index, and
+ * for putting back anything the schema only needed while the backfill was running
+ */
+typedef struct __migration {
+	int version;
+	const char *name;
+	int (*prepare)(sqlite3 *dbptr, bool *walk); /* changes plain SQL can't express, may rule out the backfill */
+	const char *ddl;
+	const char *walk; /* table the backfill goes over by rowid, NULL for none */
+	int (*backfill)(sqlite3 *dbptr, int64_t lo, int64_t hi); /* rows lo < rowid <= hi */
+	const char *finish;
+} migration;
+
+int migrate(char **argstr, sqlite3 *dbptr);
@@ -0,0 +1,400 @@
+/*
+ * Copyright (c) 2019, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* 
+ * Report output layer. Everything is formatted straight into one large buffer that
+ * is reused for the whole run and only handed to stdio when it fills up, numbers are
+ * converted by hand so the output never depends on the locale printf happens to be using.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef __EXILE_BUDGET_H
+#include "budget.h"
+#endif
+#ifndef __EXILE_BUDGET_CACHE_H
+#include "budget_cache.h"
+#endif
+#ifndef __EXILE_BUDGET_OUT_H
+#include "budget_out.h"
+#endif
+
+extern char *__progname;
+extern bool dbg;
+
+outfmt outformat = outtext;
+const char *outcols = NULL;
+
+static char *obuf = NULL;
+static size_t olen = 0;
+
+static const char *const outnames[] = { "text", "tsv", "json", "bin", NULL };
+
+static void outflush(outbuf *out);
+static void outcopy(outbuf *out, const char *src, size_t len);
+static void outbyte(outbuf *out, char c);
+static void outle(outbuf *out, uint64_t num, int bytes);
+static size_t outi64(char *dst, int64_t num, int scale);
+static size_t outymd(char *dst, int64_t ymd, char sep);
+static void outesc(outbuf *out, const char *str, size_t len);
+static void outfield1(outbuf *out, const outfield *field);
+
+int
+outparse(const char *name, outfmt *fmt) {
+	int i;
+
+	for (i = 0; outnames[i] != NULL; i++) {
+		if (strcmp(name, outnames[i]) == 0) {
+			*fmt = (outfmt)i;
+			return(0);
+		}
+	}
+	fprintf(stderr, "ERR: %s [%s:%u] %s: Unknown output format %s\n", __progname, __FILE__, __LINE__, __func__, name);
+	return(-1);
+}
+
+static void
+outflush(outbuf *out) {
+	if (olen > 0) {
+		fwrite(obuf, 1, olen, out->sink);
+		olen = 0;
+		/* a report too big to cache stops being captured and goes straight out */
+		out->sink = rptspill(out->sink);
+	}
+}
+
+static void
+outcopy(outbuf *out, const char *src, size_t len) {
+	size_t chunk;
+
+	while (len > 0) {
+		if (olen == OUTBUF_SIZE) {
+			outflush(out);
+		}
+		chunk = ((OUTBUF_SIZE - olen) < len) ? (OUTBUF_SIZE - olen) : len;
+		memcpy(obuf + olen, src, chunk);
+		olen += chunk;
+		src += chunk;
+		len -= chunk;
+	}
+}
+
+static void
+outbyte(outbuf *out, char c) {
+	if (olen == OUTBUF_SIZE) {
+		outflush(out);
+	}
+	obuf[olen++] = c;
+}
+
+static void
+outle(outbuf *out, uint64_t num, int bytes) {
+	char le[8];
+	int i;
+
+	for (i = 0; i < bytes; i++) {
+		le[i] = (char)((num >> (i * 8)) & 0xFF);
+	}
+	outcopy(out, le, (size_t)bytes);
+}
+
+/* Integer, or fixed point with scale digits after the point, dst needs 24 bytes */
+static size_t
+outi64(char *dst, int64_t num, int scale) {
+	char tmp[24];
+	uint64_t val;
+	size_t n, len;
+	n = len = 0;
+
+	val = (num < 0) ? (uint64_t)0 - (uint64_t)num : (uint64_t)num;
+	do {
+		tmp[n++] = (char)('0' + (val % 10));
+		val /= 10;
+		if ((int)n == scale) {
+			tmp[n++] = '.';
+		}
+	} while ((val > 0) || ((int)n < ((scale > 0) ? scale + 2 : 1)));
+	if (num < 0) {
+		dst[len++] = '-';
+	}
+	while (n > 0) {
+		dst[len++] = tmp[--n];
+	}
+	return(len);
+}
+
+static size_t
+outymd(char *dst, int64_t ymd, char sep) {
+	int64_t year;
+
+	year = ymd / 10000;
+	dst[0] = (char)('0' + ((year / 1000) % 10));
+	dst[1] = (char)('0' + ((year / 100) % 10));
+	dst[2] = (char)('0' + ((year / 10) % 10));
+	dst[3] = (char)('0' + (year % 10));
+	dst[4] = sep;
+	dst[5] = (char)('0' + ((ymd / 1000) % 10));
+	dst[6] = (char)('0' + ((ymd / 100) % 10));
+	dst[7] = sep;
+	dst[8] = (char)('0' + ((ymd / 10) % 10));
+	dst[9] = (char)('0' + (ymd % 10));
+	return(10);
+}
+
+/* 
+ * Escape a string for TSV or JSON, runs of plain bytes are copied in one go.
+ * Other control bytes become \xHH in TSV and \u00HH in JSON, so nothing is lost.
+ * Anything at or above 0x80 passes through untouched, so UTF-8 survives
+ */
+static void
+outesc(outbuf *out, const char *str, size_t len) {
+	static const char hex[] = "0123456789abcdef";
+	char esc[6];
+	size_t i, run;
+	unsigned char c;
+
+	for (i = run = 0; i < len; i++) {
+		c = (unsigned char)str[i];
+		if ((c >= 0x20) && (c != '\\') && ((outformat != outjson) || (c != '"'))) {
+			continue;
+		}
+		outcopy(out, str + run, i - run);
+		run = i + 1;
+		esc[0] = '\\';
+		switch (c) {
+			case '\t': esc[1] = 't'; outcopy(out, esc, 2); break;
+			case '\n': esc[1] = 'n'; outcopy(out, esc, 2); break;
+			case '\r': esc[1] = 'r'; outcopy(out, esc, 2); break;
+			case '\\': case '"': esc[1] = (char)c; outcopy(out, esc, 2); break;
+			default:
+				if (outformat == outjson) {
+					memcpy(esc + 1, "u00", 3);
+					esc[4] = hex[c >> 4];
+					esc[5] = hex[c & 0x0F];
+					outcopy(out, esc, 6);
+				} else {
+					esc[1] = 'x';
+					esc[2] = hex[c >> 4];
+					esc[3] = hex[c & 0x0F];
+					outcopy(out, esc, 4);
+				}
+				break;
+		}
+	}
+	outcopy(out, str + run, len - run);
+}
+
+static void
+outfield1(outbuf *out, const outfield *field) {
+	char num[24];
+	bool json;
+
+	json = (outformat == outjson);
+	switch (field->type) {
+		case fint:
+			outcopy(out, num, outi64(num, field->num, 0));
+			break;
+		case fdec:
+			outcopy(out, num, outi64(num, field->num, field->scale));
+			break;
+		case fdate:
+			if (json) { outbyte(out, '"'); }
+			outcopy(out, num, outymd(num, field->num, (outformat == outtext) ? '.' : '-'));
+			if (json) { outbyte(out, '"'); }
+			break;
+		case fstr:
+			if (json) { outbyte(out, '"'); }
+			if (outformat == outtext) {
+				outcopy(out, field->str, field->len);
+			} else {
+				outesc(out, field->str, field->len);
+			}
+			if (json) { outbyte(out, '"'); }
+			break;
+		default:
+			if (json) { outcopy(out, "null", 4); }
+			break;
+	}
+}
+
+/* 
+ * Start a report with the given columns, applying the -P projection if there is one.
+ * The names have to outlive the report
+ */
+int
+outbegin(outbuf *out, FILE *sink, const char *const *names, int ncol) {
+	const char *col, *end;
+	size_t len;
+	int i;
+
+	memset(out, 0, sizeof(outbuf));
+	out->sink = sink;
+	out->names = names;
+	out->ncol = (ncol < OUT_MAXCOL) ? ncol : OUT_MAXCOL;
+	if ((obuf == NULL) && ((obuf = malloc(OUTBUF_SIZE)) == NULL)) {
+		nxerr(strerror(errno));
+		return(-1);
+	}
+	for (col = outcols; (col != NULL) && (*col != '\0'); col = (*end == ',') ? end + 1 : end) {
+		for (end = col; (*end != '\0') && (*end != ','); end++) {}
+		len = (size_t)(end - col);
+		for (i = 0; (i < out->ncol) && ((strlen(names[i]) != len) || (strncmp(names[i], col, len) != 0)); i++) {}
+		if ((i == out->ncol) || (out->nproj == OUT_MAXCOL)) {
+			fprintf(stderr, "ERR: %s [%s:%u] %s: No column named %.*s in this report\n", __progname, __FILE__, __LINE__, __func__, (int)len, col);
+			return(-1);
+		}
+		out->proj[out->nproj++] = i;
+	}
+	if (outcols == NULL) {
+		for (i = 0; i < out->ncol; i++) {
+			out->proj[out->nproj++] = i;
+		}
+	}
+	if (outformat == outtsv) {
+		for (i = 0; i < out->nproj; i++) {
+			if (i > 0) { outbyte(out, '\t'); }
+			outcopy(out, names[out->proj[i]], strlen(names[out->proj[i]]));
+		}
+		outbyte(out, '\n');
+	} else if (outformat == outbin) {
+		outcopy(out, OUT_BINMAGIC, sizeof(OUT_BINMAGIC));
+		outle(out, (uint64_t)out->nproj, 2);
+		for (i = 0; i < out->nproj; i++) {
+			outle(out, strlen(names[out->proj[i]]), 4);
+			outcopy(out, names[out->proj[i]], strlen(names[out->proj[i]]));
+		}
+	}
+	return(0);
+}
+
+/* Passing NULL leaves the field null, len of -1 means the string is NUL terminated */
+void
+outstr(outbuf *out, int col, const char *str, int len) {
+	if ((col < out->ncol) && (str != NULL)) {
+		out->row[col].type = fstr;
+		out->row[col].str = str;
+		out->row[col].len = (len < 0) ? strlen(str) : (size_t)len;
+	}
+}
+
+void
+outint(outbuf *out, int col, int64_t num) {
+	if (col < out->ncol) {
+		out->row[col].type = fint;
+		out->row[col].num = num;
+	}
+}
+
+void
+outdec(outbuf *out, int col, int64_t num, int scale) {
+	if (col < out->ncol) {
+		out->row[col].type = fdec;
+		out->row[col].num = num;
+		out->row[col].scale = (scale > 18) ? 18 : scale;
+	}
+}
+
+void
+outdate(outbuf *out, int col, int year, int month, int day) {
+	if (col < out->ncol) {
+		out->row[col].type = fdate;
+		out->row[col].num = ((int64_t)year * 10000) + (month * 100) + day;
+	}
+}
+
+/* Write out the fields set since the last row, then clear them for the next one */
+int
+outrow(outbuf *out) {
+	const outfield *field;
+	uint64_t size;
+	int i;
+
+	if (outformat == outbin) {
+		for (i = 0, size = 0; i < out->nproj; i++) {
+			field = &out->row[out->proj[i]];
+			size += (field->type == fint) ? 9 : (field->type == fdec) ? 10 : (field->type == fstr) ? 5 + field->len : (field->type == fdate) ? 5 + 10 : 1;
+		}
+		outle(out, size, 4);
+	} else if (outformat == outjson) {
+		outbyte(out, '{');
+	}
+	for (i = 0; i < out->nproj; i++) {
+		field = &out->row[out->proj[i]];
+		if (outformat == outbin) {
+			outbyte(out, (char)((field->type == fdate) ? fstr : field->type));
+			if (field->type == fint) {
+				outle(out, (uint64_t)field->num, 8);
+			} else if (field->type == fdec) {
+				outle(out, (uint64_t)field->num, 8);
+				outbyte(out, (char)field->scale);
+			} else if (field->type == fstr) {
+				outle(out, field->len, 4);
+				outcopy(out, field->str, field->len);
+			} else if (field->type == fdate) {
+				char ymd[10];
+				outle(out, sizeof(ymd), 4);
+				outcopy(out, ymd, outymd(ymd, field->num, '-'));
+			}
+			continue;
+		}
+		if (i > 0) {
+			outbyte(out, (outformat == outjson) ? ',' : '\t');
+		}
+		if (outformat == outjson) {
+			outbyte(out, '"');
+			outcopy(out, out->names[out->proj[i]], strlen(out->names[out->proj[i]]));
+			outcopy(out, "\":", 2);
+		}
+		outfield1(out, field);
+	}
+	if (outformat == outjson) {
+		outbyte(out, '}');
+	}
+	if (outformat != outbin) {
+		outbyte(out, '\n');
+	}
+	memset(out->row, 0, sizeof(out->row));
+	return(0);
+}
+
+int
+outend(outbuf *out) {
+	outflush(out);
+	return(fflush(out->sink));
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2019, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* 
+ * Declarations for the report output layer.
+ * Reports describe their columns once, then hand over fields a row at a time;
+ * formatting, projection and buffering all happen in here.
+ *
+ * The binary format is little endian throughout:
+ *	header: "BDGOUT1\0", u16 column count, then per column u32 length + name
+ *	row: u32 payload length, then per field a one byte tag followed by
+ *		0 null, 1 i64, 2 i64 + u8 scale (fixed point), 3 u32 length + bytes
+ */
+#define __EXILE_BUDGET_OUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* One buffer for the whole run, only written out when full or at the end of a report */
+#ifndef OUTBUF_SIZE
+#define OUTBUF_SIZE (1024 * 1024)
+#endif
+#ifndef OUT_MAXCOL
+#define OUT_MAXCOL 16
+#endif
+#define OUT_BINMAGIC "BDGOUT1"
+
+typedef enum __outfmt {
+	outtext = 0, /* tab separated, no header, for people */
+	outtsv = 1, /* tab separated with a header line and escaping */
+	outjson = 2, /* one JSON object per line */
+	outbin = 3 /* length prefixed binary records */
+} outfmt;
+
+typedef enum __outtype {
+	fnull = 0,
+	fint = 1,
+	fdec = 2,
+	fstr = 3,
+	fdate = 4 /* packed as year * 10000 + month * 100 + day, written as a string */
+} outtype;
+
+typedef struct __outfield {
+	outtype type;
+	int64_t num;
+	int scale;
+	const char *str;
+	size_t len;
+} outfield;
+
+typedef struct __outbuf {
+	FILE *sink;
+	int ncol;
+	const char *const *names;
+	int nproj;
+	int proj[OUT_MAXCOL]; /* source column for each output position */
+	outfield row[OUT_MAXCOL];
+} outbuf;
+
+/* Set from the command line, -o and -P */
+extern outfmt outformat;
+extern const char *outcols;
+
+int outparse(const char *name, outfmt *fmt);
+int outbegin(outbuf *out, FILE *sink, const char *const *names, int ncol);
+void outstr(outbuf *out, int col, const char *str, int len);
+void outint(outbuf *out, int col, int64_t num);
+void outdec(outbuf *out, int col, int64_t num, int scale);
+void outdate(outbuf *out, int col, int year, int month, int day);
+int outrow(outbuf *out);
+int outend(outbuf *out);
@@ -0,0 +1,449 @@
+/*
+ * Copyright (c) 2019, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* 
+ * Statement reconciliation.
+ * Both sides are put in (date, signed amount) order, the statement by sorting it in memory
+ * and the ledger by walking trans_by_date, and are then matched in one merge pass.
+ * Archived years the range reaches into are attached and read through the ledger view.
+ * Whatever doesn't line up exactly gets a second merge over just the leftovers, this time
+ * allowing the dates to drift by up to the window, which covers the usual posting delays.
+ * Ledger amounts are unsigned with the type giving the direction, expenses count as negative.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+
+#ifndef __EXILE_BUDGET_H
+#include "budget.h"
+#endif
+#ifndef __EXILE_BUDGET_SUBS_H
+#include "budget_subc.h"
+#endif
+#ifndef __EXILE_BUDGET_STMT_H
+#include "budget_stmt.h"
+#endif
+#ifndef __EXILE_BUDGET_CACHE_H
+#include "budget_cache.h"
+#endif
+#ifndef __EXILE_BUDGET_OUT_H
+#include "budget_out.h"
+#endif
+#ifndef __EXILE_BUDGET_ARCHIVE_H
+#include "budget_archive.h"
+#endif
+#ifndef __EXILE_BUDGET_RECON_H
+#include "budget_recon.h"
+#endif
+
+extern char *__progname;
+extern bool dbg;
+
+typedef enum __reconstat {
+	rmatched = 0,
+	rdrift = 1, /* matched, but on a different day */
+	rmissing = 2, /* on the statement, not in the ledger */
+	rextra = 3 /* in the ledger, not on the statement */
+} reconstat;
+
+/* One entry from either side, day is a day number so drift can cross month ends */
+typedef struct __reconent {
+	int32_t day;
+	int64_t cents;
+	size_t ledrow; /* ledger row, counting from 1 in the order read, 0 for none */
+	size_t sidx; /* statement row, SIZE_MAX for none */
+	int32_t drift;
+	reconstat status;
+	bool inrange; /* ledger rows either side of the range are only there to match drift */
+} reconent;
+
+typedef struct __reconlist {
+	reconent *ent;
+	size_t len, cap;
+} reconlist;
+
+static const char *const reconcols[] = { "status", "date", "amount", "drift", "tid", "desc" };
+static const char *const reconnames[] = { "matched", "drift", "missing", "extra" };
+
+/* The range is pushed down into each part of the view, so every one of them walks its own trans_by_date */
+static const char reconq[] = 
+	"SELECT tid, year, month, day, "
+	"CASE type WHEN 0 THEN -CAST(round(amount * 100) AS INTEGER) ELSE CAST(round(amount * 100) AS INTEGER) END AS cents "
+	"FROM temp.ledger WHERE (year, month, day) >= (?1, ?2, ?3) AND (year, month, day) <= (?4, ?5, ?6) "
+	"ORDER BY year, month, day, cents;";
+
+static int32_t recday(int year, int month, int day);
+static void recdate(int32_t num, int *year, int *month, int *day);
+static int reccmp(const void *a, const void *b);
+static reconent *recpush(reconlist *list);
+
+/* Days since 1970-01-01 in the proleptic Gregorian calendar */
+static int32_t
+recday(int year, int month, int day) {
+	int32_t era, yoe, doy, doe;
+
+	year -= (month <= 2);
+	era = ((year >= 0) ? year : year - 399) / 400;
+	yoe = year - (era * 400);
+	doy = (((153 * (month + ((month > 2) ? -3 : 9))) + 2) / 5) + day - 1;
+	doe = (yoe * 365) + (yoe / 4) - (yoe / 100) + doy;
+	return((era * 146097) + doe - 719468);
+}
+
+static void
+recdate(int32_t num, int *year, int *month, int *day) {
+	int32_t era, doe, yoe, doy, mp;
+
+	num += 719468;
+	era = ((num >= 0) ? num : num - 146096) / 146097;
+	doe = num - (era * 146097);
+	yoe = (doe - (doe / 1460) + (doe / 36524) - (doe / 146096)) / 365;
+	doy = doe - ((365 * yoe) + (yoe / 4) - (yoe / 100));
+	mp = ((5 * doy) + 2) / 153;
+	*day = doy - (((153 * mp) + 2) / 5) + 1;
+	*month = (mp < 10) ? mp + 3 : mp - 9;
+	*year = yoe + (era * 400) + (*month <= 2);
+}
+
+static int
+reccmp(const void *a, const void *b) {
+	const reconent *x, *y;
+	x = a;
+	y = b;
+
+	if (x->day != y->day) {
+		return((x->day < y->day) ? -1 : 1);
+	}
+	return((x->cents < y->cents) ? -1 : (x->cents > y->cents));
+}
+
+static reconent *
+recpush(reconlist *list) {
+	reconent *grow;
+
+	if (list->len == list->cap) {
+		list->cap = (list->cap > 0) ? list->cap * 2 : 256;
+		if ((grow = realloc(list->ent, list->cap * sizeof(reconent))) == NULL) {
+			nxerr(strerror(errno));
+			return(NULL);
+		}
+		list->ent = grow;
+	}
+	memset(&list->ent[list->len], 0, sizeof(reconent));
+	list->ent[list->len].sidx = SIZE_MAX;
+	return(&list->ent[list->len++]);
+}
+
+/* 
+ * reconcile [-w days] [-f YYYY-MM-DD] [-t YYYY-MM-DD] statement
+ * The range defaults to the first and last dates on the statement
+ */
+int
+reconcile(char **argstr, sqlite3 *dbptr) {
+	int retc, year, month, day, lastyear;
+	long long window;
+	int32_t lo, hi, cur, first, last;
+	size_t i, j, k, best;
+	uint64_t counts[4];
+	const char *path;
+	char *tids, *growtids;
+	size_t ntids, captids;
+	stmtfile stmt;
+	stmtrow *rows, *grow;
+	size_t nrows, caprows;
+	reconlist st, left, out;
+	reconent *ent, led;
+	sqlite3_stmt *ledq, *tidq;
+	outbuf rpt;
+	retc = 0;
+	window = RECON_WINDOW;
+	lo = INT32_MAX;
+	hi = INT32_MIN;
+	path = NULL;
+	rows = NULL;
+	nrows = caprows = 0;
+	tids = NULL;
+	ntids = captids = 0;
+	ledq = tidq = NULL;
+	memset(&st, 0, sizeof(reconlist));
+	memset(&left, 0, sizeof(reconlist));
+	memset(&out, 0, sizeof(reconlist));
+	memset(&stmt, 0, sizeof(stmtfile));
+	memset(counts, 0, sizeof(counts));
+
+	if (dbg) {
+		nxentr();
+	}
+	for (; (argstr != NULL) && (*argstr != NULL) && (retc == 0); argstr++) {
+		if ((strcmp(*argstr, "-w") == 0) && (argstr[1] != NULL)) {
+			if (((retc = numarg(*++argstr, &window)) == 0) && ((window < 0) || (window > RECON_MAXWINDOW))) {
+				fprintf(stderr, "ERR: %s [%s:%u] %s: Date window has to be between 0 and %d days\n", __progname, __FILE__, __LINE__, __func__, RECON_MAXWINDOW);
+				retc = -1;
+			}
+		} else if (((strcmp(*argstr, "-f") == 0) || (strcmp(*argstr, "-t") == 0)) && (argstr[1] != NULL)) {
+			argstr++;
+			if ((strlen(*argstr) != 10) || (sscanf(*argstr, "%4d-%2d-%2d", &year, &month, &day) != 3)
+					|| (month < 1) || (month > 12) || (day < 1) || (day > 31)) {
+				fprintf(stderr, "ERR: %s [%s:%u] %s: %s is not a YYYY-MM-DD date\n", __progname, __FILE__, __LINE__, __func__, *argstr);
+				retc = -1;
+			} else if (argstr[-1][1] == 'f') {
+				lo = recday(year, month, day);
+			} else {
+				hi = recday(year, month, day);
+			}
+		} else {
+			path = *argstr;
+		}
+	}
+	if ((retc == 0) && (path == NULL)) {
+		nxerr("No statement file given");
+		retc = -1;
+	}
+
+	/* the statement side is small enough to just load and sort */
+	if ((retc == 0) && ((retc = stmtopen(path, &stmt)) == 0)) {
+		for (;;) {
+			if (nrows == caprows) {
+				caprows = (caprows > 0) ? caprows * 2 : 256;
+				if ((grow = realloc(rows, caprows * sizeof(stmtrow))) == NULL) {
+					nxerr(strerror(errno));
+					retc = -1;
+					break;
+				}
+				rows = grow;
+			}
+			if (stmtnext(&stmt, &rows[nrows]) != 1) {
+				break;
+			}
+			nrows++;
+		}
+	}
+	/* an open ended range takes its missing ends from the statement */
+	for (i = 0, first = INT32_MAX, last = INT32_MIN; (retc == 0) && (i < nrows); i++) {
+		cur = recday(rows[i].year, rows[i].month, rows[i].day);
+		first = (cur < first) ? cur : first;
+		last = (cur > last) ? cur : last;
+	}
+	lo = (lo == INT32_MAX) ? first : lo;
+	hi = (hi == INT32_MIN) ? last : hi;
+	for (i = 0; (retc == 0) && (i < nrows); i++) {
+		cur = recday(rows[i].year, rows[i].month, rows[i].day);
+		if ((cur >= lo) && (cur <= hi)) {
+			if ((ent = recpush(&st)) == NULL) {
+				retc = -1;
+				break;
+			}
+			ent->day = cur;
+			ent->cents = rows[i].cents;
+			ent->sidx = i;
+		}
+	}
+	if ((retc == 0) && (lo > hi)) {
+		nxerr("Nothing to reconcile, the statement has no rows in the range");
+		retc = -1;
+	}
+	if (retc == 0) {
+		qsort(st.ent, st.len, sizeof(reconent), reccmp);
+		/* a statement from a closed year is matched against that year's archive */
+		recdate(lo - (int32_t)window, &year, &month, &day);
+		recdate(hi + (int32_t)window, &lastyear, &month, &day);
+		retc = archattach(dbptr, year, lastyear);
+	}
+	if ((retc == SQLITE_OK) && ((retc = sqlite3_prepare_v2(dbptr, reconq, -1, &ledq, NULL)) != SQLITE_OK)) {
+		nxerr(sqlite3_errmsg(dbptr));
+	}
+	if (retc == SQLITE_OK) {
+		recdate(lo - (int32_t)window, &year, &month, &day);
+		sqlite3_bind_int(ledq, 1, year);
+		sqlite3_bind_int(ledq, 2, month);
+		sqlite3_bind_int(ledq, 3, day);
+		recdate(hi + (int32_t)window, &year, &month, &day);
+		sqlite3_bind_int(ledq, 4, year);
+		sqlite3_bind_int(ledq, 5, month);
+		sqlite3_bind_int(ledq, 6, day);
+	}
+
+	/* exact pass, a straight merge of the two sorted streams */
+	for (i = 0; (retc == SQLITE_OK) && ((retc = sqlite3_step(ledq)) == SQLITE_ROW); retc = SQLITE_OK) {
+		memset(&led, 0, sizeof(reconent));
+		/* rowids repeat between main and the archives, so ledger rows are kept by their tid */
+		if (ntids == captids) {
+			captids = (captids > 0) ? captids * 2 : 256;
+			if ((growtids = realloc(tids, captids * TID_LEN)) == NULL) {
+				nxerr(strerror(errno));
+				retc = -1;
+				break;
+			}
+			tids = growtids;
+		}
+		snprintf(tids + (ntids * TID_LEN), TID_LEN, "%s", (const char *)sqlite3_column_text(ledq, 0));
+		led.ledrow = ++ntids;
+		led.day = recday(sqlite3_column_int(ledq, 1), sqlite3_column_int(ledq, 2), sqlite3_column_int(ledq, 3));
+		led.cents = sqlite3_column_int64(ledq, 4);
+		led.sidx = SIZE_MAX;
+		led.inrange = (led.day >= lo) && (led.day <= hi);
+		for (; (retc == SQLITE_ROW) && (i < st.len) && (reccmp(&st.ent[i], &led) < 0); i++) {
+			if ((ent = recpush(&left)) == NULL) {
+				retc = -1;
+			} else {
+				*ent = st.ent[i];
+			}
+		}
+		if ((retc == SQLITE_ROW) && (i < st.len) && (reccmp(&st.ent[i], &led) == 0)) {
+			if ((ent = recpush(&out)) == NULL) {
+				retc = -1;
+			} else {
+				*ent = st.ent[i++];
+				ent->ledrow = led.ledrow;
+				ent->status = rmatched;
+			}
+		} else if (retc == SQLITE_ROW) {
+			if ((ent = recpush(&left)) == NULL) {
+				retc = -1;
+			} else {
+				*ent = led;
+			}
+		}
+		if (retc != SQLITE_ROW) {
+			break;
+		}
+	}
+	if (retc == SQLITE_DONE) {
+		retc = SQLITE_OK;
+		for (; i < st.len; i++) {
+			if ((ent = recpush(&left)) == NULL) { retc = -1; break; }
+			*ent = st.ent[i];
+		}
+	} else if (retc != -1) {
+		nxerr(sqlite3_errmsg(dbptr));
+	}
+
+	/* 
+	 * drift pass over the leftovers, still in date order, so the candidates for each statement
+	 * row are a window sliding forward over the list. The nearest date wins, then the earliest
+	 */
+	for (i = j = 0; (retc == SQLITE_OK) && (i < left.len); i++) {
+		if (left.ent[i].sidx == SIZE_MAX) {
+			continue;
+		}
+		for (; (j < left.len) && (left.ent[j].day < (left.ent[i].day - window)); j++) {}
+		for (k = j, best = SIZE_MAX; (k < left.len) && (left.ent[k].day <= (left.ent[i].day + window)); k++) {
+			if ((left.ent[k].sidx == SIZE_MAX) && (left.ent[k].ledrow != 0) && (left.ent[k].cents == left.ent[i].cents)
+					&& ((best == SIZE_MAX) || (abs(left.ent[k].day - left.ent[i].day) < abs(left.ent[best].day - left.ent[i].day)))) {
+				best = k;
+			}
+		}
+		if (best != SIZE_MAX) {
+			left.ent[i].ledrow = left.ent[best].ledrow;
+			left.ent[i].drift = left.ent[best].day - left.ent[i].day;
+			left.ent[i].status = rdrift;
+			/* used up, it can't match anything else */
+			left.ent[best].ledrow = 0;
+		}
+	}
+	for (i = 0; (retc == SQLITE_OK) && (i < left.len); i++) {
+		if ((left.ent[i].sidx == SIZE_MAX) && ((left.ent[i].ledrow == 0) || !left.ent[i].inrange)) {
+			continue;
+		}
+		if ((ent = recpush(&out)) == NULL) {
+			retc = -1;
+			break;
+		}
+		*ent = left.ent[i];
+		if (ent->sidx == SIZE_MAX) {
+			ent->status = rextra;
+		} else if (ent->ledrow == 0) {
+			ent->status = rmissing;
+		}
+	}
+
+	/* everything goes out in date order, the ledger description is looked up by tid */
+	if (retc == SQLITE_OK) {
+		qsort(out.ent, out.len, sizeof(reconent), reccmp);
+		if ((retc = sqlite3_prepare_v2(dbptr, "SELECT desc FROM temp.ledger WHERE tid = ?1;", -1, &tidq, NULL)) != SQLITE_OK) {
+			nxerr(sqlite3_errmsg(dbptr));
+		} else {
+			retc = outbegin(&rpt, rptout, reconcols, 6);
+		}
+	}
+	for (i = 0; (retc == 0) && (i < out.len); i++) {
+		ent = &out.ent[i];
+		counts[ent->status]++;
+		recdate(ent->day, &year, &month, &day);
+		outstr(&rpt, 0, reconnames[ent->status], -1);
+		outdate(&rpt, 1, year, month, day);
+		outdec(&rpt, 2, ent->cents, 2);
+		if ((ent->ledrow != 0) && (ent->sidx != SIZE_MAX)) {
+			outint(&rpt, 3, ent->drift);
+		}
+		if (ent->ledrow != 0) {
+			outstr(&rpt, 4, tids + ((ent->ledrow - 1) * TID_LEN), -1);
+			sqlite3_bind_text(tidq, 1, tids + ((ent->ledrow - 1) * TID_LEN), -1, SQLITE_STATIC);
+			if ((ent->sidx == SIZE_MAX) && (sqlite3_step(tidq) == SQLITE_ROW)) {
+				outstr(&rpt, 5, (const char *)sqlite3_column_text(tidq, 0), -1);
+			}
+		}
+		if (ent->sidx != SIZE_MAX) {
+			outstr(&rpt, 5, rows[ent->sidx].desc, (int)rows[ent->sidx].desclen);
+		}
+		retc = outrow(&rpt);
+		sqlite3_reset(tidq);
+	}
+	if ((retc == 0) && (tidq != NULL)) {
+		retc = outend(&rpt);
+		if (outformat == outtext) {
+			fprintf(rptout, "%llu matched (%llu with date drift), %llu missing from the ledger, %llu not on the statement\n",
+					(unsigned long long)(counts[rmatched] + counts[rdrift]), (unsigned long long)counts[rdrift],
+					(unsigned long long)counts[rmissing], (unsigned long long)counts[rextra]);
+		}
+	}
+	if (dbg) {
+		fprintf(stderr, "DBG: %s [%s:%u] %s: %zu statement rows, %zu left after the exact pass\n", __progname, __FILE__, __LINE__, __func__, st.len, left.len);
+		nxexit();
+	}
+	sqlite3_finalize(ledq);
+	sqlite3_finalize(tidq);
+	free(st.ent);
+	free(left.ent);
+	free(out.ent);
+	free(tids);
+	free(rows);
+	stmtclose(&stmt);
+	return(retc);
+}
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2019, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* 
+ * Full-text search over transaction descriptions, backed by the trans_fts table.
+ * Each term is quoted before being handed to FTS5 so stray punctuation in a description
+ * can't be mistaken for query syntax, a trailing '*' makes it a prefix query
+ * and a term with spaces in it (quoted on the command line) is matched as a phrase.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+
+#ifndef __EXILE_BUDGET_H
+#include "budget.h"
+#endif
+#ifndef __EXILE_BUDGET_SUBS_H
+#include "budget_subc.h"
+#endif
+#ifndef __EXILE_BUDGET_CACHE_H
+#include "budget_cache.h"
+#endif
+#ifndef __EXILE_BUDGET_SEARCH_H
+#include "budget_search.h"
+#endif
+#ifndef __EXILE_BUDGET_ARCHIVE_H
+#include "budget_archive.h"
+#endif
+#ifndef __EXILE_BUDGET_OUT_H
+#include "budget_out.h"
+#endif
+
+extern char *__progname;
+extern bool dbg;
+
+/* 
+ * The category lookup goes through xcats so the filter is an equality on an indexed integer,
+ * the date filters are likewise plain equalities rather than computed expressions.
+ * This is repeated for main and each attached archive, every copy sharing the same parameters
+ */
+static const char *const ftscols[] = { "tid", "date", "amount", "category", "desc" };
+
+static const char ftsql[] = 
+	"SELECT tx.tid, tx.year, tx.month, tx.day, CAST(round(tx.amount * 100) AS INTEGER), xc.cat, tx.desc, fts.rank AS rank "
+	"FROM \"%w\".trans_fts AS fts JOIN \"%w\".transactions AS tx ON tx.rowid = fts.rowid "
+	"LEFT JOIN main.xcats AS xc ON xc.key = tx.category "
+	"WHERE fts.trans_fts MATCH ?1 "
+	"AND (?2 IS NULL OR tx.category = (SELECT key FROM main.xcats WHERE cat = upper(?2))) "
+	"AND (?3 IS NULL OR tx.year = ?3) "
+	"AND (?4 IS NULL OR tx.month = ?4)";
+
+static int ftsunion(const char *schema, void *arg);
+
+static int
+ftsunion(const char *schema, void *arg) {
+	sqlite3_str *sql;
+	sql = arg;
+
+	if (sqlite3_str_length(sql) > 0) {
+		sqlite3_str_appendall(sql, " UNION ALL ");
+	}
+	sqlite3_str_appendf(sql, ftsql, schema, schema);
+	return(0);
+}
+
+/* 
+ * Append a single term to the MATCH expression being built,
+ * returns nonzero if there was nothing usable in the term
+ */
+int
+ftsmatch(sqlite3_str *match, const char *term) {
+	size_t len;
+	bool prefix;
+	const char *c;
+
+	if ((match == NULL) || (term == NULL) || ((len = strlen(term)) == 0)) {
+		return(-1);
+	}
+	/* a lone '*' would become an empty prefix query, which FTS5 rejects */
+	if ((prefix = (term[len - 1] == '*')) && (--len == 0)) {
+		return(-1);
+	}
+	if (sqlite3_str_length(match) > 0) {
+		sqlite3_str_appendchar(match, 1, ' ');
+	}
+	/* FTS5 strings escape embedded quotes by doubling them, same as SQL */
+	sqlite3_str_appendchar(match, 1, '"');
+	for (c = term; c < (term + len); c++) {
+		sqlite3_str_appendchar(match, (*c == '"') ? 2 : 1, *c);
+	}
+	sqlite3_str_appendchar(match, 1, '"');
+	if (prefix) {
+		sqlite3_str_appendchar(match, 1, '*');
+	}
+	return(0);
+}
+
+/* 
+ * VACUUM the given schema and rebuild its trans_fts, which is keyed on the implicit rowids of
+ * transactions that VACUUM may renumber. Anything here that vacuums has to go through this
+ */
+int
+ftsvacuum(sqlite3 *dbptr, const char *schema) {
+	int retc;
+	char *sql;
+	sqlite3_stmt *ftsq;
+	ftsq = NULL;
+
+	sql = sqlite3_mprintf("VACUUM \"%w\";", schema);
+	if ((retc = sqlite3_exec(dbptr, sql, NULL, NULL, NULL)) != SQLITE_OK) {
+		nxerr(sqlite3_errmsg(dbptr));
+	}
+	sqlite3_free(sql);
+	sql = sqlite3_mprintf("SELECT 1 FROM \"%w\".sqlite_master WHERE name = 'trans_fts';", schema);
+	if ((retc == SQLITE_OK) && ((retc = sqlite3_prepare_v2(dbptr, sql, -1, &ftsq, NULL)) == SQLITE_OK) && (sqlite3_step(ftsq) == SQLITE_ROW)) {
+		sqlite3_free(sql);
+		sql = sqlite3_mprintf("INSERT INTO \"%w\".trans_fts (trans_fts) VALUES ('rebuild');", schema);
+		if ((retc = sqlite3_exec(dbptr, sql, NULL, NULL, NULL)) != SQLITE_OK) {
+			nxerr(sqlite3_errmsg(dbptr));
+		}
+	}
+	sqlite3_finalize(ftsq);
+	sqlite3_free(sql);
+	return(retc);
+}
+
+int
+ftsearch(char **argstr, sqlite3 *dbptr) {
+	int retc, rows;
+	long long year, month, limit;
+	const char *cat;
+	char *expr, *sql;
+	sqlite3_str *match, *query;
+	sqlite3_stmt *ftsq;
+	outbuf out;
+	retc = rows = 0;
+	year = month = 0;
+	limit = SEARCH_LIMIT;
+	cat = NULL; expr = NULL; sql = NULL; ftsq = NULL;
+
+	if (dbg) {
+		nxentr();
+	}
+	if ((argstr == NULL) || (dbptr == NULL)) {
+		nxerr("Passed bad pointers!");
+		return(-1);
+	}
+	match = sqlite3_str_new(dbptr);
+	for (; (retc == 0) && (*argstr != NULL); argstr++) {
+		if ((strcmp(*argstr, "-c") == 0) && (argstr[1] != NULL)) {
+			cat = *++argstr;
+		} else if ((strcmp(*argstr, "-y") == 0) && (argstr[1] != NULL)) {
+			retc = numarg(*++argstr, &year);
+		} else if ((strcmp(*argstr, "-m") == 0) && (argstr[1] != NULL)) {
+			retc = numarg(*++argstr, &month);
+		} else if ((strcmp(*argstr, "-n") == 0) && (argstr[1] != NULL)) {
+			retc = numarg(*++argstr, &limit);
+		} else if (ftsmatch(match, *argstr) != 0) {
+			fprintf(stderr, "WRN: %s [%s:%u] %s: Ignoring empty search term '%s'\n", __progname, __FILE__, __LINE__, __func__, *argstr);
+		}
+	}
+	expr = sqlite3_str_finish(match);
+	if ((retc == 0) && (expr == NULL)) {
+		nxerr("No search terms given");
+		retc = -1;
+	}
+
+	/* only archives for the requested year get attached, everything if there's no year given */
+	if ((retc == 0) && ((retc = archattach(dbptr, year, year)) == SQLITE_OK)) {
+		query = sqlite3_str_new(dbptr);
+		archeach(dbptr, ftsunion, query);
+		sqlite3_str_appendall(query, " ORDER BY rank LIMIT ?5;");
+		sql = sqlite3_str_finish(query);
+		if ((retc = sqlite3_prepare_v2(dbptr, sql, -1, &ftsq, NULL)) != SQLITE_OK) {
+			nxerr(sqlite3_errmsg(dbptr));
+		}
+	}
+	if (retc == SQLITE_OK) {
+		sqlite3_bind_text(ftsq, 1, expr, -1, SQLITE_STATIC);
+		if (cat != NULL) { sqlite3_bind_text(ftsq, 2, cat, -1, SQLITE_STATIC); }
+		if (year > 0) { sqlite3_bind_int64(ftsq, 3, year); }
+		if (month > 0) { sqlite3_bind_int64(ftsq, 4, month); }
+		sqlite3_bind_int64(ftsq, 5, limit);
+		retc = outbegin(&out, rptout, ftscols, 5);
+		while ((retc == 0) && ((retc = sqlite3_step(ftsq)) == SQLITE_ROW)) {
+			outstr(&out, 0, (const char *)sqlite3_column_text(ftsq, 0), -1);
+			outdate(&out, 1, sqlite3_column_int(ftsq, 1), sqlite3_column_int(ftsq, 2), sqlite3_column_int(ftsq, 3));
+			outdec(&out, 2, sqlite3_column_int64(ftsq, 4), 2);
+			outstr(&out, 3, (const char *)sqlite3_column_text(ftsq, 5), -1);
+			outstr(&out, 4, (const char *)sqlite3_column_text(ftsq, 6), -1);
+			retc = outrow(&out);
+			rows++;
+		}
+		if ((retc == SQLITE_DONE) && (outend(&out) == 0)) {
+			retc = 0;
+		} else if (retc > 0) {
+			nxerr(sqlite3_errmsg(dbptr));
+		}
+	}
+	if (dbg) {
+		fprintf(stderr, "DBG: %s [%s:%u] %s: %d matches for %s\n", __progname, __FILE__, __LINE__, __func__, rows, (expr != NULL) ? expr : "");
+		nxexit();
+	}
+	sqlite3_finalize(ftsq);
+	sqlite3_free(sql);
+	sqlite3_free(expr);
+	return(retc);
+}
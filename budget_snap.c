@@ -0,0 +1,712 @@
+/*
+ * Copyright (c) 2019, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* 
+ * Columnar snapshot of the transactions table for ad-hoc analysis.
+ * Date, type, category and amount are written out as packed arrays in a single file
+ * that gets mmap(2)'d back in, so aggregations run over flat memory instead of 
+ * going through the SQLite VM one row at a time. Refreshing only appends the rows
+ * added since the last build, unless something older changed underneath it.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+#ifndef __EXILE_BUDGET_H
+#include "budget.h"
+#endif
+#ifndef __EXILE_BUDGET_SUBS_H
+#include "budget_subc.h"
+#endif
+#ifndef __EXILE_BUDGET_CACHE_H
+#include "budget_cache.h"
+#endif
+#ifndef __EXILE_BUDGET_SNAP_H
+#include "budget_snap.h"
+#endif
+#ifndef __EXILE_BUDGET_OUT_H
+#include "budget_out.h"
+#endif
+
+extern char *__progname;
+extern bool dbg;
+
+
+static const char *const snapcols[] = { "group", "count", "sum", "min", "max" };
+static uint64_t snaplayout(snaphdr *hdr, uint64_t cap);
+static bool snapvalid(const snaphdr *hdr, off_t size);
+static int64_t snapgen(sqlite3 *dbptr);
+static int64_t snapcount(sqlite3 *dbptr, const char *sql, int64_t rowid);
+static void snaplabel(sqlite3 *dbptr, snapgroup group, const snaphdr *hdr, uint32_t key, uint32_t nmonth, char *buf, size_t len);
+
+#define SNAP_ROUND(off) (((off) + (SNAP_ALIGN - 1)) & ~((uint64_t)SNAP_ALIGN - 1))
+
+/* Set the column offsets for the given capacity and return the resulting file size */
+static uint64_t
+snaplayout(snaphdr *hdr, uint64_t cap) {
+	hdr->cap = cap;
+	hdr->date = SNAP_ROUND(sizeof(snaphdr));
+	hdr->type = SNAP_ROUND(hdr->date + (cap * sizeof(uint32_t)));
+	hdr->cat = SNAP_ROUND(hdr->type + (cap * sizeof(uint8_t)));
+	hdr->amount = SNAP_ROUND(hdr->cat + (cap * sizeof(uint16_t)));
+	return(hdr->amount + (cap * sizeof(int64_t)));
+}
+
+static bool
+snapvalid(const snaphdr *hdr, off_t size) {
+	snaphdr check;
+
+	if ((size < (off_t)sizeof(snaphdr)) || (memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic)) != 0) || (hdr->rows > hdr->cap)) {
+		return(false);
+	}
+	memcpy(&check, hdr, sizeof(check));
+	return((snaplayout(&check, hdr->cap) == (uint64_t)size) && (check.amount == hdr->amount));
+}
+
+static int64_t
+snapcount(sqlite3 *dbptr, const char *sql, int64_t rowid) {
+	int64_t count;
+	sqlite3_stmt *countq;
+	count = -1;
+	countq = NULL;
+
+	if (sqlite3_prepare_v2(dbptr, sql, -1, &countq, NULL) == SQLITE_OK) {
+		sqlite3_bind_int64(countq, 1, rowid);
+		if (sqlite3_step(countq) == SQLITE_ROW) {
+			count = sqlite3_column_int64(countq, 0);
+		}
+	} else {
+		nxerr(sqlite3_errmsg(dbptr));
+	}
+	sqlite3_finalize(countq);
+	return(count);
+}
+
+/* The report cache's generation counter, -1 on a database from before it existed */
+static int64_t
+snapgen(sqlite3 *dbptr) {
+	if (sqlite3_table_column_metadata(dbptr, "main", "ledger_gen", "gen", NULL, NULL, NULL, NULL, NULL) != SQLITE_OK) {
+		return(-1);
+	}
+	return(snapcount(dbptr, "SELECT gen FROM main.ledger_gen LIMIT ?1;", 1));
+}
+
+/* 
+ * Build or refresh the snapshot at path.
+ * Rows past the recorded rowid are appended in place when there's room, otherwise
+ * the columns are copied into a larger file that replaces the old one with rename(2).
+ * The header is only updated after the data is written, so an interrupted refresh
+ * leaves the previous snapshot intact.
+ */
+int
+snapbuild(sqlite3 *dbptr, const char *path) {
+	int retc, fd, nfd;
+	int64_t added, year, gen;
+	uint64_t size, row;
+	struct stat snapstat;
+	snaphdr hdr, *nhdr;
+	uint8_t *omap, *nmap;
+	char *tmppath;
+	sqlite3_stmt *rowq;
+	retc = 0;
+	nfd = -1;
+	omap = nmap = NULL;
+	tmppath = NULL; rowq = NULL;
+	memset(&hdr, 0, sizeof(hdr));
+
+	if (dbg) {
+		nxentr();
+	}
+	if ((fd = open(path, O_RDWR|O_CLOEXEC)) >= 0) {
+		if ((fstat(fd, &snapstat) != 0) || (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) || !snapvalid(&hdr, snapstat.st_size)) {
+			nxwrn("Existing snapshot is unusable, rebuilding it");
+			memset(&hdr, 0, sizeof(hdr));
+		}
+	}
+	/* the generation and the rows read after it have to come from the same read transaction */
+	sqlite3_exec(dbptr, "BEGIN;", NULL, NULL, NULL);
+	gen = snapgen(dbptr);
+	added = snapcount(dbptr, "SELECT count(*) FROM main.transactions WHERE rowid > ?1;", hdr.lastrow);
+	/* 
+	 * Each inserted, updated or deleted row bumps the generation once, so only plain appends
+	 * leave it exactly that many ahead. Anything else, or rows missing below the high-water mark
+	 * on a database without ledger_gen, means the snapshot is stale
+	 */
+	if ((hdr.cap > 0) && (added >= 0) && (((gen >= 0) && (gen != hdr.gen + added))
+				|| ((hdr.rows > 0) && (snapcount(dbptr, "SELECT count(*) FROM main.transactions WHERE rowid <= ?1;", hdr.lastrow) != (int64_t)hdr.rows)))) {
+		nxinf("Transactions changed since the last snapshot, rebuilding it");
+		memset(&hdr, 0, sizeof(hdr));
+		added = snapcount(dbptr, "SELECT count(*) FROM main.transactions WHERE rowid > ?1;", hdr.lastrow);
+	}
+	if (added < 0) {
+		retc = -1;
+	} else if ((added == 0) && (hdr.cap > 0)) {
+		/* nothing new, leave it alone */
+		sqlite3_exec(dbptr, "COMMIT;", NULL, NULL, NULL);
+		if (fd >= 0) { close(fd); }
+		if (dbg) { nxexit(); }
+		return(0);
+	}
+
+	if ((retc == 0) && ((hdr.rows + (uint64_t)added) <= hdr.cap)) {
+		/* enough room, append in place */
+		size = snaplayout(&hdr, hdr.cap);
+		if ((nmap = mmap(NULL, (size_t)size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+			nxerr(strerror(errno));
+			nmap = NULL;
+			retc = -1;
+		}
+	} else if (retc == 0) {
+		/* leave headroom so the next few refreshes can append in place */
+		row = ((hdr.rows + (uint64_t)added) * 2 > SNAP_MINCAP) ? (hdr.rows + (uint64_t)added) * 2 : SNAP_MINCAP;
+		if (((tmppath = sqlite3_mprintf("%s.tmp", path)) == NULL) 
+				|| ((nfd = open(tmppath, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, S_IRUSR|S_IWUSR)) < 0)) {
+			nxerr(strerror(errno));
+			retc = -1;
+		}
+		if ((retc == 0) && (hdr.rows > 0)) {
+			if ((omap = mmap(NULL, (size_t)snapstat.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+				nxerr(strerror(errno));
+				omap = NULL;
+				retc = -1;
+			}
+		}
+		memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+		/* the old offsets are needed to copy the existing columns over */
+		nhdr = (omap != NULL) ? (snaphdr *)omap : NULL;
+		size = snaplayout(&hdr, row);
+		if ((retc == 0) && (ftruncate(nfd, (off_t)size) != 0)) {
+			nxerr(strerror(errno));
+			retc = -1;
+		}
+		if ((retc == 0) && ((nmap = mmap(NULL, (size_t)size, PROT_READ|PROT_WRITE, MAP_SHARED, nfd, 0)) == MAP_FAILED)) {
+			nxerr(strerror(errno));
+			nmap = NULL;
+			retc = -1;
+		}
+		if ((retc == 0) && (nhdr != NULL)) {
+			memcpy(nmap + hdr.date, omap + nhdr->date, hdr.rows * sizeof(uint32_t));
+			memcpy(nmap + hdr.type, omap + nhdr->type, hdr.rows * sizeof(uint8_t));
+			memcpy(nmap + hdr.cat, omap + nhdr->cat, hdr.rows * sizeof(uint16_t));
+			memcpy(nmap + hdr.amount, omap + nhdr->amount, hdr.rows * sizeof(int64_t));
+		}
+		if (omap != NULL) { munmap(omap, (size_t)snapstat.st_size); }
+	}
+
+	/* amounts are converted to cents here so the kernels only deal with integers */
+	if ((retc == 0) && ((retc = sqlite3_prepare_v2(dbptr, 
+						"SELECT rowid, year, month, day, type, category, CAST(round(amount * 100) AS INTEGER) "
+						"FROM main.transactions WHERE rowid > ?1 ORDER BY rowid;", -1, &rowq, NULL)) != SQLITE_OK)) {
+		nxerr(sqlite3_errmsg(dbptr));
+	}
+	if (retc == SQLITE_OK) {
+		sqlite3_bind_int64(rowq, 1, hdr.lastrow);
+		if (hdr.rows == 0) {
+			hdr.mindate = UINT32_MAX;
+			hdr.maxdate = hdr.maxcat = hdr.maxtype = 0;
+		}
+		for (row = hdr.rows; (row < hdr.cap) && ((retc = sqlite3_step(rowq)) == SQLITE_ROW); row++) {
+			year = sqlite3_column_int64(rowq, 1);
+			((uint32_t *)(nmap + hdr.date))[row] = SNAP_DATE((uint32_t)year & 0x3FFFFF, (uint32_t)sqlite3_column_int(rowq, 2) & 0x0F, (uint32_t)sqlite3_column_int(rowq, 3) & 0x1F);
+			((uint8_t *)(nmap + hdr.type))[row] = (uint8_t)sqlite3_column_int(rowq, 4);
+			((uint16_t *)(nmap + hdr.cat))[row] = (sqlite3_column_type(rowq, 5) == SQLITE_NULL) ? SNAP_NOCAT : (uint16_t)sqlite3_column_int(rowq, 5);
+			((int64_t *)(nmap + hdr.amount))[row] = sqlite3_column_int64(rowq, 6);
+			hdr.mindate = (((uint32_t *)(nmap + hdr.date))[row] < hdr.mindate) ? ((uint32_t *)(nmap + hdr.date))[row] : hdr.mindate;
+			hdr.maxdate = (((uint32_t *)(nmap + hdr.date))[row] > hdr.maxdate) ? ((uint32_t *)(nmap + hdr.date))[row] : hdr.maxdate;
+			hdr.maxtype = (((uint8_t *)(nmap + hdr.type))[row] > hdr.maxtype) ? ((uint8_t *)(nmap + hdr.type))[row] : hdr.maxtype;
+			hdr.maxcat = ((((uint16_t *)(nmap + hdr.cat))[row] != SNAP_NOCAT) && (((uint16_t *)(nmap + hdr.cat))[row] > hdr.maxcat)) ? ((uint16_t *)(nmap + hdr.cat))[row] : hdr.maxcat;
+			hdr.lastrow = sqlite3_column_int64(rowq, 0);
+		}
+		retc = ((retc == SQLITE_ROW) || (retc == SQLITE_DONE)) ? 0 : retc;
+		if (retc != 0) {
+			nxerr(sqlite3_errmsg(dbptr));
+		}
+		hdr.rows = row;
+		hdr.gen = gen;
+		/* data first, then the header that makes it visible */
+		if (retc == 0) {
+			msync(nmap, (size_t)size, MS_SYNC);
+			memcpy(nmap, &hdr, sizeof(hdr));
+			msync(nmap, sizeof(hdr), MS_SYNC);
+		}
+	}
+	sqlite3_finalize(rowq);
+	sqlite3_exec(dbptr, "COMMIT;", NULL, NULL, NULL);
+	if (nmap != NULL) { munmap(nmap, (size_t)size); }
+	if (tmppath != NULL) {
+		if ((retc == 0) && (rename(tmppath, path) != 0)) {
+			nxerr(strerror(errno));
+			retc = -1;
+		}
+		if (retc != 0) { unlink(tmppath); }
+		sqlite3_free(tmppath);
+	}
+	if (nfd >= 0) { close(nfd); }
+	if (fd >= 0) { close(fd); }
+	if ((retc == 0) && dbg) {
+		fprintf(stderr, "DBG: %s [%s:%u] %s: %llu rows in %s (%lld new)\n", __progname, __FILE__, __LINE__, __func__,
+				(unsigned long long)hdr.rows, path, (long long)added);
+	}
+	if (dbg) {
+		nxexit();
+	}
+	return(retc);
+}
+
+/* 
+ * Sum, count, min and max of every amount whose date falls within [lo, hi].
+ * Rows outside the range are masked off rather than branched around, so the loop
+ * body is the same for every row and streams straight through both columns.
+ * Packed dates stay well below 2^31, so the signed 32 bit compares are safe.
+ */
+void
+snaptotal(const uint32_t *date, const int64_t *amt, size_t n, uint32_t lo, uint32_t hi, snapagg *out) {
+	size_t i, l;
+	i = 0;
+
+	out->sum = 0; out->count = 0;
+	out->min = INT64_MAX; out->max = INT64_MIN;
+#if defined(__AVX2__)
+	{
+		int64_t lanes[4][4];
+		__m128i vlo, vhi, d;
+		__m256i keep, a, cand, vsum, vcnt, vmin, vmax, top, bottom;
+		vlo = _mm_set1_epi32((int)lo);
+		vhi = _mm_set1_epi32((int)hi);
+		top = _mm256_set1_epi64x(INT64_MAX);
+		bottom = _mm256_set1_epi64x(INT64_MIN);
+		vsum = vcnt = _mm256_setzero_si256();
+		vmin = top; vmax = bottom;
+		for (; (i + 4) <= n; i += 4) {
+			d = _mm_loadu_si128((const __m128i *)(const void *)(date + i));
+			/* in range lanes are all ones, then widened to line up with the 64 bit amounts */
+			keep = _mm256_cvtepi32_epi64(_mm_andnot_si128(_mm_or_si128(_mm_cmpgt_epi32(vlo, d), _mm_cmpgt_epi32(d, vhi)), _mm_set1_epi32(-1)));
+			a = _mm256_loadu_si256((const __m256i *)(const void *)(amt + i));
+			vsum = _mm256_add_epi64(vsum, _mm256_and_si256(a, keep));
+			vcnt = _mm256_sub_epi64(vcnt, keep);
+			/* no 64 bit min/max before AVX-512, so compare and blend */
+			cand = _mm256_blendv_epi8(top, a, keep);
+			vmin = _mm256_blendv_epi8(vmin, cand, _mm256_cmpgt_epi64(vmin, cand));
+			cand = _mm256_blendv_epi8(bottom, a, keep);
+			vmax = _mm256_blendv_epi8(vmax, cand, _mm256_cmpgt_epi64(cand, vmax));
+		}
+		_mm256_storeu_si256((__m256i *)(void *)lanes[0], vsum);
+		_mm256_storeu_si256((__m256i *)(void *)lanes[1], vcnt);
+		_mm256_storeu_si256((__m256i *)(void *)lanes[2], vmin);
+		_mm256_storeu_si256((__m256i *)(void *)lanes[3], vmax);
+		for (l = 0; l < 4; l++) {
+			out->sum += lanes[0][l];
+			out->count += (uint64_t)lanes[1][l];
+			out->min = (lanes[2][l] < out->min) ? lanes[2][l] : out->min;
+			out->max = (lanes[3][l] > out->max) ? lanes[3][l] : out->max;
+		}
+	}
+#elif defined(__SSE4_2__)
+	{
+		int64_t lanes[4][2];
+		int32_t pair[2];
+		__m128i vlo, vhi, d, keep, a, cand, vsum, vcnt, vmin, vmax, top, bottom;
+		vlo = _mm_set1_epi32((int)lo);
+		vhi = _mm_set1_epi32((int)hi);
+		top = _mm_set1_epi64x(INT64_MAX);
+		bottom = _mm_set1_epi64x(INT64_MIN);
+		vsum = vcnt = _mm_setzero_si128();
+		vmin = top; vmax = bottom;
+		for (; (i + 2) <= n; i += 2) {
+			memcpy(pair, date + i, sizeof(pair));
+			d = _mm_set_epi32(0, 0, pair[1], pair[0]);
+			keep = _mm_cvtepi32_epi64(_mm_andnot_si128(_mm_or_si128(_mm_cmpgt_epi32(vlo, d), _mm_cmpgt_epi32(d, vhi)), _mm_set1_epi32(-1)));
+			a = _mm_loadu_si128((const __m128i *)(const void *)(amt + i));
+			vsum = _mm_add_epi64(vsum, _mm_and_si128(a, keep));
+			vcnt = _mm_sub_epi64(vcnt, keep);
+			cand = _mm_blendv_epi8(top, a, keep);
+			vmin = _mm_blendv_epi8(vmin, cand, _mm_cmpgt_epi64(vmin, cand));
+			cand = _mm_blendv_epi8(bottom, a, keep);
+			vmax = _mm_blendv_epi8(vmax, cand, _mm_cmpgt_epi64(cand, vmax));
+		}
+		_mm_storeu_si128((__m128i *)(void *)lanes[0], vsum);
+		_mm_storeu_si128((__m128i *)(void *)lanes[1], vcnt);
+		_mm_storeu_si128((__m128i *)(void *)lanes[2], vmin);
+		_mm_storeu_si128((__m128i *)(void *)lanes[3], vmax);
+		for (l = 0; l < 2; l++) {
+			out->sum += lanes[0][l];
+			out->count += (uint64_t)lanes[1][l];
+			out->min = (lanes[2][l] < out->min) ? lanes[2][l] : out->min;
+			out->max = (lanes[3][l] > out->max) ? lanes[3][l] : out->max;
+		}
+	}
+#endif
+	/* whatever is left over, or everything without SIMD support */
+	for (l = i; l < n; l++) {
+		if ((date[l] >= lo) && (date[l] <= hi)) {
+			out->sum += amt[l];
+			out->count++;
+			out->min = (amt[l] < out->min) ? amt[l] : out->min;
+			out->max = (amt[l] > out->max) ? amt[l] : out->max;
+		}
+	}
+}
+
+/* 
+ * Compute the group key for each row as a weighted sum of category, type and month index,
+ * which covers every supported grouping with one formula. Rows outside [lo, hi] get SNAP_SKIP.
+ * The month index is counted from January of the base year.
+ */
+void
+snapkeys(const uint32_t *date, const uint16_t *cat, const uint8_t *type, size_t n, uint32_t lo, uint32_t hi,
+		uint32_t base, const uint32_t *weight, uint32_t *keys) {
+	size_t i;
+	uint32_t month;
+	i = 0;
+
+#if defined(__AVX2__)
+	{
+		__m256i vlo, vhi, vbase, wcat, wtype, wmon, d, c, t, m, key, skip;
+		vlo = _mm256_set1_epi32((int)lo);
+		vhi = _mm256_set1_epi32((int)hi);
+		vbase = _mm256_set1_epi32((int)(base << 4));
+		wcat = _mm256_set1_epi32((int)weight[0]);
+		wtype = _mm256_set1_epi32((int)weight[1]);
+		wmon = _mm256_set1_epi32((int)weight[2]);
+		for (; (i + 8) <= n; i += 8) {
+			d = _mm256_loadu_si256((const __m256i *)(const void *)(date + i));
+			c = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(const void *)(cat + i)));
+			t = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(const void *)(type + i)));
+			m = _mm256_sub_epi32(_mm256_srli_epi32(d, 5), vbase);
+			key = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(c, wcat), _mm256_mullo_epi32(t, wtype)), _mm256_mullo_epi32(m, wmon));
+			skip = _mm256_or_si256(_mm256_cmpgt_epi32(vlo, d), _mm256_cmpgt_epi32(d, vhi));
+			_mm256_storeu_si256((__m256i *)(void *)(keys + i), _mm256_or_si256(key, skip));
+		}
+	}
+#elif defined(__SSE4_2__)
+	{
+		uint32_t packed;
+		__m128i vlo, vhi, vbase, wcat, wtype, wmon, d, c, t, m, key, skip;
+		vlo = _mm_set1_epi32((int)lo);
+		vhi = _mm_set1_epi32((int)hi);
+		vbase = _mm_set1_epi32((int)(base << 4));
+		wcat = _mm_set1_epi32((int)weight[0]);
+		wtype = _mm_set1_epi32((int)weight[1]);
+		wmon = _mm_set1_epi32((int)weight[2]);
+		for (; (i + 4) <= n; i += 4) {
+			d = _mm_loadu_si128((const __m128i *)(const void *)(date + i));
+			c = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)(const void *)(cat + i)));
+			memcpy(&packed, type + i, sizeof(packed));
+			t = _mm_cvtepu8_epi32(_mm_cvtsi32_si128((int)packed));
+			m = _mm_sub_epi32(_mm_srli_epi32(d, 5), vbase);
+			key = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(c, wcat), _mm_mullo_epi32(t, wtype)), _mm_mullo_epi32(m, wmon));
+			skip = _mm_or_si128(_mm_cmpgt_epi32(vlo, d), _mm_cmpgt_epi32(d, vhi));
+			_mm_storeu_si128((__m128i *)(void *)(keys + i), _mm_or_si128(key, skip));
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		month = (date[i] >> 5) - (base << 4);
+		keys[i] = ((date[i] < lo) || (date[i] > hi)) ? SNAP_SKIP : 
+			(cat[i] * weight[0]) + (type[i] * weight[1]) + (month * weight[2]);
+	}
+}
+
+static void
+snaplabel(sqlite3 *dbptr, snapgroup group, const snaphdr *hdr, uint32_t key, uint32_t nmonth, char *buf, size_t len) {
+	uint32_t base, month;
+	const char *sql;
+	sqlite3_stmt *nameq;
+	nameq = NULL;
+	sql = NULL;
+	month = 0;
+
+	base = SNAP_YEAR(hdr->mindate);
+	switch (group) {
+		case bycat:
+			sql = "SELECT cat FROM main.xcats WHERE key = ?1;";
+			break;
+		case bytype:
+			sql = "SELECT type FROM main.xtypes WHERE key = ?1;";
+			break;
+		case bycatmonth:
+			sql = "SELECT cat FROM main.xcats WHERE key = ?1;";
+			month = key % nmonth;
+			key /= nmonth;
+			break;
+		default:
+			month = key;
+			break;
+	}
+	snprintf(buf, len, "%u", key);
+	if (((group == bycat) || (group == bycatmonth)) && (key > hdr->maxcat)) {
+		snprintf(buf, len, "NONE");
+	} else if ((sql != NULL) && (sqlite3_prepare_v2(dbptr, sql, -1, &nameq, NULL) == SQLITE_OK)) {
+		sqlite3_bind_int64(nameq, 1, (sqlite3_int64)key);
+		if (sqlite3_step(nameq) == SQLITE_ROW) {
+			snprintf(buf, len, "%s", (const char *)sqlite3_column_text(nameq, 0));
+		}
+	}
+	sqlite3_finalize(nameq);
+	if (group == bymonth) {
+		snprintf(buf, len, "%04u.%02u", base + (month >> 4), month & 0x0F);
+	} else if (group == bycatmonth) {
+		snprintf(buf + strlen(buf), len - strlen(buf), " %04u.%02u", base + (month >> 4), month & 0x0F);
+	}
+}
+
+/* 
+ * Aggregate the snapshot over [lo, hi], grouped as requested.
+ * Ungrouped totals go entirely through snaptotal(), grouped reports have the keys
+ * computed a block at a time by snapkeys() and then folded into a flat accumulator array
+ */
+int
+snapreport(sqlite3 *dbptr, const char *path, snapgroup group, uint32_t lo, uint32_t hi) {
+	int retc, fd;
+	uint32_t weight[3], nmonth, base, last, keys[SNAP_BLOCK];
+	uint64_t ngroup, row, i, block;
+	struct stat snapstat;
+	const snaphdr *hdr;
+	const uint8_t *map;
+	const int64_t *amt;
+	snapagg total, *acc;
+	char label[128];
+	outbuf out;
+	retc = 0;
+	acc = NULL;
+	map = NULL;
+
+	if (dbg) {
+		nxentr();
+	}
+	if (((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0) || (fstat(fd, &snapstat) != 0)) {
+		nxerr(strerror(errno));
+		fprintf(stderr, "ERR: %s [%s:%u] %s: Run '%s analyze snapshot' to build %s\n", __progname, __FILE__, __LINE__, __func__, __progname, path);
+		if (fd >= 0) { close(fd); }
+		if (dbg) { nxexit(); }
+		return(-1);
+	}
+	if ((map = mmap(NULL, (size_t)snapstat.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		nxerr(strerror(errno));
+		map = NULL;
+		retc = -1;
+	}
+	close(fd);
+	hdr = (const snaphdr *)(const void *)map;
+	if ((retc == 0) && !snapvalid(hdr, snapstat.st_size)) {
+		nxerr("Snapshot file is corrupt, rebuild it with 'analyze snapshot'");
+		retc = -1;
+	}
+	if (retc == 0) {
+		posix_madvise((void *)(uintptr_t)map, (size_t)snapstat.st_size, POSIX_MADV_SEQUENTIAL);
+		if (((hdr->gen >= 0) && (snapgen(dbptr) != hdr->gen))
+				|| ((hdr->gen < 0) && (snapcount(dbptr, "SELECT ifnull(max(rowid), 0) > ?1 FROM main.transactions;", hdr->lastrow) > 0))) {
+			nxwrn("Snapshot is behind the database, run 'analyze snapshot' to refresh it");
+		}
+		amt = (const int64_t *)(const void *)(map + hdr->amount);
+		lo = (lo > hdr->mindate) ? lo : hdr->mindate;
+		hi = (hi < hdr->maxdate) ? hi : hdr->maxdate;
+		retc = outbegin(&out, rptout, snapcols, 5);
+	}
+	if ((retc == 0) && (hdr->rows > 0) && (lo <= hi) && (group == bynone)) {
+		snaptotal((const uint32_t *)(const void *)(map + hdr->date), amt, (size_t)hdr->rows, lo, hi, &total);
+		if (total.count > 0) {
+			outstr(&out, 0, "TOTAL", -1);
+			outint(&out, 1, (int64_t)total.count);
+			outdec(&out, 2, total.sum, 2);
+			outdec(&out, 3, total.min, 2);
+			outdec(&out, 4, total.max, 2);
+			outrow(&out);
+		}
+	} else if ((retc == 0) && (hdr->rows > 0) && (lo <= hi)) {
+		/* month indexes count from January of the first year in range */
+		base = SNAP_YEAR(lo);
+		last = SNAP_YEAR(hi);
+		nmonth = (last - base + 1) << 4;
+		memset(weight, 0, sizeof(weight));
+		switch (group) {
+			case bycat:
+				weight[0] = 1;
+				ngroup = (uint64_t)hdr->maxcat + 2;
+				break;
+			case bytype:
+				weight[1] = 1;
+				ngroup = (uint64_t)hdr->maxtype + 1;
+				break;
+			case bymonth:
+				weight[2] = 1;
+				ngroup = nmonth;
+				break;
+			default:
+				weight[0] = nmonth;
+				weight[2] = 1;
+				ngroup = ((uint64_t)hdr->maxcat + 2) * nmonth;
+				break;
+		}
+		if ((acc = calloc((size_t)ngroup, sizeof(snapagg))) == NULL) {
+			nxerr(strerror(errno));
+			retc = -1;
+		}
+		for (i = 0; (retc == 0) && (i < ngroup); i++) {
+			acc[i].min = INT64_MAX;
+			acc[i].max = INT64_MIN;
+		}
+		for (row = 0; (retc == 0) && (row < hdr->rows); row += block) {
+			block = ((hdr->rows - row) < SNAP_BLOCK) ? (hdr->rows - row) : SNAP_BLOCK;
+			snapkeys((const uint32_t *)(const void *)(map + hdr->date) + row, (const uint16_t *)(const void *)(map + hdr->cat) + row,
+					map + hdr->type + row, (size_t)block, lo, hi, base, weight, keys);
+			for (i = 0; i < block; i++) {
+				/* uncategorized rows move from SNAP_NOCAT down to the slot after maxcat, unsigned wraparound cancels out */
+				if ((weight[0] > 0) && (keys[i] != SNAP_SKIP) && (((const uint16_t *)(const void *)(map + hdr->cat))[row + i] == SNAP_NOCAT)) {
+					keys[i] -= ((uint32_t)SNAP_NOCAT - (hdr->maxcat + 1)) * weight[0];
+				}
+				if (keys[i] < ngroup) {
+					acc[keys[i]].sum += amt[row + i];
+					acc[keys[i]].count++;
+					acc[keys[i]].min = (amt[row + i] < acc[keys[i]].min) ? amt[row + i] : acc[keys[i]].min;
+					acc[keys[i]].max = (amt[row + i] > acc[keys[i]].max) ? amt[row + i] : acc[keys[i]].max;
+				}
+			}
+		}
+		for (i = 0; (retc == 0) && (i < ngroup); i++) {
+			if (acc[i].count > 0) {
+				snaplabel(dbptr, group, hdr, (uint32_t)i, nmonth, label, sizeof(label));
+				outstr(&out, 0, label, -1);
+				outint(&out, 1, (int64_t)acc[i].count);
+				outdec(&out, 2, acc[i].sum, 2);
+				outdec(&out, 3, acc[i].min, 2);
+				outdec(&out, 4, acc[i].max, 2);
+				outrow(&out);
+			}
+		}
+		free(acc);
+	}
+	if ((retc == 0) && (outend(&out) != 0)) {
+		nxerr(strerror(errno));
+		retc = -1;
+	}
+	if (map != NULL) { munmap((void *)(uintptr_t)map, (size_t)snapstat.st_size); }
+	if (dbg) {
+		nxexit();
+	}
+	return(retc);
+}
+
+/* 
+ * analyze snapshot
+ * analyze report [-g cat|type|month|catmonth] [-y year [-m month]]
+ */
+int
+analyze(char **argstr, sqlite3 *dbptr) {
+	int retc;
+	long long year, month;
+	uint32_t lo, hi;
+	snapgroup group;
+	const char *dbfile;
+	char *path;
+	retc = 0;
+	year = month = 0;
+	group = bynone;
+	path = NULL;
+
+	if (dbg) {
+		nxentr();
+	}
+	if ((argstr == NULL) || (*argstr == NULL)) {
+		nxerr("Expected either 'snapshot' or 'report'");
+		if (dbg) { nxexit(); }
+		return(-1);
+	}
+	/* the snapshot sits next to the database it was built from */
+	if (((dbfile = sqlite3_db_filename(dbptr, "main")) == NULL) || (*dbfile == '\0') 
+			|| ((path = sqlite3_mprintf("%s.snap", dbfile)) == NULL)) {
+		nxerr("Snapshots need a database file to sit next to");
+		if (dbg) { nxexit(); }
+		return(-1);
+	}
+	if (strcmp(*argstr, "snapshot") == 0) {
+		/* cached reports were computed from the old snapshot */
+		if ((retc = snapbuild(dbptr, path)) == 0) {
+			cacheinval(dbptr);
+		}
+	} else if (strcmp(*argstr, "report") == 0) {
+		for (argstr++; (retc == 0) && (*argstr != NULL); argstr++) {
+			if ((strcmp(*argstr, "-y") == 0) && (argstr[1] != NULL)) {
+				retc = numarg(*++argstr, &year);
+			} else if ((strcmp(*argstr, "-m") == 0) && (argstr[1] != NULL)) {
+				retc = numarg(*++argstr, &month);
+			} else if ((strcmp(*argstr, "-g") == 0) && (argstr[1] != NULL)) {
+				argstr++;
+				if (strcmp(*argstr, "cat") == 0) { group = bycat; }
+				else if (strcmp(*argstr, "type") == 0) { group = bytype; }
+				else if (strcmp(*argstr, "month") == 0) { group = bymonth; }
+				else if (strcmp(*argstr, "catmonth") == 0) { group = bycatmonth; }
+				else {
+					fprintf(stderr, "ERR: %s [%s:%u] %s: Unknown grouping %s\n", __progname, __FILE__, __LINE__, __func__, *argstr);
+					retc = -1;
+				}
+			} else {
+				fprintf(stderr, "ERR: %s [%s:%u] %s: Unexpected argument %s\n", __progname, __FILE__, __LINE__, __func__, *argstr);
+				retc = -1;
+			}
+		}
+		/* turn the year/month filter into a packed date range */
+		lo = 0; hi = UINT32_MAX >> 1;
+		if ((year > 0) && (year < (1 << 22))) {
+			lo = SNAP_DATE((uint32_t)year, (month > 0) ? (uint32_t)month & 0x0F : 0, 0);
+			hi = SNAP_DATE((uint32_t)year, (month > 0) ? (uint32_t)month & 0x0F : 0x0F, 0x1F);
+		}
+		if (retc == 0) {
+			retc = snapreport(dbptr, path, group, lo, hi);
+		}
+	} else {
+		fprintf(stderr, "ERR: %s [%s:%u] %s: Unknown analyze command %s\n", __progname, __FILE__, __LINE__, __func__, *argstr);
+		retc = -1;
+	}
+	sqlite3_free(path);
+	if (dbg) {
+		nxexit();
+	}
+	return(retc);
+}
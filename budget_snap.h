@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2019, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* 
+ * Declarations for the columnar transaction snapshot used by the analyze command,
+ * the file is mapped directly so the layout here is the on-disk format
+ */
+#define __EXILE_BUDGET_SNAP_H
+
+#include <sqlite3.h>
+#include <stdint.h>
+
+#define SNAP_MAGIC "BDGSNAP3"
+/* Each column starts on a cache line */
+#define SNAP_ALIGN 64
+/* Rows handed to the key kernel at a time, small enough to stay in L1 */
+#define SNAP_BLOCK 1024
+#ifndef SNAP_MINCAP
+#define SNAP_MINCAP 4096
+#endif
+/* Group key for rows outside the requested date range */
+#define SNAP_SKIP UINT32_MAX
+/* Category column value for transactions without one, never counted in maxcat */
+#define SNAP_NOCAT UINT16_MAX
+
+/* 
+ * Dates are packed as (year << 9) | (month << 5) | day, which keeps them ordered
+ * while letting the month be pulled out with a shift instead of a division
+ */
+#define SNAP_DATE(y,m,d) ((uint32_t)(((y) << 9) | ((m) << 5) | (d)))
+#define SNAP_YEAR(date) ((date) >> 9)
+#define SNAP_MONTH(date) (((date) >> 5) & 0x0F)
+
+typedef struct __snaphdr {
+	char magic[8];
+	uint64_t rows; /* rows currently held */
+	uint64_t cap; /* rows each column has room for */
+	int64_t lastrow; /* highest transactions rowid included */
+	int64_t gen; /* ledger_gen.gen as of the last build or refresh, -1 without one */
+	uint32_t mindate, maxdate;
+	uint32_t maxcat, maxtype;
+	/* column offsets from the start of the file */
+	uint64_t date, type, cat, amount;
+} snaphdr;
+
+typedef struct __snapagg {
+	int64_t sum, min, max; /* amounts are kept in cents */
+	uint64_t count;
+} snapagg;
+
+typedef enum __snapgroup {
+	bynone = 0,
+	bycat = 1,
+	bytype = 2,
+	bymonth = 3,
+	bycatmonth = 4
+} snapgroup;
+
+int analyze(char **argstr, sqlite3 *dbptr);
+int snapbuild(sqlite3 *dbptr, const char *path);
+int snapreport(sqlite3 *dbptr, const char *path, snapgroup group, uint32_t lo, uint32_t hi);
+void snaptotal(const uint32_t *date, const int64_t *amt, size_t n, uint32_t lo, uint32_t hi, snapagg *out);
+void snapkeys(const uint32_t *date, const uint16_t *cat, const uint8_t *type, size_t n, uint32_t lo, uint32_t hi,
+		uint32_t base, const uint32_t *weight, uint32_t *keys);
@@ -0,0 +1,432 @@
+/*
+ * Copyright (c) 2019, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* 
+ * Write spool.
+ * Writers never wait on the database to record a transaction: each one is written to its
+ * own file in <db>.spool, fsync(2)'d, and renamed into place, which needs no lock at all.
+ * Whoever then gets the write lock commits everything waiting in the spool in a single
+ * transaction, so a pile of concurrent writers costs a handful of commits instead of one
+ * each. The spooled file is named after the transaction's tid, and is only removed after
+ * the commit, so a drain cut short just inserts the same rows again and they're ignored.
+ */
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef __EXILE_BUDGET_H
+#include "budget.h"
+#endif
+#ifndef __EXILE_BUDGET_SUBS_H
+#include "budget_subc.h"
+#endif
+#ifndef __EXILE_BUDGET_STMT_H
+#include "budget_stmt.h"
+#endif
+#ifndef __EXILE_BUDGET_IMPORT_H
+#include "budget_import.h"
+#endif
+#ifndef __EXILE_BUDGET_SPOOL_H
+#include "budget_spool.h"
+#endif
+#ifndef __EXILE_BUDGET_CHAIN_H
+#include "budget_chain.h"
+#endif
+
+extern char *__progname;
+extern bool dbg;
+
+static char *spooldir(sqlite3 *dbptr);
+static int spoolsync(const char *dir);
+static int spoolname(const void *a, const void *b);
+static int spoollist(const char *dir, char ***names, size_t *count);
+
+/* The tid is unique, a row already committed by an earlier drain is left alone */
+static const char spoolinsq[] = 
+	"INSERT INTO main.transactions (tid, year, month, day, type, amount, category, desc, fprint) "
+	"VALUES (?1, ?2, ?3, ?4, ?5, ?6, (SELECT key FROM main.xcats WHERE cat = upper(?7)), ?8, ?9) "
+	"ON CONFLICT (tid) DO NOTHING;";
+
+/* 
+ * Busy handler with a randomized, doubling backoff that gives up after BUSY_TRIES.
+ * Given the path of a spooled record it also stops as soon as the record is gone,
+ * as that means whoever held the lock has already committed it
+ */
+int
+busywait(void *arg, int count) {
+	uint32_t delay;
+
+	if (count >= BUSY_TRIES) {
+		return(0);
+	}
+	if ((arg != NULL) && (access((const char *)arg, F_OK) != 0) && (errno == ENOENT)) {
+		return(0);
+	}
+	delay = (count < 7) ? (uint32_t)BUSY_MINWAIT << count : BUSY_MAXWAIT;
+	delay = (delay > BUSY_MAXWAIT) ? BUSY_MAXWAIT : delay;
+	usleep((useconds_t)((delay / 2) + arc4random_uniform((delay / 2) + 1)));
+	return(1);
+}
+
+static char *
+spooldir(sqlite3 *dbptr) {
+	const char *dbfile;
+
+	if (((dbfile = sqlite3_db_filename(dbptr, "main")) == NULL) || (*dbfile == '\0')) {
+		nxerr("The write spool needs a database on disk");
+		return(NULL);
+	}
+	return(sqlite3_mprintf("%s.spool", dbfile));
+}
+
+/* A rename(2) is only durable once the directory holding it is */
+static int
+spoolsync(const char *dir) {
+	int fd, retc;
+
+	if ((fd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0) {
+		return(-1);
+	}
+	retc = fsync(fd);
+	close(fd);
+	return(retc);
+}
+
+static int
+spoolname(const void *a, const void *b) {
+	return(strcmp(*(char *const *)a, *(char *const *)b));
+}
+
+/* Pending records, oldest first as tids start with the time they were made */
+static int
+spoollist(const char *dir, char ***names, size_t *count) {
+	DIR *spool;
+	struct dirent *ent;
+	size_t len, cap;
+	char **list, **grow;
+	list = NULL;
+	cap = *count = 0;
+
+	if ((spool = opendir(dir)) == NULL) {
+		*names = NULL;
+		return((errno == ENOENT) ? 0 : -1);
+	}
+	while ((ent = readdir(spool)) != NULL) {
+		len = strlen(ent->d_name);
+		if ((ent->d_name[0] == '.') || (len < 5) || (len >= (TID_LEN + 4)) || (strcmp(ent->d_name + len - 4, ".txn") != 0)) {
+			continue;
+		}
+		if (*count == cap) {
+			cap = (cap > 0) ? cap * 2 : 64;
+			if ((grow = realloc(list, cap * sizeof(char *))) == NULL) {
+				break;
+			}
+			list = grow;
+		}
+		if ((list[*count] = strdup(ent->d_name)) == NULL) {
+			break;
+		}
+		(*count)++;
+	}
+	closedir(spool);
+	if (ent != NULL) {
+		nxerr(strerror(ENOMEM));
+	}
+	if (*count > 0) {
+		qsort(list, *count, sizeof(char *), spoolname);
+	}
+	*names = list;
+	return((ent != NULL) ? -1 : 0);
+}
+
+/* 
+ * Commit whatever is waiting in the spool, SPOOL_BATCH records per transaction.
+ * mine is the record the caller just spooled, if it's committed by someone else
+ * while waiting for the lock there's nothing left to do and that counts as success
+ */
+int
+spooldrain(sqlite3 *dbptr, const char *mine, long long *drained) {
+	int retc, fd;
+	size_t count, i, batch, done;
+	ssize_t len;
+	char **names;
+	char *dir, *path;
+	char rec[SPOOL_RECMAX];
+	char tid[TID_LEN];
+	stmtrow row;
+	sqlite3_stmt *insq;
+	retc = 0;
+	names = NULL;
+	count = done = 0;
+	insq = NULL;
+	*drained = 0;
+
+	if ((dir = spooldir(dbptr)) == NULL) {
+		return(-1);
+	}
+	do {
+		/* list only once the lock is held, anything renamed in after that waits for the next drain */
+		sqlite3_busy_handler(dbptr, busywait, (void *)(uintptr_t)mine);
+		if ((retc = sqlite3_exec(dbptr, "BEGIN IMMEDIATE;", NULL, NULL, NULL)) != SQLITE_OK) {
+			if ((retc == SQLITE_BUSY) && (mine != NULL) && (access(mine, F_OK) != 0)) {
+				retc = SQLITE_OK;
+			} else if ((retc == SQLITE_BUSY) && (mine != NULL)) {
+				nxwrn("Database is busy, the transaction stays spooled until the next write or 'flush'");
+				retc = SQLITE_OK;
+			} else {
+				nxerr(sqlite3_errmsg(dbptr));
+			}
+			break;
+		}
+		sqlite3_busy_handler(dbptr, busywait, NULL);
+		if ((insq == NULL) && ((retc = sqlite3_prepare_v2(dbptr, spoolinsq, -1, &insq, NULL)) != SQLITE_OK)) {
+			count = 0;
+		} else if (spoollist(dir, &names, &count) != 0) {
+			nxerr(strerror(errno));
+			retc = -1;
+		}
+		batch = (count < SPOOL_BATCH) ? count : SPOOL_BATCH;
+		for (i = 0; (retc == SQLITE_OK) && (i < batch); i++) {
+			path = sqlite3_mprintf("%s/%s", dir, names[i]);
+			/* another drain may have finished with it since the listing */
+			if ((path == NULL) || ((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0)) {
+				sqlite3_free(path);
+				names[i][0] = '\0';
+				continue;
+			}
+			len = read(fd, rec, sizeof(rec));
+			close(fd);
+			if ((len <= 0) || (rec[len - 1] != '\n') || (stmtparse(rec, (size_t)len - 1, &row) != 0)) {
+				fprintf(stderr, "WRN: %s [%s:%u] %s: Skipping malformed spool record %s\n", __progname, __FILE__, __LINE__, __func__, path);
+				names[i][0] = '\0';
+				sqlite3_free(path);
+				continue;
+			}
+			sqlite3_free(path);
+			snprintf(tid, sizeof(tid), "%.*s", (int)(strlen(names[i]) - 4), names[i]);
+			sqlite3_bind_text(insq, 1, tid, -1, SQLITE_STATIC);
+			sqlite3_bind_int(insq, 2, row.year);
+			sqlite3_bind_int(insq, 3, row.month);
+			sqlite3_bind_int(insq, 4, row.day);
+			sqlite3_bind_int(insq, 5, (row.cents < 0) ? expense : deposit);
+			sqlite3_bind_double(insq, 6, (double)((row.cents < 0) ? -row.cents : row.cents) / 100.0);
+			if (row.catlen > 0) {
+				sqlite3_bind_text(insq, 7, row.cat, (int)row.catlen, SQLITE_STATIC);
+			} else {
+				sqlite3_bind_null(insq, 7);
+			}
+			sqlite3_bind_text(insq, 8, row.desc, (int)row.desclen, SQLITE_STATIC);
+			sqlite3_bind_int64(insq, 9, (sqlite3_int64)fingerprint(row.year, row.month, row.day, (row.cents < 0) ? expense : deposit, row.cents, row.desc, row.desclen));
+			if ((retc = sqlite3_step(insq)) == SQLITE_DONE) {
+				retc = SQLITE_OK;
+			}
+			sqlite3_reset(insq);
+		}
+		/* not being able to chain isn't fatal, the rows stay queued for the next commit */
+		if (retc == SQLITE_OK) {
+			chainextend(dbptr);
+		}
+		if (retc != SQLITE_OK) {
+			nxerr(sqlite3_errmsg(dbptr));
+			sqlite3_exec(dbptr, "ROLLBACK;", NULL, NULL, NULL);
+		} else if ((retc = sqlite3_exec(dbptr, "COMMIT;", NULL, NULL, NULL)) != SQLITE_OK) {
+			nxerr(sqlite3_errmsg(dbptr));
+			sqlite3_exec(dbptr, "ROLLBACK;", NULL, NULL, NULL);
+		}
+		/* only now is it safe to let go of the records */
+		for (i = 0; i < count; i++) {
+			if ((retc == SQLITE_OK) && (i < batch) && (names[i][0] != '\0')) {
+				path = sqlite3_mprintf("%s/%s", dir, names[i]);
+				if ((path != NULL) && (unlink(path) == 0)) {
+					done++;
+				}
+				sqlite3_free(path);
+			}
+			free(names[i]);
+		}
+		free(names);
+		names = NULL;
+	} while ((retc == SQLITE_OK) && (count > SPOOL_BATCH));
+	sqlite3_busy_handler(dbptr, busywait, NULL);
+	if (dbg) {
+		fprintf(stderr, "DBG: %s [%s:%u] %s: %zu spooled transactions committed\n", __progname, __FILE__, __LINE__, __func__, done);
+	}
+	*drained = (long long)done;
+	sqlite3_finalize(insq);
+	sqlite3_free(dir);
+	return(retc);
+}
+
+/* 
+ * insert [-c category] [-d YYYY-MM-DD] amount description...
+ * A negative amount is an expense, the date defaults to today
+ */
+int
+spoolinsert(char **argstr, sqlite3 *dbptr) {
+	int retc, fd;
+	long long drained;
+	time_t now;
+	const char *cat, *amount;
+	char date[16], tid[TID_LEN], scratch[SPOOL_RECMAX];
+	char *dir, *tmp, *path, *rec, *c;
+	sqlite3_str *line;
+	sqlite3_stmt *catq;
+	stmtrow row;
+	retc = 0;
+	fd = -1;
+	catq = NULL;
+	cat = amount = NULL;
+	dir = tmp = path = rec = NULL;
+
+	if (dbg) {
+		nxentr();
+	}
+	now = time(NULL);
+	strftime(date, sizeof(date), "%Y-%m-%d", localtime(&now));
+	line = sqlite3_str_new(NULL);
+	for (; (argstr != NULL) && (*argstr != NULL); argstr++) {
+		if ((strcmp(*argstr, "-c") == 0) && (argstr[1] != NULL)) {
+			cat = *++argstr;
+		} else if ((strcmp(*argstr, "-d") == 0) && (argstr[1] != NULL)) {
+			snprintf(date, sizeof(date), "%s", *++argstr);
+		} else if (amount == NULL) {
+			amount = *argstr;
+		} else {
+			/* description words, tabs and newlines would split the record */
+			if (sqlite3_str_length(line) > 0) {
+				sqlite3_str_appendchar(line, 1, ' ');
+			}
+			for (c = *argstr; *c != '\0'; c++) {
+				sqlite3_str_appendchar(line, 1, ((*c == '\t') || (*c == '\n') || (*c == '\r')) ? ' ' : *c);
+			}
+		}
+	}
+	if ((rec = sqlite3_str_finish(line)) == NULL) {
+		nxerr("Expected an amount and a description");
+		retc = -1;
+	} else if ((path = sqlite3_mprintf("%s\t%s\t%s\t%s\n", date, amount, rec, (cat != NULL) ? cat : "")) == NULL) {
+		nxerr(strerror(ENOMEM));
+		retc = -1;
+	} else if ((strlen(path) >= SPOOL_RECMAX) || (strchr(cat ? cat : "", '\t') != NULL)
+			/* parsed from a copy, stmtparse() collapses quotes in place and the record goes to disk as typed */
+			|| (stmtparse(memcpy(scratch, path, strlen(path) + 1), strlen(path) - 1, &row) != 0)) {
+		fprintf(stderr, "ERR: %s [%s:%u] %s: Not a valid transaction: %s", __progname, __FILE__, __LINE__, __func__, path);
+		retc = -1;
+	}
+	sqlite3_free(rec);
+	rec = path;
+	path = NULL;
+	/* a category that doesn't exist would be stored as NULL at drain time, with nobody left to tell */
+	if ((retc == 0) && (cat != NULL) && (sqlite3_prepare_v2(dbptr, "SELECT 1 FROM main.xcats WHERE cat = upper(?1);", -1, &catq, NULL) == SQLITE_OK)) {
+		sqlite3_bind_text(catq, 1, cat, -1, SQLITE_STATIC);
+		if (sqlite3_step(catq) != SQLITE_ROW) {
+			fprintf(stderr, "ERR: %s [%s:%u] %s: No such category %s\n", __progname, __FILE__, __LINE__, __func__, cat);
+			retc = -1;
+		}
+		sqlite3_finalize(catq);
+	}
+
+	/* write it out under a hidden name and only rename it in once it's safely on disk */
+	if ((retc == 0) && ((dir = spooldir(dbptr)) == NULL)) {
+		retc = -1;
+	}
+	if ((retc == 0) && (mkdir(dir, 0700) != 0) && (errno != EEXIST)) {
+		nxerr(strerror(errno));
+		retc = -1;
+	}
+	if (retc == 0) {
+		mktid(tid);
+		tmp = sqlite3_mprintf("%s/.%s.tmp", dir, tid);
+		path = sqlite3_mprintf("%s/%s.txn", dir, tid);
+		if ((tmp == NULL) || (path == NULL) || ((fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0600)) < 0)) {
+			nxerr(strerror(errno));
+			retc = -1;
+		}
+	}
+	if ((retc == 0) && ((write(fd, rec, strlen(rec)) != (ssize_t)strlen(rec)) || (fsync(fd) != 0))) {
+		nxerr(strerror(errno));
+		retc = -1;
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	if ((retc == 0) && ((rename(tmp, path) != 0) || (spoolsync(dir) != 0))) {
+		nxerr(strerror(errno));
+		retc = -1;
+	}
+	if ((retc != 0) && (tmp != NULL)) {
+		unlink(tmp);
+	}
+	if (retc == 0) {
+		retc = spooldrain(dbptr, path, &drained);
+	}
+	if (dbg) {
+		nxexit();
+	}
+	sqlite3_free(rec);
+	sqlite3_free(tmp);
+	sqlite3_free(path);
+	sqlite3_free(dir);
+	return(retc);
+}
+
+/* 
+ * flush
+ * Waits for the write lock, unlike insert which leaves that to whoever holds it
+ */
+int
+spoolflush(char **argstr, sqlite3 *dbptr) {
+	int retc;
+	long long drained;
+
+	if ((argstr != NULL) && (*argstr != NULL)) {
+		nxerr("flush doesn't take any arguments");
+		return(-1);
+	}
+	if ((retc = spooldrain(dbptr, NULL, &drained)) == 0) {
+		fprintf(stdout, "%lld spooled transactions committed\n", drained);
+	}
+	return(retc);
+}
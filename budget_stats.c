@@ -0,0 +1,819 @@
+/*
+ * Copyright (c) 2019, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* 
+ * Streaming statistics.
+ * Every category, type and month gets a Welford accumulator for the mean and variance and
+ * a t-digest for the quantiles. Both merge exactly (or as near as a digest gets), so the scan
+ * is split into per-month work units spread across threads, each thread folds rows into its
+ * own groups, and the groups are merged at the end. Archived years are just more work units.
+ * Months that are over get their groups stored in stats_months, and are only scanned again
+ * once a trigger reports a write to them.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef __EXILE_BUDGET_H
+#include "budget.h"
+#endif
+#ifndef __EXILE_BUDGET_SUBS_H
+#include "budget_subc.h"
+#endif
+#ifndef __EXILE_BUDGET_ARCHIVE_H
+#include "budget_archive.h"
+#endif
+#ifndef __EXILE_BUDGET_CACHE_H
+#include "budget_cache.h"
+#endif
+#ifndef __EXILE_BUDGET_OUT_H
+#include "budget_out.h"
+#endif
+#ifndef __EXILE_BUDGET_SPOOL_H
+#include "budget_spool.h"
+#endif
+#ifndef __EXILE_BUDGET_STATS_H
+#include "budget_stats.h"
+#endif
+
+extern char *__progname;
+extern bool dbg;
+
+#define TD_PI 3.14159265358979323846
+
+typedef enum __statsgroup {
+	stcat = 0,
+	stmonth = 1,
+	stcatmonth = 2
+} statsgroup;
+
+/* One month of one database file */
+typedef struct __statsunit {
+	char *path;
+	int32_t year, month;
+} statsunit;
+
+typedef struct __statswork {
+	statsunit *units;
+	size_t nunits, next;
+	pthread_mutex_t lock;
+} statswork;
+
+typedef struct __statsthr {
+	pthread_t thread;
+	statswork *work;
+	statsmap map;
+	int retc;
+} statsthr;
+
+typedef struct __statsctx {
+	sqlite3 *dbptr;
+	long long year, month;
+	statsunit *units;
+	size_t nunits, cap;
+} statsctx;
+
+static const char *const statscols[] = { "group", "count", "mean", "stddev", "min", "p50", "p90", "p99", "max", "trend" };
+
+/* Kept in step with budget.sql, for databases made before these existed */
+static const char statsschema[] = 
+	"CREATE TABLE IF NOT EXISTS main.stats_closed (year integer, month integer, PRIMARY KEY (year, month));"
+	"CREATE TABLE IF NOT EXISTS main.stats_months (category integer, type integer, year integer, month integer, "
+	"n integer, mean real, m2 real, min integer, max integer, sum integer, digest blob, PRIMARY KEY (category, type, year, month));"
+	"CREATE TRIGGER IF NOT EXISTS main.stats_trans_ins AFTER INSERT ON transactions BEGIN "
+	"DELETE FROM stats_closed WHERE year = new.year AND month = new.month; END;"
+	"CREATE TRIGGER IF NOT EXISTS main.stats_trans_upd AFTER UPDATE ON transactions BEGIN "
+	"DELETE FROM stats_closed WHERE (year = old.year AND month = old.month) OR (year = new.year AND month = new.month); END;"
+	"CREATE TRIGGER IF NOT EXISTS main.stats_trans_del AFTER DELETE ON transactions BEGIN "
+	"DELETE FROM stats_closed WHERE year = old.year AND month = old.month; END;";
+
+static const char statsscan[] = 
+	"SELECT ifnull(category, -1), type, CAST(round(amount * 100) AS INTEGER) FROM transactions WHERE year = ?1 AND month = ?2;";
+static const char statsload[] = 
+	"SELECT s.category, s.type, s.year, s.month, s.n, s.mean, s.m2, s.min, s.max, s.sum, s.digest "
+	"FROM main.stats_months AS s JOIN main.stats_closed AS c ON c.year = s.year AND c.month = s.month "
+	"WHERE (?1 = 0 OR s.year = ?1) AND (?2 = 0 OR s.month = ?2);";
+static const char statssave[] = 
+	"INSERT OR REPLACE INTO main.stats_months VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11);";
+
+static double tdk(double q);
+static double tdkinv(double k);
+static int tdcmp(const void *a, const void *b);
+static uint32_t statshash(int32_t cat, int32_t type, int32_t year, int32_t month);
+static statsgrp *statsget(statsmap *map, int32_t cat, int32_t type, int32_t year, int32_t month);
+static void statsadd(statsgrp *grp, int64_t cents);
+static int statsfold(statsgrp *dst, const statsgrp *src);
+static void statsfree(statsmap *map);
+static int statsunits(const char *schema, void *arg);
+static void *statsworker(void *arg);
+static int statsorder(const void *a, const void *b);
+static int statspersist(sqlite3 *dbptr, statsmap *map, const statsctx *ctx);
+
+/* The k1 scale function, keeps centroids small near the tails where the interesting quantiles are */
+static double
+tdk(double q) {
+	return((TD_DELTA / (2.0 * TD_PI)) * asin((2.0 * q) - 1.0));
+}
+
+static double
+tdkinv(double k) {
+	if (k >= (TD_DELTA / 4.0)) {
+		return(1.0);
+	}
+	return((sin((k * 2.0 * TD_PI) / TD_DELTA) + 1.0) / 2.0);
+}
+
+static int
+tdcmp(const void *a, const void *b) {
+	const tdcent *x, *y;
+	x = a;
+	y = b;
+	return((x->mean < y->mean) ? -1 : (x->mean > y->mean));
+}
+
+int
+tdadd(tdigest *td, double val, double weight) {
+	tdcent *grow;
+
+	if (td->n == td->cap) {
+		if (td->cap < TD_MAXCAP) {
+			if ((grow = realloc(td->c, ((td->cap > 0) ? td->cap * 2 : 16) * sizeof(tdcent))) == NULL) {
+				return(-1);
+			}
+			td->c = grow;
+			td->cap = (td->cap > 0) ? td->cap * 2 : 16;
+		} else {
+			tdcompress(td);
+		}
+	}
+	td->c[td->n].mean = val;
+	td->c[td->n++].weight = weight;
+	td->total += weight;
+	return(0);
+}
+
+int
+tdmerge(tdigest *dst, const tdigest *src) {
+	uint32_t i;
+
+	for (i = 0; i < src->n; i++) {
+		if (tdadd(dst, src->c[i].mean, src->c[i].weight) != 0) {
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+/* Sort everything and merge neighbours for as long as the scale function allows */
+void
+tdcompress(tdigest *td) {
+	uint32_t i, out;
+	double sofar, qlimit;
+	tdcent cur;
+
+	if ((td->n == td->merged) || (td->n == 0)) {
+		return;
+	}
+	qsort(td->c, td->n, sizeof(tdcent), tdcmp);
+	sofar = 0.0;
+	out = 0;
+	cur = td->c[0];
+	qlimit = tdkinv(tdk(0.0) + 1.0);
+	for (i = 1; i < td->n; i++) {
+		if (((sofar + cur.weight + td->c[i].weight) / td->total) <= qlimit) {
+			cur.weight += td->c[i].weight;
+			cur.mean += ((td->c[i].mean - cur.mean) * td->c[i].weight) / cur.weight;
+		} else {
+			sofar += cur.weight;
+			td->c[out++] = cur;
+			qlimit = tdkinv(tdk(sofar / td->total) + 1.0);
+			cur = td->c[i];
+		}
+	}
+	td->c[out++] = cur;
+	td->n = td->merged = out;
+}
+
+/* Interpolates between centroid means, and out to the exact min and max at either end */
+double
+tdquantile(tdigest *td, double q, double min, double max) {
+	uint32_t i;
+	double idx, cum, next;
+
+	tdcompress(td);
+	if (td->n == 0) {
+		return(0.0);
+	} else if (td->n == 1) {
+		return(td->c[0].mean);
+	}
+	idx = q * td->total;
+	cum = td->c[0].weight / 2.0;
+	if (idx < cum) {
+		return(min + (((td->c[0].mean - min) * idx) / cum));
+	}
+	for (i = 0; (i + 1) < td->n; i++) {
+		next = cum + ((td->c[i].weight + td->c[i + 1].weight) / 2.0);
+		if (idx < next) {
+			return(td->c[i].mean + (((td->c[i + 1].mean - td->c[i].mean) * (idx - cum)) / (next - cum)));
+		}
+		cum = next;
+	}
+	next = td->total - cum;
+	return((next > 0.0) ? td->c[i].mean + (((max - td->c[i].mean) * fmin(idx - cum, next)) / next) : max);
+}
+
+void
+tdfree(tdigest *td) {
+	free(td->c);
+	memset(td, 0, sizeof(tdigest));
+}
+
+static uint32_t
+statshash(int32_t cat, int32_t type, int32_t year, int32_t month) {
+	uint64_t hash;
+
+	hash = ((uint64_t)(uint32_t)cat << 32) ^ ((uint64_t)(uint32_t)type << 24) ^ ((uint64_t)(uint32_t)year << 4) ^ (uint64_t)(uint32_t)month;
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	return((uint32_t)hash);
+}
+
+/* Find or make a group, the pointer is only good until the next call */
+static statsgrp *
+statsget(statsmap *map, int32_t cat, int32_t type, int32_t year, int32_t month) {
+	statsgrp *old, *grp;
+	uint32_t i, oldcap;
+
+	if (((map->len + 1) * 2) > map->cap) {
+		old = map->grp;
+		oldcap = map->cap;
+		map->cap = (map->cap > 0) ? map->cap * 2 : 64;
+		if ((map->grp = calloc(map->cap, sizeof(statsgrp))) == NULL) {
+			map->grp = old;
+			map->cap = oldcap;
+			return(NULL);
+		}
+		for (i = 0; i < oldcap; i++) {
+			if (old[i].used) {
+				for (grp = &map->grp[statshash(old[i].cat, old[i].type, old[i].year, old[i].month) & (map->cap - 1)]; grp->used;
+						grp = (grp == &map->grp[map->cap - 1]) ? map->grp : grp + 1) {}
+				*grp = old[i];
+			}
+		}
+		free(old);
+	}
+	for (i = statshash(cat, type, year, month) & (map->cap - 1); map->grp[i].used; i = (i + 1) & (map->cap - 1)) {
+		grp = &map->grp[i];
+		if ((grp->cat == cat) && (grp->type == type) && (grp->year == year) && (grp->month == month)) {
+			return(grp);
+		}
+	}
+	grp = &map->grp[i];
+	grp->used = true;
+	grp->cat = cat;
+	grp->type = type;
+	grp->year = year;
+	grp->month = month;
+	grp->min = INT64_MAX;
+	grp->max = INT64_MIN;
+	map->len++;
+	return(grp);
+}
+
+static void
+statsadd(statsgrp *grp, int64_t cents) {
+	double delta;
+
+	grp->n++;
+	delta = (double)cents - grp->mean;
+	grp->mean += delta / (double)grp->n;
+	grp->m2 += delta * ((double)cents - grp->mean);
+	grp->min = (cents < grp->min) ? cents : grp->min;
+	grp->max = (cents > grp->max) ? cents : grp->max;
+	grp->sum += cents;
+	tdadd(&grp->td, (double)cents, 1.0);
+}
+
+/* Chan et al.'s pairwise combination of two Welford accumulators */
+static int
+statsfold(statsgrp *dst, const statsgrp *src) {
+	double delta, total;
+
+	if (src->n == 0) {
+		return(0);
+	}
+	total = (double)(dst->n + src->n);
+	delta = src->mean - dst->mean;
+	dst->m2 += src->m2 + ((delta * delta * (double)dst->n * (double)src->n) / total);
+	dst->mean += (delta * (double)src->n) / total;
+	dst->n += src->n;
+	dst->min = (src->min < dst->min) ? src->min : dst->min;
+	dst->max = (src->max > dst->max) ? src->max : dst->max;
+	dst->sum += src->sum;
+	return(tdmerge(&dst->td, &src->td));
+}
+
+static void
+statsfree(statsmap *map) {
+	uint32_t i;
+
+	for (i = 0; i < map->cap; i++) {
+		if (map->grp[i].used) {
+			tdfree(&map->grp[i].td);
+		}
+	}
+	free(map->grp);
+	memset(map, 0, sizeof(statsmap));
+}
+
+int
+statsinit(sqlite3 *dbptr) {
+	int retc;
+
+	if ((retc = sqlite3_exec(dbptr, statsschema, NULL, NULL, NULL)) != SQLITE_OK) {
+		nxerr(sqlite3_errmsg(dbptr));
+	}
+	return(retc);
+}
+
+/* Every month in the range that isn't folded in yet becomes a unit of work, per database file */
+static int
+statsunits(const char *schema, void *arg) {
+	int retc;
+	const char *path;
+	char *sql;
+	statsunit *grow;
+	statsctx *ctx;
+	sqlite3_stmt *monthq;
+	ctx = arg;
+	monthq = NULL;
+
+	if (((path = sqlite3_db_filename(ctx->dbptr, schema)) == NULL) || (*path == '\0')) {
+		return(0);
+	}
+	sql = sqlite3_mprintf("SELECT DISTINCT year, month FROM \"%w\".transactions AS tx WHERE (?1 = 0 OR year = ?1) AND (?2 = 0 OR month = ?2) "
+			"AND NOT EXISTS (SELECT 1 FROM main.stats_closed AS c WHERE c.year = tx.year AND c.month = tx.month);", schema);
+	if ((retc = sqlite3_prepare_v2(ctx->dbptr, sql, -1, &monthq, NULL)) != SQLITE_OK) {
+		nxerr(sqlite3_errmsg(ctx->dbptr));
+	} else {
+		sqlite3_bind_int64(monthq, 1, ctx->year);
+		sqlite3_bind_int64(monthq, 2, ctx->month);
+	}
+	while ((retc == SQLITE_OK) && (sqlite3_step(monthq) == SQLITE_ROW)) {
+		if (ctx->nunits == ctx->cap) {
+			ctx->cap = (ctx->cap > 0) ? ctx->cap * 2 : 64;
+			if ((grow = realloc(ctx->units, ctx->cap * sizeof(statsunit))) == NULL) {
+				nxerr(strerror(errno));
+				retc = -1;
+				break;
+			}
+			ctx->units = grow;
+		}
+		ctx->units[ctx->nunits].year = sqlite3_column_int(monthq, 0);
+		ctx->units[ctx->nunits].month = sqlite3_column_int(monthq, 1);
+		if ((ctx->units[ctx->nunits].path = sqlite3_mprintf("%s", path)) == NULL) {
+			retc = -1;
+			break;
+		}
+		ctx->nunits++;
+	}
+	sqlite3_finalize(monthq);
+	sqlite3_free(sql);
+	return(retc);
+}
+
+/* 
+ * Pulls units off the shared list until there are none left. Each thread reads through its
+ * own read-only connection, reopened only when the units move on to another file
+ */
+static void *
+statsworker(void *arg) {
+	size_t i;
+	const char *open;
+	statsgrp *grp;
+	statsunit *unit;
+	statsthr *thr;
+	sqlite3 *conn;
+	sqlite3_stmt *scanq;
+	thr = arg;
+	open = NULL;
+	conn = NULL;
+	scanq = NULL;
+
+	while (thr->retc == 0) {
+		pthread_mutex_lock(&thr->work->lock);
+		i = thr->work->next++;
+		pthread_mutex_unlock(&thr->work->lock);
+		if (i >= thr->work->nunits) {
+			break;
+		}
+		unit = &thr->work->units[i];
+		if ((open == NULL) || (strcmp(open, unit->path) != 0)) {
+			sqlite3_finalize(scanq);
+			sqlite3_close(conn);
+			scanq = NULL;
+			conn = NULL;
+			open = unit->path;
+			if (((thr->retc = sqlite3_open_v2(unit->path, &conn, SQLITE_OPEN_READONLY|SQLITE_OPEN_NOMUTEX, NULL)) != SQLITE_OK)
+					|| (sqlite3_busy_handler(conn, busywait, NULL) != SQLITE_OK)
+					|| ((thr->retc = sqlite3_prepare_v2(conn, statsscan, -1, &scanq, NULL)) != SQLITE_OK)) {
+				fprintf(stderr, "ERR: %s [%s:%u] %s: %s: %s\n", __progname, __FILE__, __LINE__, __func__, unit->path, sqlite3_errmsg(conn));
+				break;
+			}
+		}
+		sqlite3_bind_int(scanq, 1, unit->year);
+		sqlite3_bind_int(scanq, 2, unit->month);
+		while ((thr->retc = sqlite3_step(scanq)) == SQLITE_ROW) {
+			if ((grp = statsget(&thr->map, sqlite3_column_int(scanq, 0), sqlite3_column_int(scanq, 1), unit->year, unit->month)) == NULL) {
+				thr->retc = SQLITE_NOMEM;
+				break;
+			}
+			statsadd(grp, sqlite3_column_int64(scanq, 2));
+		}
+		if (thr->retc == SQLITE_DONE) {
+			thr->retc = 0;
+		} else {
+			fprintf(stderr, "ERR: %s [%s:%u] %s: %s: %s\n", __progname, __FILE__, __LINE__, __func__, unit->path, sqlite3_errmsg(conn));
+		}
+		sqlite3_reset(scanq);
+	}
+	sqlite3_finalize(scanq);
+	sqlite3_close(conn);
+	return(NULL);
+}
+
+static int
+statsorder(const void *a, const void *b) {
+	const statsgrp *x, *y;
+	x = a;
+	y = b;
+
+	if (x->cat != y->cat) {
+		return((x->cat < y->cat) ? -1 : 1);
+	} else if (x->year != y->year) {
+		return((x->year < y->year) ? -1 : 1);
+	}
+	return((x->month < y->month) ? -1 : (x->month > y->month));
+}
+
+/* Store every group for the months that were scanned and are over, then mark those months folded in */
+static int
+statspersist(sqlite3 *dbptr, statsmap *map, const statsctx *ctx) {
+	int retc, year, month;
+	uint32_t i;
+	size_t u, v;
+	time_t now;
+	struct tm *cur;
+	bool closed;
+	sqlite3_stmt *saveq, *markq, *clearq;
+	saveq = markq = clearq = NULL;
+
+	now = time(NULL);
+	cur = localtime(&now);
+	year = cur->tm_year + 1900;
+	month = cur->tm_mon + 1;
+	if (((retc = sqlite3_exec(dbptr, "BEGIN IMMEDIATE;", NULL, NULL, NULL)) != SQLITE_OK)
+			|| ((retc = sqlite3_prepare_v2(dbptr, statssave, -1, &saveq, NULL)) != SQLITE_OK)
+			|| ((retc = sqlite3_prepare_v2(dbptr, "INSERT OR IGNORE INTO main.stats_closed VALUES (?1, ?2);", -1, &markq, NULL)) != SQLITE_OK)
+			|| ((retc = sqlite3_prepare_v2(dbptr, "DELETE FROM main.stats_months WHERE year = ?1 AND month = ?2;", -1, &clearq, NULL)) != SQLITE_OK)) {
+		nxwrn(sqlite3_errmsg(dbptr));
+	}
+	/* the same month can show up once per file, only the first one counts */
+	for (u = 0; (retc == SQLITE_OK) && (u < ctx->nunits); u++) {
+		for (v = 0; (v < u) && ((ctx->units[v].year != ctx->units[u].year) || (ctx->units[v].month != ctx->units[u].month)); v++) {}
+		if ((v < u) || (ctx->units[u].year > year) || ((ctx->units[u].year == year) && (ctx->units[u].month >= month))) {
+			continue;
+		}
+		sqlite3_bind_int(clearq, 1, ctx->units[u].year);
+		sqlite3_bind_int(clearq, 2, ctx->units[u].month);
+		sqlite3_bind_int(markq, 1, ctx->units[u].year);
+		sqlite3_bind_int(markq, 2, ctx->units[u].month);
+		if ((sqlite3_step(clearq) != SQLITE_DONE) || (sqlite3_step(markq) != SQLITE_DONE)) {
+			retc = sqlite3_errcode(dbptr);
+		}
+		sqlite3_reset(clearq);
+		sqlite3_reset(markq);
+	}
+	for (i = 0; (retc == SQLITE_OK) && (i < map->cap); i++) {
+		if (!map->grp[i].used) {
+			continue;
+		}
+		for (u = 0, closed = false; !closed && (u < ctx->nunits); u++) {
+			closed = (ctx->units[u].year == map->grp[i].year) && (ctx->units[u].month == map->grp[i].month);
+		}
+		if (!closed || (map->grp[i].year > year) || ((map->grp[i].year == year) && (map->grp[i].month >= month))) {
+			continue;
+		}
+		tdcompress(&map->grp[i].td);
+		sqlite3_bind_int(saveq, 1, map->grp[i].cat);
+		sqlite3_bind_int(saveq, 2, map->grp[i].type);
+		sqlite3_bind_int(saveq, 3, map->grp[i].year);
+		sqlite3_bind_int(saveq, 4, map->grp[i].month);
+		sqlite3_bind_int64(saveq, 5, (sqlite3_int64)map->grp[i].n);
+		sqlite3_bind_double(saveq, 6, map->grp[i].mean);
+		sqlite3_bind_double(saveq, 7, map->grp[i].m2);
+		sqlite3_bind_int64(saveq, 8, map->grp[i].min);
+		sqlite3_bind_int64(saveq, 9, map->grp[i].max);
+		sqlite3_bind_int64(saveq, 10, map->grp[i].sum);
+		sqlite3_bind_blob(saveq, 11, map->grp[i].td.c, (int)(map->grp[i].td.n * sizeof(tdcent)), SQLITE_STATIC);
+		if (sqlite3_step(saveq) != SQLITE_DONE) {
+			retc = sqlite3_errcode(dbptr);
+		}
+		sqlite3_reset(saveq);
+	}
+	if (retc == SQLITE_OK) {
+		retc = sqlite3_exec(dbptr, "COMMIT;", NULL, NULL, NULL);
+	}
+	if (retc != SQLITE_OK) {
+		nxwrn("Couldn't store the monthly statistics, they'll be worked out again next time");
+		sqlite3_exec(dbptr, "ROLLBACK;", NULL, NULL, NULL);
+	}
+	sqlite3_finalize(saveq);
+	sqlite3_finalize(markq);
+	sqlite3_finalize(clearq);
+	return(retc);
+}
+
+/* 
+ * stats [-g cat|month|catmonth] [-c category] [-t type] [-y year [-m month]]
+ * Only expenses unless another type is asked for
+ */
+int
+stats(char **argstr, sqlite3 *dbptr) {
+	int retc, len;
+	long long cat, type, cpus;
+	size_t i, nthr;
+	uint32_t j;
+	double slope, *pairs;
+	const char *catname, *typename;
+	char label[128];
+	statsgroup group;
+	statsctx ctx;
+	statswork work;
+	statsthr *thr;
+	statsmap fine, rpt;
+	statsgrp *grp, *src, *prev, *sorted;
+	sqlite3_stmt *loadq, *nameq;
+	outbuf out;
+	retc = 0;
+	cat = -2;
+	type = expense;
+	group = stcat;
+	catname = typename = NULL;
+	thr = NULL;
+	sorted = NULL;
+	loadq = nameq = NULL;
+	nthr = 0;
+	memset(&ctx, 0, sizeof(statsctx));
+	memset(&fine, 0, sizeof(statsmap));
+	memset(&rpt, 0, sizeof(statsmap));
+	ctx.dbptr = dbptr;
+
+	if (dbg) {
+		nxentr();
+	}
+	for (; (argstr != NULL) && (*argstr != NULL) && (retc == 0); argstr++) {
+		if ((strcmp(*argstr, "-g") == 0) && (argstr[1] != NULL)) {
+			argstr++;
+			if (strcmp(*argstr, "cat") == 0) { group = stcat; }
+			else if (strcmp(*argstr, "month") == 0) { group = stmonth; }
+			else if (strcmp(*argstr, "catmonth") == 0) { group = stcatmonth; }
+			else {
+				fprintf(stderr, "ERR: %s [%s:%u] %s: Unknown grouping %s\n", __progname, __FILE__, __LINE__, __func__, *argstr);
+				retc = -1;
+			}
+		} else if ((strcmp(*argstr, "-c") == 0) && (argstr[1] != NULL)) {
+			catname = *++argstr;
+		} else if ((strcmp(*argstr, "-t") == 0) && (argstr[1] != NULL)) {
+			typename = *++argstr;
+		} else if ((strcmp(*argstr, "-y") == 0) && (argstr[1] != NULL)) {
+			retc = numarg(*++argstr, &ctx.year);
+		} else if ((strcmp(*argstr, "-m") == 0) && (argstr[1] != NULL)) {
+			retc = numarg(*++argstr, &ctx.month);
+		} else {
+			fprintf(stderr, "ERR: %s [%s:%u] %s: Unexpected argument %s\n", __progname, __FILE__, __LINE__, __func__, *argstr);
+			retc = -1;
+		}
+	}
+	if ((retc == 0) && ((ctx.month < 0) || (ctx.month > 12))) {
+		nxerr("Month has to be between 1 and 12");
+		retc = -1;
+	}
+	/* names are resolved once up front so the scan only compares integers */
+	if ((retc == 0) && (catname != NULL) && (sqlite3_prepare_v2(dbptr, "SELECT key FROM main.xcats WHERE cat = upper(?1);", -1, &nameq, NULL) == SQLITE_OK)) {
+		sqlite3_bind_text(nameq, 1, catname, -1, SQLITE_STATIC);
+		cat = (sqlite3_step(nameq) == SQLITE_ROW) ? sqlite3_column_int64(nameq, 0) : -3;
+		sqlite3_finalize(nameq);
+	}
+	if ((retc == 0) && (typename != NULL) && (sqlite3_prepare_v2(dbptr, "SELECT key FROM main.xtypes WHERE type = upper(?1);", -1, &nameq, NULL) == SQLITE_OK)) {
+		sqlite3_bind_text(nameq, 1, typename, -1, SQLITE_STATIC);
+		type = (sqlite3_step(nameq) == SQLITE_ROW) ? sqlite3_column_int64(nameq, 0) : -3;
+		sqlite3_finalize(nameq);
+	}
+	nameq = NULL;
+	if ((retc == 0) && ((cat == -3) || (type == -3))) {
+		fprintf(stderr, "ERR: %s [%s:%u] %s: No such %s\n", __progname, __FILE__, __LINE__, __func__, (cat == -3) ? catname : typename);
+		retc = -1;
+	}
+	if ((retc == 0) && ((retc = statsinit(dbptr)) == SQLITE_OK) && ((retc = archattach(dbptr, ctx.year, ctx.year)) == SQLITE_OK)) {
+		retc = archeach(dbptr, statsunits, &ctx);
+	}
+
+	/* months that are already folded in come straight from stats_months */
+	if ((retc == 0) && ((retc = sqlite3_prepare_v2(dbptr, statsload, -1, &loadq, NULL)) == SQLITE_OK)) {
+		sqlite3_bind_int64(loadq, 1, ctx.year);
+		sqlite3_bind_int64(loadq, 2, ctx.month);
+		while ((retc == 0) && (sqlite3_step(loadq) == SQLITE_ROW)) {
+			if ((grp = statsget(&fine, sqlite3_column_int(loadq, 0), sqlite3_column_int(loadq, 1), sqlite3_column_int(loadq, 2), sqlite3_column_int(loadq, 3))) == NULL) {
+				retc = -1;
+				break;
+			}
+			grp->n = (uint64_t)sqlite3_column_int64(loadq, 4);
+			grp->mean = sqlite3_column_double(loadq, 5);
+			grp->m2 = sqlite3_column_double(loadq, 6);
+			grp->min = sqlite3_column_int64(loadq, 7);
+			grp->max = sqlite3_column_int64(loadq, 8);
+			grp->sum = sqlite3_column_int64(loadq, 9);
+			pairs = (double *)(uintptr_t)sqlite3_column_blob(loadq, 10);
+			len = sqlite3_column_bytes(loadq, 10) / (int)sizeof(tdcent);
+			for (j = 0; (pairs != NULL) && (j < (uint32_t)len); j++) {
+				tdadd(&grp->td, pairs[j * 2], pairs[(j * 2) + 1]);
+			}
+		}
+	}
+	sqlite3_finalize(loadq);
+
+	/* everything else is scanned, spread over as many threads as there are cores and units */
+	if ((retc == 0) && (ctx.nunits > 0)) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthr = (cpus < 1) ? 1 : (size_t)cpus;
+		nthr = (nthr > STATS_THREADS) ? STATS_THREADS : nthr;
+		nthr = (nthr > ctx.nunits) ? ctx.nunits : nthr;
+		memset(&work, 0, sizeof(statswork));
+		work.units = ctx.units;
+		work.nunits = ctx.nunits;
+		pthread_mutex_init(&work.lock, NULL);
+		if ((thr = calloc(nthr, sizeof(statsthr))) == NULL) {
+			nxerr(strerror(errno));
+			retc = -1;
+			nthr = 0;
+		}
+		for (i = 0; i < nthr; i++) {
+			thr[i].work = &work;
+			if ((i > 0) && (pthread_create(&thr[i].thread, NULL, statsworker, &thr[i]) != 0)) {
+				nthr = i;
+			}
+		}
+		/* the calling thread takes a share too */
+		if (nthr > 0) {
+			statsworker(&thr[0]);
+		}
+		for (i = 0; i < nthr; i++) {
+			if (i > 0) {
+				pthread_join(thr[i].thread, NULL);
+			}
+			retc = (thr[i].retc != 0) ? -1 : retc;
+			for (j = 0; (retc == 0) && (j < thr[i].map.cap); j++) {
+				src = &thr[i].map.grp[j];
+				if (src->used && (((grp = statsget(&fine, src->cat, src->type, src->year, src->month)) == NULL) || (statsfold(grp, src) != 0))) {
+					retc = -1;
+				}
+			}
+			statsfree(&thr[i].map);
+		}
+		pthread_mutex_destroy(&work.lock);
+		free(thr);
+		if (dbg) {
+			fprintf(stderr, "DBG: %s [%s:%u] %s: %zu months scanned across %zu threads\n", __progname, __FILE__, __LINE__, __func__, ctx.nunits, nthr);
+		}
+		if (retc == 0) {
+			statspersist(dbptr, &fine, &ctx);
+		}
+	}
+
+	/* fold the monthly groups into the ones asked for, tracking monthly totals for the trend */
+	for (j = 0; (retc == 0) && (j < fine.cap); j++) {
+		src = &fine.grp[j];
+		if (!src->used || (src->type != type) || ((cat != -2) && (src->cat != cat))) {
+			continue;
+		}
+		if ((grp = statsget(&rpt, (group == stmonth) ? 0 : src->cat, 0, (group == stcat) ? 0 : src->year, (group == stcat) ? 0 : src->month)) == NULL) {
+			retc = -1;
+			break;
+		}
+		statsfold(grp, src);
+		slope = (double)((src->year * 12) + src->month - 1);
+		grp->sx += slope;
+		grp->sy += (double)src->sum;
+		grp->sxx += slope * slope;
+		grp->sxy += slope * (double)src->sum;
+		grp->np++;
+	}
+	if ((retc == 0) && (rpt.len > 0) && ((sorted = calloc(rpt.len, sizeof(statsgrp))) == NULL)) {
+		nxerr(strerror(errno));
+		retc = -1;
+	}
+	for (i = j = 0; (retc == 0) && (j < rpt.cap); j++) {
+		if (rpt.grp[j].used) {
+			sorted[i++] = rpt.grp[j];
+		}
+	}
+	if ((retc == 0) && (rpt.len > 0)) {
+		qsort(sorted, rpt.len, sizeof(statsgrp), statsorder);
+	}
+	if ((retc == 0) && ((retc = outbegin(&out, rptout, statscols, 10)) == 0)) {
+		sqlite3_prepare_v2(dbptr, "SELECT cat FROM main.xcats WHERE key = ?1;", -1, &nameq, NULL);
+	}
+	for (i = 0, prev = NULL; (retc == 0) && (i < rpt.len); prev = grp, i++) {
+		grp = &sorted[i];
+		label[0] = '\0';
+		if (group != stmonth) {
+			snprintf(label, sizeof(label), "%s", (grp->cat < 0) ? "NONE" : "");
+			sqlite3_bind_int(nameq, 1, grp->cat);
+			if ((grp->cat >= 0) && (sqlite3_step(nameq) == SQLITE_ROW)) {
+				snprintf(label, sizeof(label), "%s", (const char *)sqlite3_column_text(nameq, 0));
+			} else if (grp->cat >= 0) {
+				snprintf(label, sizeof(label), "%d", grp->cat);
+			}
+			sqlite3_reset(nameq);
+		}
+		if (group != stcat) {
+			snprintf(label + strlen(label), sizeof(label) - strlen(label), "%s%04d.%02d", (group == stcatmonth) ? " " : "", grp->year, grp->month);
+		}
+		outstr(&out, 0, label, -1);
+		outint(&out, 1, (int64_t)grp->n);
+		outdec(&out, 2, llround(grp->mean), 2);
+		outdec(&out, 3, (grp->n > 1) ? llround(sqrt(grp->m2 / (double)(grp->n - 1))) : 0, 2);
+		outdec(&out, 4, grp->min, 2);
+		outdec(&out, 5, llround(tdquantile(&grp->td, 0.5, (double)grp->min, (double)grp->max)), 2);
+		outdec(&out, 6, llround(tdquantile(&grp->td, 0.9, (double)grp->min, (double)grp->max)), 2);
+		outdec(&out, 7, llround(tdquantile(&grp->td, 0.99, (double)grp->min, (double)grp->max)), 2);
+		outdec(&out, 8, grp->max, 2);
+		/* per category it's the fitted change per month, otherwise the change from the month before */
+		if ((group == stcat) && (grp->np > 1) && (((grp->np * grp->sxx) - (grp->sx * grp->sx)) > 0.0)) {
+			slope = ((grp->np * grp->sxy) - (grp->sx * grp->sy)) / ((grp->np * grp->sxx) - (grp->sx * grp->sx));
+			outdec(&out, 9, llround(slope), 2);
+		} else if ((group != stcat) && (prev != NULL) && (prev->cat == grp->cat)
+				&& ((((grp->year * 12) + grp->month) - ((prev->year * 12) + prev->month)) == 1)) {
+			outdec(&out, 9, grp->sum - prev->sum, 2);
+		}
+		retc = outrow(&out);
+	}
+	if ((retc == 0) && (outend(&out) != 0)) {
+		nxerr(strerror(errno));
+		retc = -1;
+	}
+	if (dbg) {
+		nxexit();
+	}
+	sqlite3_finalize(nameq);
+	for (i = 0; i < ctx.nunits; i++) {
+		sqlite3_free(ctx.units[i].path);
+	}
+	free(ctx.units);
+	free(sorted);
+	statsfree(&fine);
+	statsfree(&rpt);
+	return(retc);
+}
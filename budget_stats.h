@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2019, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* 
+ * Declarations for the streaming statistics report: Welford accumulators for the moments
+ * and a merging t-digest for the quantiles, both of which combine without a second pass
+ */
+#define __EXILE_BUDGET_STATS_H
+
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* t-digest compression, roughly how many centroids are kept once compressed */
+#define TD_DELTA 100
+/* Centroids held before the buffered ones have to be folded in */
+#define TD_MAXCAP 512
+/* Upper bound on worker threads for the scan */
+#ifndef STATS_THREADS
+#define STATS_THREADS 8
+#endif
+
+typedef struct __tdcent {
+	double mean;
+	double weight;
+} tdcent;
+
+typedef struct __tdigest {
+	tdcent *c;
+	uint32_t n, cap;
+	uint32_t merged; /* the first merged centroids are sorted and compressed */
+	double total;
+} tdigest;
+
+/* One category, type and month, or whatever a report groups them into */
+typedef struct __statsgrp {
+	int32_t cat, type, year, month;
+	uint64_t n;
+	double mean, m2;
+	int64_t min, max, sum; /* cents */
+	tdigest td;
+	/* least squares over the monthly totals folded in, for the trend */
+	double sx, sy, sxx, sxy;
+	uint64_t np;
+	bool used;
+} statsgrp;
+
+typedef struct __statsmap {
+	statsgrp *grp;
+	uint32_t len, cap;
+} statsmap;
+
+int tdadd(tdigest *td, double val, double weight);
+int tdmerge(tdigest *dst, const tdigest *src);
+void tdcompress(tdigest *td);
+double tdquantile(tdigest *td, double q, double min, double max);
+void tdfree(tdigest *td);
+int statsinit(sqlite3 *dbptr);
+int stats(char **argstr, sqlite3 *dbptr);
@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2019, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* 
+ * Statement file parsing, the file is mapped privately and walked a line at a time
+ * without copying anything, callers get pointers back into the mapping. The only writes
+ * are quoted fields having their "" escapes collapsed in place, which never reach the file.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifndef __EXILE_BUDGET_H
+#include "budget.h"
+#endif
+#ifndef __EXILE_BUDGET_STMT_H
+#include "budget_stmt.h"
+#endif
+
+extern char *__progname;
+extern bool dbg;
+
+static char *stmtfield(char *pos, char *end, char sep, const char **field, size_t *len);
+static bool stmtnum(const char *field, size_t len, int64_t *val, int *scale);
+
+int
+stmtopen(const char *path, stmtfile *stmt) {
+	int fd;
+	struct stat st;
+
+	if ((path == NULL) || (stmt == NULL)) {
+		nxerr("Passed bad pointers!");
+		return(-1);
+	}
+	memset(stmt, 0, sizeof(stmtfile));
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0) {
+		nxerr(strerror(errno));
+		return(-1);
+	}
+	if (fstat(fd, &st) != 0) {
+		nxerr(strerror(errno));
+		close(fd);
+		return(-1);
+	}
+	/* an empty statement is valid, there's just nothing to map */
+	if (st.st_size > 0) {
+		if ((stmt->data = mmap(NULL, (size_t)st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+			nxerr(strerror(errno));
+			stmt->data = NULL;
+			close(fd);
+			return(-1);
+		}
+		stmt->len = (size_t)st.st_size;
+		posix_madvise(stmt->data, stmt->len, POSIX_MADV_SEQUENTIAL);
+	}
+	close(fd);
+	return(0);
+}
+
+void
+stmtclose(stmtfile *stmt) {
+	if ((stmt != NULL) && (stmt->data != NULL)) {
+		munmap(stmt->data, stmt->len);
+		stmt->data = NULL;
+	}
+}
+
+/* 
+ * Fetch the next usable row, returns 1 while there are rows, 0 at the end of the file.
+ * Malformed lines are reported and skipped rather than aborting the whole statement
+ */
+int
+stmtnext(stmtfile *stmt, stmtrow *row) {
+	char *line, *eol;
+	size_t len;
+
+	while ((stmt->data != NULL) && (stmt->off < stmt->len)) {
+		line = stmt->data + stmt->off;
+		if ((eol = memchr(line, '\n', stmt->len - stmt->off)) == NULL) {
+			eol = stmt->data + stmt->len;
+		}
+		stmt->off = (size_t)(eol - stmt->data) + 1;
+		stmt->line++;
+		len = (size_t)(eol - line);
+		if ((len > 0) && (line[len - 1] == '\r')) {
+			len--;
+		}
+		if ((len == 0) || (*line == '#')) {
+			continue;
+		}
+		if (stmtparse(line, len, row) == 0) {
+			row->line = stmt->line;
+			return(1);
+		}
+		/* the first line is allowed to be a column header */
+		if (stmt->line > 1) {
+			fprintf(stderr, "WRN: %s [%s:%u] %s: Skipping malformed statement line %zu: %.*s\n", 
+					__progname, __FILE__, __LINE__, __func__, stmt->line, (int)len, line);
+		}
+	}
+	return(0);
+}
+
+/* 
+ * Split off one field, handling double quoted fields with "" as an escaped quote.
+ * Escapes are collapsed in place, so a description reads the same as one typed in directly
+ */
+static char *
+stmtfield(char *pos, char *end, char sep, const char **field, size_t *len) {
+	char *c, *out;
+
+	if ((pos < end) && (*pos == '"')) {
+		for (c = out = ++pos; c < end; c++, out++) {
+			if ((*c == '"') && (((c + 1) >= end) || (c[1] != '"'))) {
+				break;
+			} else if (*c == '"') {
+				c++;
+			}
+			/* only lines that had an escape get written to */
+			if (out != c) {
+				*out = *c;
+			}
+		}
+		*field = pos;
+		*len = (size_t)(out - pos);
+		/* skip the closing quote and whatever junk sits before the separator */
+		for (; (c < end) && (*c != sep); c++) {}
+	} else {
+		for (c = pos; (c < end) && (*c != sep); c++) {}
+		*field = pos;
+		*len = (size_t)(c - pos);
+	}
+	return((c < end) ? c + 1 : NULL);
+}
+
+/* Fixed point parse of an amount into hundredths, no locale or floating point involved */
+static bool
+stmtnum(const char *field, size_t len, int64_t *val, int *scale) {
+	const char *c, *end;
+	bool neg, dot, digits;
+	neg = dot = digits = false;
+	*val = 0;
+	*scale = 0;
+
+	for (c = field, end = field + len; (c < end) && (*c == ' '); c++) {}
+	if ((c < end) && ((*c == '-') || (*c == '+'))) {
+		neg = (*c++ == '-');
+	}
+	for (; c < end; c++) {
+		if ((*c >= '0') && (*c <= '9')) {
+			if (dot && (++*scale > 2)) {
+				/* anything past cents is dropped */
+				continue;
+			}
+			*val = (*val * 10) + (*c - '0');
+			digits = true;
+		} else if ((*c == '.') && !dot) {
+			dot = true;
+		} else if ((*c == ',') || (*c == '$')) {
+			/* thousands separators and currency symbols */
+			continue;
+		} else if (*c != ' ') {
+			return(false);
+		}
+	}
+	for (*scale = (*scale > 2) ? 2 : *scale; *scale < 2; (*scale)++) {
+		*val *= 10;
+	}
+	*val = neg ? -*val : *val;
+	return(digits);
+}
+
+int
+stmtparse(char *line, size_t len, stmtrow *row) {
+	char *pos, *end;
+	const char *field;
+	size_t flen;
+	char sep;
+	int scale;
+
+	end = line + len;
+	sep = (memchr(line, '\t', len) != NULL) ? '\t' : ',';
+	memset(row, 0, sizeof(stmtrow));
+	/* date */
+	pos = stmtfield(line, end, sep, &field, &flen);
+	if ((pos == NULL) || (flen != 10) || (sscanf(field, "%4d-%2d-%2d", &row->year, &row->month, &row->day) != 3) 
+			|| (row->month < 1) || (row->month > 12) || (row->day < 1) || (row->day > 31)) {
+		return(-1);
+	}
+	/* amount */
+	pos = stmtfield(pos, end, sep, &field, &flen);
+	if (!stmtnum(field, flen, &row->cents, &scale) || (pos == NULL)) {
+		return(-1);
+	}
+	/* description, then the optional category */
+	pos = stmtfield(pos, end, sep, &row->desc, &row->desclen);
+	if (pos != NULL) {
+		stmtfield(pos, end, sep, &row->cat, &row->catlen);
+	}
+	return((row->desclen > 0) ? 0 : -1);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2019, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* 
+ * Declarations for reading bank statement files used by import and reconcile.
+ * A statement is one transaction per line, comma or tab separated:
+ *	YYYY-MM-DD,amount,description[,category]
+ * Negative amounts are money leaving the account. Blank lines, lines starting
+ * with '#' and a header line that doesn't start with a date are skipped.
+ */
+#define __EXILE_BUDGET_STMT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Fields point into the mapped statement (or the line handed to stmtparse), they are not NUL terminated */
+typedef struct __stmtrow {
+	int year, month, day;
+	int64_t cents; /* signed, as it appeared on the statement */
+	const char *desc;
+	size_t desclen;
+	const char *cat;
+	size_t catlen;
+	size_t line;
+} stmtrow;
+
+typedef struct __stmtfile {
+	char *data;
+	size_t len;
+	size_t off; /* where the next line starts */
+	size_t line;
+} stmtfile;
+
+int stmtopen(const char *path, stmtfile *stmt);
+int stmtnext(stmtfile *stmt, stmtrow *row);
+void stmtclose(stmtfile *stmt);
+int stmtparse(char *line, size_t len, stmtrow *row);
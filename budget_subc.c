@@ -31,20 +31,239 @@
  * DAMAGE.
  */
 
+#ifndef __EXILE_BUDGET_H
+#include "budget.h"
+#endif
 #ifndef __EXILE_BUDGET_SUBS_H
 #include "budget_subc.h"
 #endif
+#ifndef __EXILE_BUDGET_SEARCH_H
+#include "budget_search.h"
+#endif
+#ifndef __EXILE_BUDGET_ARCHIVE_H
+#include "budget_archive.h"
+#endif
+#ifndef __EXILE_BUDGET_SNAP_H
+#include "budget_snap.h"
+#endif
+#ifndef __EXILE_BUDGET_IMPORT_H
+#include "budget_import.h"
+#endif
+#ifndef __EXILE_BUDGET_CACHE_H
+#include "budget_cache.h"
+#endif
+#ifndef __EXILE_BUDGET_SPOOL_H
+#include "budget_spool.h"
+#endif
+#ifndef __EXILE_BUDGET_RECON_H
+#include "budget_recon.h"
+#endif
+#ifndef __EXILE_BUDGET_STATS_H
+#include "budget_stats.h"
+#endif
+#ifndef __EXILE_BUDGET_VAULT_H
+#include "budget_vault.h"
+#endif
+#ifndef __EXILE_BUDGET_MIGRATE_H
+#include "budget_migrate.h"
+#endif
+#ifndef __EXILE_BUDGET_OUT_H
+#include "budget_out.h"
+#endif
+
+extern char *__progname;
+extern bool dbg;
+
+/* 
+ * Map of the subcommand names to the actions they trigger,
+ * anything not listed here falls through to unknown
+ */
+static const struct {
+	const char *name;
+	dbaction action;
+} subcmds[] = {
+	{ "insert", insert },
+	{ "query", query },
+	{ "update", update },
+	{ "create", create },
+	{ "balance", balance },
+	{ "show", show },
+	{ "search", search },
+	{ "archive", archive_years },
+	{ "analyze", analysis },
+	{ "import", import_stmt },
+	{ "cache", cache_cmd },
+	{ "flush", flush_spool },
+	{ "reconcile", reconcile_stmt },
+	{ "stats", stats_report },
+	{ "vault", vault_cmd },
+	{ "migrate", migrate_schema },
+	{ NULL, unknown }
+};
+
+dbaction
+readaction(const char *input) {
+	register int i;
+
+	if (input == NULL) {
+		return(unknown);
+	}
+	for (i = 0; subcmds[i].name != NULL; i++) {
+		if (strcmp(input, subcmds[i].name) == 0) {
+			return(subcmds[i].action);
+		}
+	}
+	return(unknown);
+}
+
+static int runcmd(dbaction action, char **argstr, sqlite3 *dbptr);
+static bool cacheable(dbaction action, char **argstr);
+
+/* Only read-only reports are worth caching */
+static bool
+cacheable(dbaction action, char **argstr) {
+	return((action == search) || (action == stats_report) || ((action == analysis) && (argstr[1] != NULL) && (strcmp(argstr[1], "report") == 0)));
+}
+
+static int
+runcmd(dbaction action, char **argstr, sqlite3 *dbptr) {
+	int retc;
+	retc = 0;
+
+	switch (action) {
+		case insert:
+			retc = spoolinsert(argstr + 1, dbptr);
+			break;
+		case flush_spool:
+			retc = spoolflush(argstr + 1, dbptr);
+			break;
+		case search:
+			retc = ftsearch(argstr + 1, dbptr);
+			break;
+		case archive_years:
+			retc = archive(argstr + 1, dbptr);
+			break;
+		case analysis:
+			retc = analyze(argstr + 1, dbptr);
+			break;
+		case import_stmt:
+			retc = import(argstr + 1, dbptr);
+			break;
+		case stats_report:
+			retc = stats(argstr + 1, dbptr);
+			break;
+		case reconcile_stmt:
+			retc = reconcile(argstr + 1, dbptr);
+			break;
+		case vault_cmd:
+			retc = vault(argstr + 1, dbptr);
+			break;
+		case migrate_schema:
+			retc = migrate(argstr + 1, dbptr);
+			break;
+		case cache_cmd:
+			retc = cachecmd(argstr + 1, dbptr);
+			break;
+		case unknown:
+			fprintf(stderr, "ERR: %s [%s:%u] %s: Unknown command %s\n", __progname, __FILE__, __LINE__, __func__, *argstr);
+			retc = -1;
+			break;
+		default:
+			fprintf(stderr, "WRN: %s [%s:%u] %s: %s is not implemented\n", __progname, __FILE__, __LINE__, __func__, *argstr);
+			retc = -1;
+			break;
+	}
+	return(retc);
+}
+
+/* 
+ * Dispatch to the function handling the given subcommand,
+ * argstr[0] is the subcommand itself and everything after it belongs to the handler.
+ * Cacheable reports are served from the result cache when the ledger hasn't changed,
+ * otherwise their output is captured on the way through and stored for next time
+ */
+int
+parsecmd(char **argstr, sqlite3 *dbptr) {
+	int retc;
+	dbaction action;
+	size_t keylen, reslen;
+	char *key, *result, *scope;
+	rcache cache;
+	retc = 0;
+	key = result = scope = NULL;
+	keylen = reslen = 0;
+
+	if (dbg) {
+		nxentr();
+	}
+	if ((argstr == NULL) || (*argstr == NULL) || (dbptr == NULL)) {
+		nxerr("No command given");
+		if (dbg) { nxexit(); }
+		return(-1);
+	}
+	rptout = stdout;
+	action = readaction(*argstr);
+	if (cacheable(action, argstr) && (cacheopen(dbptr, &cache) == 0)) {
+		/* the output format and projection are part of what was cached */
+		if (((scope = sqlite3_mprintf("%d:%s", (int)outformat, (outcols != NULL) ? outcols : "")) != NULL) &&
+				((key = cachekey(scope, argstr, &keylen)) != NULL) && (cacheget(&cache, key, keylen, stdout) == 1)) {
+			if (dbg) { nxdbg("Served from the report cache"); }
+		} else if ((key != NULL) && (keylen < CACHE_ENTMAX) && (rptcapture(CACHE_ENTMAX - keylen) == 0)) {
+			retc = runcmd(action, argstr, dbptr);
+			/* nothing comes back once the report outgrew the cache, it's already been written */
+			if ((result = rptrelease(&reslen)) != NULL) {
+				if (retc == 0) {
+					cacheput(&cache, key, keylen, result, reslen);
+				}
+				fwrite(result, 1, reslen, stdout);
+				free(result);
+			}
+		} else {
+			rptout = stdout;
+			retc = runcmd(action, argstr, dbptr);
+		}
+		sqlite3_free(key);
+		sqlite3_free(scope);
+		cacheclose(&cache);
+	} else {
+		retc = runcmd(action, argstr, dbptr);
+	}
+	if (dbg) {
+		nxexit();
+	}
+	return(retc);
+}
+
+/* 
+ * Convert a numeric subcommand argument, complaining if any of it isn't a number
+ */
+int
+numarg(const char *arg, long long *val) {
+	char *end;
+	end = NULL;
+
+	if ((arg == NULL) || (val == NULL)) {
+		return(-1);
+	}
+	errno = 0;
+	*val = strtoll(arg, &end, 10);
+	if ((errno != 0) || (end == arg) || (*end != '\0')) {
+		fprintf(stderr, "ERR: %s [%s:%u] %s: %s is not a valid number\n", __progname, __FILE__, __LINE__, __func__, arg);
+		return(-1);
+	}
+	return(0);
+}
+
+/* 
+ * Generate a new transaction id, the clock keeps them generally incrementing
+ * and the random half keeps ids minted in the same nanosecond apart
+ */
+void
+mktid(char *tid) {
+	struct timespec now;
+	uint64_t rnd;
 
-//int
-//readaction(const char *input, cmdargs *dbcmd) {
-//	int retc;
-//	retc = 0;
-//	return(retc);
-//}
-//
-//int
-//parsecmd(const char **instr, cmdargs *dbcmd) {
-//	int retc;
-//	retc = 0;
-//	return(retc);
-//}
+	clock_gettime(CLOCK_REALTIME, &now);
+	arc4random_buf(&rnd, sizeof(rnd));
+	snprintf(tid, TID_LEN, "%016llx%016llx", ((unsigned long long)now.tv_sec * 1000000000ULL) + (unsigned long long)now.tv_nsec, (unsigned long long)rnd);
+}
@@ -47,9 +47,11 @@
 #include <err.h>
 #include <errno.h>
 #include <sqlite3.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 /* 
@@ -57,3 +59,8 @@
  * command structure definitions being used, so the function definitions make sense
  */
 int parsecmd(char **argstr, sqlite3 *dbptr);
+/* dbaction comes from budget.h, which must be included first */
+dbaction readaction(const char *input);
+int numarg(const char *arg, long long *val);
+/* tid needs room for TID_LEN bytes */
+void mktid(char *tid);
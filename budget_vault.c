@@ -0,0 +1,1101 @@
+/*
+ * Copyright (c) 2019, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* 
+ * Sealed ledger.
+ * Sealing moves transactions out of the plaintext table into vault, where the amount (with
+ * the date and category) and the description each sit in their own ChaCha20-Poly1305 box,
+ * authenticated together with the tid so boxes can't be swapped between rows.
+ * Rather than decrypting to filter, every row carries HMAC tokens of its month and category
+ * and the two indexes are over those, with the amount box and tid carried along so reports
+ * never read the table itself, let alone the descriptions.
+ * The keys are derived from the -k key file once per run, the cipher context is keyed once
+ * and only the nonce changes from one row of a result set to the next.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#ifndef __EXILE_BUDGET_H
+#include "budget.h"
+#endif
+#ifndef __EXILE_BUDGETCONF_H
+#include "budgetconf.h"
+#endif
+#ifndef __EXILE_BUDGET_SUBS_H
+#include "budget_subc.h"
+#endif
+#ifndef __EXILE_BUDGET_IMPORT_H
+#include "budget_import.h"
+#endif
+#ifndef __EXILE_BUDGET_CACHE_H
+#include "budget_cache.h"
+#endif
+#ifndef __EXILE_BUDGET_OUT_H
+#include "budget_out.h"
+#endif
+#ifndef __EXILE_BUDGET_CHAIN_H
+#include "budget_chain.h"
+#endif
+#ifndef __EXILE_BUDGET_STATS_H
+#include "budget_stats.h"
+#endif
+#ifndef __EXILE_BUDGET_ARCHIVE_H
+#include "budget_archive.h"
+#endif
+#ifndef __EXILE_BUDGET_SEARCH_H
+#include "budget_search.h"
+#endif
+#ifndef __EXILE_BUDGET_VAULT_H
+#include "budget_vault.h"
+#endif
+
+extern char *__progname;
+extern bool dbg;
+
+typedef enum __vaultgroup {
+	vgnone = 0,
+	vgcat = 1,
+	vgmonth = 2,
+	vgcatmonth = 3
+} vaultgroup;
+
+/* What a command was narrowed down to, turned into tokens before querying */
+typedef struct __vaultflt {
+	long long year, month, limit;
+	long long cat; /* -2 when not filtering */
+	vaultgroup group;
+} vaultflt;
+
+/* Carried from one schema to the next while sealing, the buffers only ever grow */
+typedef struct __vaultsealer {
+	sqlite3 *dbptr;
+	const vaultflt *flt;
+	EVP_CIPHER_CTX *ctx;
+	sqlite3_stmt *insq;
+	unsigned char *plain, *dbox;
+	size_t cap;
+	uint64_t sealed;
+} vaultsealer;
+
+typedef struct __vaultgrp {
+	int32_t cat, year, month;
+	uint64_t n;
+	int64_t sum, min, max;
+} vaultgrp;
+
+/* Session state, the key file is only turned into keys when a vault command needs them */
+static unsigned char vaultsecret[VAULT_MAXSECRET];
+static size_t vaultsecretlen = 0;
+static bool vaultkeyed = false;
+static unsigned char vaultenc[VAULT_KEYLEN], vaulttokkey[VAULT_KEYLEN];
+static const EVP_MD *vaultmd = NULL;
+
+static const char *const vaultcols[] = { "group", "count", "sum", "min", "max" };
+static const char *const vaultrows[] = { "tid", "date", "amount", "category", "desc" };
+
+/* Kept in step with budget.sql */
+static const char vaultschema[] = 
+	"CREATE TABLE IF NOT EXISTS main.vault_meta (salt blob NOT NULL, rounds integer NOT NULL, spec text NOT NULL, verifier blob NOT NULL);"
+	"CREATE TABLE IF NOT EXISTS main.vault (tid varchar(64) PRIMARY KEY, type integer, mtok blob NOT NULL, ctok blob NOT NULL, abox blob NOT NULL, dbox blob NOT NULL);"
+	"CREATE INDEX IF NOT EXISTS main.vault_month ON vault (mtok, ctok, abox, tid);"
+	"CREATE INDEX IF NOT EXISTS main.vault_cat ON vault (ctok, mtok, abox, tid);";
+/* Format string, the dupof expression and then the schema, main or an attached archive */
+static const char vaultsealq[] = 
+	"SELECT tid, year, month, day, type, CAST(round(amount * 100) AS INTEGER), ifnull(category, -1), desc, %s "
+	"FROM \"%w\".transactions WHERE ?1 = 0 OR year <= ?1 ORDER BY rowid;";
+
+static int vaultderive(sqlite3 *dbptr, bool create);
+static void vaulttok(char kind, int32_t a, int32_t b, unsigned char *tok);
+static void vaultpack(const vaultamt *amt, unsigned char *buf);
+static void vaultunpack(const unsigned char *buf, vaultamt *amt);
+static EVP_CIPHER_CTX *vaultcipher(bool enc);
+static int vaultbox(EVP_CIPHER_CTX *ctx, const char *tid, int tidlen, char kind, const unsigned char *plain, int len, unsigned char *box);
+static int vaultunbox(EVP_CIPHER_CTX *ctx, const char *tid, int tidlen, char kind, const unsigned char *box, int boxlen, unsigned char *plain);
+static char *vaultwhere(const vaultflt *flt);
+static void vaultbind(sqlite3_stmt *stmt, const vaultflt *flt);
+static void vaultlabel(sqlite3_stmt *nameq, int32_t cat, char *buf, size_t len);
+static int vaultorder(const void *a, const void *b);
+static int vaultseal(sqlite3 *dbptr, const vaultflt *flt);
+static int vaultsealfrom(const char *schema, void *arg);
+static int vaultshrink(sqlite3 *dbptr);
+static int vaultunseal(sqlite3 *dbptr, const vaultflt *flt);
+static int vaultreport(sqlite3 *dbptr, const vaultflt *flt);
+static int vaultlist(sqlite3 *dbptr, const vaultflt *flt);
+
+/* 
+ * Read the key file given with -k, a raw key or a passphrase both work since it's
+ * stretched with PBKDF2 anyway. A single trailing newline isn't part of the key
+ */
+int
+vaultopen(const char *keyfile) {
+	int fd;
+	ssize_t len;
+
+	if ((keyfile == NULL) || ((fd = open(keyfile, O_RDONLY|O_CLOEXEC)) < 0)) {
+		nxerr((keyfile == NULL) ? "No key file given" : strerror(errno));
+		return(-1);
+	}
+	len = read(fd, vaultsecret, sizeof(vaultsecret));
+	close(fd);
+	if ((len > 0) && (vaultsecret[len - 1] == '\n')) {
+		len--;
+		len -= ((len > 0) && (vaultsecret[len - 1] == '\r')) ? 1 : 0;
+	}
+	if (len <= 0) {
+		nxerr("The key file is empty");
+		return(-1);
+	}
+	vaultsecretlen = (size_t)len;
+	return(0);
+}
+
+void
+vaultclose(void) {
+	explicit_bzero(vaultsecret, sizeof(vaultsecret));
+	explicit_bzero(vaultenc, sizeof(vaultenc));
+	explicit_bzero(vaulttokkey, sizeof(vaulttokkey));
+	vaultsecretlen = 0;
+	vaultkeyed = false;
+}
+
+/* 
+ * Turn the key file into the cipher and token keys, using the salt and rounds stored with
+ * the vault. A stored verifier catches the wrong key before anything gets decrypted
+ */
+static int
+vaultderive(sqlite3 *dbptr, bool create) {
+	int retc;
+	long long rounds;
+	unsigned int maclen;
+	bool fresh;
+	char spec[32];
+	unsigned char salt[VAULT_SALTLEN], keys[VAULT_KEYLEN * 2], verifier[VAULT_TOKLEN], mac[EVP_MAX_MD_SIZE];
+	sqlite3_stmt *metaq;
+	metaq = NULL;
+	fresh = false;
+	rounds = VAULT_ROUNDS;
+	snprintf(spec, sizeof(spec), "%s", hashname(DEFAULT_HASHSPEC));
+
+	if (vaultkeyed) {
+		return(0);
+	}
+	if (vaultsecretlen == 0) {
+		nxerr("The vault needs a key file, give one with -k");
+		return(-1);
+	}
+	if (((retc = sqlite3_prepare_v2(dbptr, "SELECT salt, rounds, spec, verifier FROM main.vault_meta LIMIT 1;", -1, &metaq, NULL)) == SQLITE_OK)
+			&& (sqlite3_step(metaq) == SQLITE_ROW) && (sqlite3_column_bytes(metaq, 0) == VAULT_SALTLEN) && (sqlite3_column_bytes(metaq, 3) == VAULT_TOKLEN)) {
+		memcpy(salt, sqlite3_column_blob(metaq, 0), VAULT_SALTLEN);
+		rounds = sqlite3_column_int64(metaq, 1);
+		snprintf(spec, sizeof(spec), "%s", (const char *)sqlite3_column_text(metaq, 2));
+		memcpy(verifier, sqlite3_column_blob(metaq, 3), VAULT_TOKLEN);
+	} else if (create) {
+		arc4random_buf(salt, sizeof(salt));
+		fresh = true;
+		retc = SQLITE_OK;
+	} else {
+		nxerr("Nothing has been sealed in this database");
+		retc = -1;
+	}
+	sqlite3_finalize(metaq);
+	metaq = NULL;
+
+	if ((retc == SQLITE_OK) && ((vaultmd = EVP_get_digestbyname(spec)) == NULL)) {
+		fprintf(stderr, "ERR: %s [%s:%u] %s: The vault's hash %s isn't available\n", __progname, __FILE__, __LINE__, __func__, spec);
+		retc = -1;
+	}
+	if ((retc == SQLITE_OK) && ((rounds < 1) || (rounds > INT32_MAX)
+				|| (PKCS5_PBKDF2_HMAC((const char *)vaultsecret, (int)vaultsecretlen, salt, VAULT_SALTLEN, (int)rounds, vaultmd, sizeof(keys), keys) != 1))) {
+		nxerr("Couldn't derive the vault keys");
+		retc = -1;
+	}
+	if (retc == SQLITE_OK) {
+		memcpy(vaultenc, keys, VAULT_KEYLEN);
+		memcpy(vaulttokkey, keys + VAULT_KEYLEN, VAULT_KEYLEN);
+		HMAC(vaultmd, vaulttokkey, VAULT_KEYLEN, (const unsigned char *)"BDGVAULT", 8, mac, &maclen);
+		if (fresh && ((retc = sqlite3_prepare_v2(dbptr, "INSERT INTO main.vault_meta VALUES (?1, ?2, ?3, ?4);", -1, &metaq, NULL)) == SQLITE_OK)) {
+			sqlite3_bind_blob(metaq, 1, salt, VAULT_SALTLEN, SQLITE_STATIC);
+			sqlite3_bind_int64(metaq, 2, rounds);
+			sqlite3_bind_text(metaq, 3, spec, -1, SQLITE_STATIC);
+			sqlite3_bind_blob(metaq, 4, mac, VAULT_TOKLEN, SQLITE_STATIC);
+			if ((retc = sqlite3_step(metaq)) == SQLITE_DONE) {
+				retc = SQLITE_OK;
+			} else {
+				nxerr(sqlite3_errmsg(dbptr));
+			}
+			sqlite3_finalize(metaq);
+		} else if (!fresh && (memcmp(mac, verifier, VAULT_TOKLEN) != 0)) {
+			nxerr("Wrong key for this vault");
+			retc = -1;
+		}
+	}
+	explicit_bzero(keys, sizeof(keys));
+	if (retc == SQLITE_OK) {
+		explicit_bzero(vaultsecret, sizeof(vaultsecret));
+		vaultsecretlen = 0;
+		vaultkeyed = true;
+	}
+	return(retc);
+}
+
+/* Blind token for a (kind, a, b) triple, 'm' with year and month or 'c' with the category */
+static void
+vaulttok(char kind, int32_t a, int32_t b, unsigned char *tok) {
+	unsigned char msg[9], mac[EVP_MAX_MD_SIZE];
+	unsigned int maclen;
+	int i;
+
+	msg[0] = (unsigned char)kind;
+	for (i = 0; i < 4; i++) {
+		msg[1 + i] = (unsigned char)(((uint32_t)a >> (i * 8)) & 0xFF);
+		msg[5 + i] = (unsigned char)(((uint32_t)b >> (i * 8)) & 0xFF);
+	}
+	HMAC(vaultmd, vaulttokkey, VAULT_KEYLEN, msg, sizeof(msg), mac, &maclen);
+	memcpy(tok, mac, VAULT_TOKLEN);
+}
+
+static void
+vaultpack(const vaultamt *amt, unsigned char *buf) {
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		buf[i] = (unsigned char)(((uint64_t)amt->cents >> (i * 8)) & 0xFF);
+	}
+	for (i = 0; i < 4; i++) {
+		buf[8 + i] = (unsigned char)(((uint32_t)amt->year >> (i * 8)) & 0xFF);
+		buf[14 + i] = (unsigned char)(((uint32_t)amt->cat >> (i * 8)) & 0xFF);
+	}
+	buf[12] = (unsigned char)amt->month;
+	buf[13] = (unsigned char)amt->day;
+}
+
+static void
+vaultunpack(const unsigned char *buf, vaultamt *amt) {
+	uint64_t cents;
+	uint32_t year, cat;
+	int i;
+	cents = 0;
+	year = cat = 0;
+
+	for (i = 7; i >= 0; i--) {
+		cents = (cents << 8) | buf[i];
+	}
+	for (i = 3; i >= 0; i--) {
+		year = (year << 8) | buf[8 + i];
+		cat = (cat << 8) | buf[14 + i];
+	}
+	amt->cents = (int64_t)cents;
+	amt->year = (int32_t)year;
+	amt->month = buf[12];
+	amt->day = buf[13];
+	amt->cat = (int32_t)cat;
+}
+
+/* The key schedule is done here once, boxes only set their own nonce */
+static EVP_CIPHER_CTX *
+vaultcipher(bool enc) {
+	EVP_CIPHER_CTX *ctx;
+
+	if (((ctx = EVP_CIPHER_CTX_new()) != NULL) && (EVP_CipherInit_ex(ctx, EVP_chacha20_poly1305(), NULL, vaultenc, NULL, enc ? 1 : 0) != 1)) {
+		EVP_CIPHER_CTX_free(ctx);
+		ctx = NULL;
+	}
+	if (ctx == NULL) {
+		nxerr("ChaCha20-Poly1305 isn't available");
+	}
+	return(ctx);
+}
+
+/* Seal plain into box as nonce, ciphertext and tag, returns the box length */
+static int
+vaultbox(EVP_CIPHER_CTX *ctx, const char *tid, int tidlen, char kind, const unsigned char *plain, int len, unsigned char *box) {
+	int outl, finl;
+	unsigned char aad;
+	aad = (unsigned char)kind;
+
+	arc4random_buf(box, VAULT_NONCELEN);
+	if ((EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, box) != 1)
+			|| (EVP_EncryptUpdate(ctx, NULL, &outl, (const unsigned char *)tid, tidlen) != 1)
+			|| (EVP_EncryptUpdate(ctx, NULL, &outl, &aad, 1) != 1)
+			|| (EVP_EncryptUpdate(ctx, box + VAULT_NONCELEN, &outl, plain, len) != 1)
+			|| (EVP_EncryptFinal_ex(ctx, box + VAULT_NONCELEN + outl, &finl) != 1)
+			|| (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, VAULT_TAGLEN, box + VAULT_NONCELEN + len) != 1)) {
+		return(-1);
+	}
+	return(VAULT_BOXLEN(len));
+}
+
+/* Open a box into plain, which needs room for boxlen bytes, returns the plaintext length */
+static int
+vaultunbox(EVP_CIPHER_CTX *ctx, const char *tid, int tidlen, char kind, const unsigned char *box, int boxlen, unsigned char *plain) {
+	int outl, finl, len;
+	unsigned char aad;
+	aad = (unsigned char)kind;
+
+	if ((box == NULL) || (boxlen < VAULT_BOXLEN(0))) {
+		return(-1);
+	}
+	len = boxlen - VAULT_BOXLEN(0);
+	if ((EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, box) != 1)
+			|| (EVP_DecryptUpdate(ctx, NULL, &outl, (const unsigned char *)tid, tidlen) != 1)
+			|| (EVP_DecryptUpdate(ctx, NULL, &outl, &aad, 1) != 1)
+			|| (EVP_DecryptUpdate(ctx, plain, &outl, box + VAULT_NONCELEN, len) != 1)
+			|| (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, VAULT_TAGLEN, (void *)(uintptr_t)(box + VAULT_NONCELEN + len)) != 1)
+			|| (EVP_DecryptFinal_ex(ctx, plain + outl, &finl) != 1)) {
+		return(-1);
+	}
+	return(len);
+}
+
+/* Months are ?1 - ?12 and the category ?13, bound by vaultbind() */
+static char *
+vaultwhere(const vaultflt *flt) {
+	sqlite3_str *sql;
+	int i;
+
+	sql = sqlite3_str_new(NULL);
+	sqlite3_str_appendall(sql, " WHERE 1");
+	if (flt->year > 0) {
+		sqlite3_str_appendall(sql, " AND mtok IN (?1");
+		for (i = 2; (flt->month == 0) && (i <= 12); i++) {
+			sqlite3_str_appendf(sql, ", ?%d", i);
+		}
+		sqlite3_str_appendall(sql, ")");
+	}
+	if (flt->cat > -2) {
+		sqlite3_str_appendall(sql, " AND ctok = ?13");
+	}
+	return(sqlite3_str_finish(sql));
+}
+
+static void
+vaultbind(sqlite3_stmt *stmt, const vaultflt *flt) {
+	unsigned char tok[VAULT_TOKLEN];
+	int i;
+
+	for (i = 1; (flt->year > 0) && (i <= 12); i++) {
+		vaulttok('m', (int32_t)flt->year, (flt->month > 0) ? (int32_t)flt->month : i, tok);
+		sqlite3_bind_blob(stmt, i, tok, VAULT_TOKLEN, SQLITE_TRANSIENT);
+		if (flt->month > 0) {
+			break;
+		}
+	}
+	if (flt->cat > -2) {
+		vaulttok('c', (int32_t)flt->cat, 0, tok);
+		sqlite3_bind_blob(stmt, 13, tok, VAULT_TOKLEN, SQLITE_TRANSIENT);
+	}
+}
+
+static void
+vaultlabel(sqlite3_stmt *nameq, int32_t cat, char *buf, size_t len) {
+	snprintf(buf, len, "%s", (cat < 0) ? "NONE" : "");
+	if ((cat >= 0) && (nameq != NULL)) {
+		sqlite3_reset(nameq);
+		sqlite3_bind_int64(nameq, 1, cat);
+		snprintf(buf, len, "%s", (sqlite3_step(nameq) == SQLITE_ROW) ? (const char *)sqlite3_column_text(nameq, 0) : "");
+		if (*buf == '\0') {
+			snprintf(buf, len, "%d", (int)cat);
+		}
+	}
+}
+
+static int
+vaultorder(const void *a, const void *b) {
+	const vaultgrp *x, *y;
+	x = a;
+	y = b;
+
+	if (x->cat != y->cat) {
+		return((x->cat < y->cat) ? -1 : 1);
+	}
+	if (x->year != y->year) {
+		return((x->year < y->year) ? -1 : 1);
+	}
+	return((x->month > y->month) - (x->month < y->month));
+}
+
+/* 
+ * Move transactions, through the given year or all of them, into the vault.
+ * Archived years in range are attached and sealed along with main, so no plaintext copy
+ * survives in a <db>.YYYY file. secure_delete keeps the plaintext from lingering in freed pages,
+ * the full-text index is merged down so deleted terms are gone too, each archive that was
+ * emptied is vacuumed afterwards, and the snapshot and cache go with them
+ */
+static int
+vaultseal(sqlite3 *dbptr, const vaultflt *flt) {
+	int retc;
+	const char *dbfile;
+	char *path;
+	vaultsealer sealer;
+	sqlite3_stmt *readq;
+	readq = NULL;
+	memset(&sealer, 0, sizeof(vaultsealer));
+	sealer.dbptr = dbptr;
+	sealer.flt = flt;
+
+	/* attaching can't happen inside the transaction, and a year left unattached would keep its plaintext */
+	if ((sqlite3_table_column_metadata(dbptr, "main", "archives", "path", NULL, NULL, NULL, NULL, NULL) == SQLITE_OK)
+			&& (sqlite3_prepare_v2(dbptr, "SELECT count(*) FROM main.archives WHERE ?1 = 0 OR year <= ?1;", -1, &readq, NULL) == SQLITE_OK)) {
+		sqlite3_bind_int64(readq, 1, flt->year);
+		if ((sqlite3_step(readq) == SQLITE_ROW) && (sqlite3_column_int64(readq, 0) > ARCHIVE_MAX)) {
+			fprintf(stderr, "ERR: %s [%s:%u] %s: More than %d archived years to seal, seal them a few years at a time with -y\n",
+					__progname, __FILE__, __LINE__, __func__, ARCHIVE_MAX);
+			sqlite3_finalize(readq);
+			return(-1);
+		}
+	}
+	sqlite3_finalize(readq);
+	readq = NULL;
+	if ((retc = archattach(dbptr, 0, flt->year)) != SQLITE_OK) {
+		return(retc);
+	}
+	/* with no schema named this covers every archive attached above */
+	sqlite3_exec(dbptr, "PRAGMA secure_delete = ON;", NULL, NULL, NULL);
+	if ((retc = sqlite3_exec(dbptr, "BEGIN IMMEDIATE;", NULL, NULL, NULL)) != SQLITE_OK) {
+		nxerr(sqlite3_errmsg(dbptr));
+		return(retc);
+	}
+	if ((retc = sqlite3_exec(dbptr, vaultschema, NULL, NULL, NULL)) != SQLITE_OK) {
+		nxerr(sqlite3_errmsg(dbptr));
+	} else if (((retc = vaultderive(dbptr, true)) == SQLITE_OK) && ((sealer.ctx = vaultcipher(true)) == NULL)) {
+		retc = -1;
+	}
+	if ((retc == SQLITE_OK) && ((retc = sqlite3_prepare_v2(dbptr, "INSERT INTO main.vault (tid, type, mtok, ctok, abox, dbox) VALUES (?1, ?2, ?3, ?4, ?5, ?6);", -1, &sealer.insq, NULL)) != SQLITE_OK)) {
+		nxerr(sqlite3_errmsg(dbptr));
+	}
+	if (retc == SQLITE_OK) {
+		retc = archeach(dbptr, vaultsealfrom, &sealer);
+	}
+	/* the per month aggregates, digests included, are plaintext too and nothing rescans a month with no rows left */
+	if ((retc == SQLITE_OK) && ((retc = statsinit(dbptr)) == SQLITE_OK)
+			&& ((retc = sqlite3_prepare_v2(dbptr, "DELETE FROM main.stats_months WHERE ?1 = 0 OR year <= ?1;", -1, &readq, NULL)) == SQLITE_OK)) {
+		sqlite3_bind_int64(readq, 1, flt->year);
+		retc = (sqlite3_step(readq) == SQLITE_DONE) ? SQLITE_OK : sqlite3_errcode(dbptr);
+	}
+	sqlite3_finalize(readq);
+	readq = NULL;
+	if ((retc == SQLITE_OK) && ((retc = sqlite3_prepare_v2(dbptr, "DELETE FROM main.stats_closed WHERE ?1 = 0 OR year <= ?1;", -1, &readq, NULL)) == SQLITE_OK)) {
+		sqlite3_bind_int64(readq, 1, flt->year);
+		retc = (sqlite3_step(readq) == SQLITE_DONE) ? SQLITE_OK : sqlite3_errcode(dbptr);
+	}
+	if (retc == SQLITE_OK) {
+		retc = sqlite3_exec(dbptr, "INSERT INTO main.trans_fts (trans_fts) VALUES ('optimize');", NULL, NULL, NULL);
+	}
+	if (retc != SQLITE_OK) {
+		if (retc > 0) {
+			nxerr(sqlite3_errmsg(dbptr));
+		}
+		sqlite3_exec(dbptr, "ROLLBACK;", NULL, NULL, NULL);
+	} else if ((retc = sqlite3_exec(dbptr, "COMMIT;", NULL, NULL, NULL)) != SQLITE_OK) {
+		nxerr(sqlite3_errmsg(dbptr));
+		sqlite3_exec(dbptr, "ROLLBACK;", NULL, NULL, NULL);
+	} else {
+		/* anything computed from the plaintext rows has to go as well */
+		cacheinval(dbptr);
+		if (((dbfile = sqlite3_db_filename(dbptr, "main")) != NULL) && (*dbfile != '\0') && ((path = sqlite3_mprintf("%s.snap", dbfile)) != NULL)) {
+			unlink(path);
+			sqlite3_free(path);
+		}
+		/* secure_delete already zeroed the freed pages, this gives the space back as well */
+		retc = vaultshrink(dbptr);
+		fprintf(stdout, "%llu transactions sealed\n", (unsigned long long)sealer.sealed);
+	}
+	if (sealer.plain != NULL) {
+		explicit_bzero(sealer.plain, sealer.cap);
+	}
+	free(sealer.plain);
+	free(sealer.dbox);
+	EVP_CIPHER_CTX_free(sealer.ctx);
+	sqlite3_finalize(readq);
+	sqlite3_finalize(sealer.insq);
+	return(retc);
+}
+
+/* Seal the rows of one schema, main or an attached archive, and delete the plaintext */
+static int
+vaultsealfrom(const char *schema, void *arg) {
+	int retc, tidlen, len;
+	vaultsealer *sealer;
+	vaultamt amt;
+	size_t desclen, duplen;
+	const char *tid;
+	char *sql;
+	unsigned char mtok[VAULT_TOKLEN], ctok[VAULT_TOKLEN], packed[VAULT_AMTLEN], abox[VAULT_BOXLEN(VAULT_AMTLEN)];
+	unsigned char *grown;
+	sqlite3_stmt *readq;
+	sealer = arg;
+	readq = NULL;
+
+	/* archives made before duplicates were tracked have no dupof column */
+	sql = sqlite3_mprintf(vaultsealq, 
+			(sqlite3_table_column_metadata(sealer->dbptr, schema, "transactions", "dupof", NULL, NULL, NULL, NULL, NULL) == SQLITE_OK) ? "ifnull(dupof, '')" : "''", schema);
+	if ((retc = sqlite3_prepare_v2(sealer->dbptr, sql, -1, &readq, NULL)) != SQLITE_OK) {
+		nxerr(sqlite3_errmsg(sealer->dbptr));
+	} else {
+		sqlite3_bind_int64(readq, 1, sealer->flt->year);
+	}
+	sqlite3_free(sql);
+	while ((retc == SQLITE_OK) && (sqlite3_step(readq) == SQLITE_ROW)) {
+		tid = (const char *)sqlite3_column_text(readq, 0);
+		tidlen = sqlite3_column_bytes(readq, 0);
+		amt.year = sqlite3_column_int(readq, 1);
+		amt.month = sqlite3_column_int(readq, 2);
+		amt.day = sqlite3_column_int(readq, 3);
+		amt.cents = sqlite3_column_int64(readq, 5);
+		amt.cat = sqlite3_column_int(readq, 6);
+		/* the description box is its length, the description and whatever it duplicates */
+		desclen = (size_t)sqlite3_column_bytes(readq, 7);
+		duplen = (size_t)sqlite3_column_bytes(readq, 8);
+		if ((4 + desclen + duplen) > sealer->cap) {
+			sealer->cap = 4 + desclen + duplen + 256;
+			if ((grown = realloc(sealer->plain, sealer->cap)) == NULL) {
+				nxerr(strerror(errno));
+				retc = -1;
+				break;
+			}
+			sealer->plain = grown;
+			if ((grown = realloc(sealer->dbox, VAULT_BOXLEN(sealer->cap))) == NULL) {
+				nxerr(strerror(errno));
+				retc = -1;
+				break;
+			}
+			sealer->dbox = grown;
+		}
+		sealer->plain[0] = (unsigned char)(desclen & 0xFF);
+		sealer->plain[1] = (unsigned char)((desclen >> 8) & 0xFF);
+		sealer->plain[2] = (unsigned char)((desclen >> 16) & 0xFF);
+		sealer->plain[3] = (unsigned char)((desclen >> 24) & 0xFF);
+		memcpy(sealer->plain + 4, sqlite3_column_text(readq, 7), desclen);
+		memcpy(sealer->plain + 4 + desclen, sqlite3_column_text(readq, 8), duplen);
+		vaultpack(&amt, packed);
+		vaulttok('m', amt.year, amt.month, mtok);
+		vaulttok('c', amt.cat, 0, ctok);
+		if ((vaultbox(sealer->ctx, tid, tidlen, 'a', packed, VAULT_AMTLEN, abox) < 0)
+				|| ((len = vaultbox(sealer->ctx, tid, tidlen, 'd', sealer->plain, (int)(4 + desclen + duplen), sealer->dbox)) < 0)) {
+			nxerr("Couldn't seal a transaction");
+			retc = -1;
+			break;
+		}
+		sqlite3_bind_text(sealer->insq, 1, tid, tidlen, SQLITE_STATIC);
+		sqlite3_bind_int64(sealer->insq, 2, sqlite3_column_int64(readq, 4));
+		sqlite3_bind_blob(sealer->insq, 3, mtok, VAULT_TOKLEN, SQLITE_STATIC);
+		sqlite3_bind_blob(sealer->insq, 4, ctok, VAULT_TOKLEN, SQLITE_STATIC);
+		sqlite3_bind_blob(sealer->insq, 5, abox, (int)sizeof(abox), SQLITE_STATIC);
+		sqlite3_bind_blob(sealer->insq, 6, sealer->dbox, len, SQLITE_STATIC);
+		if ((retc = sqlite3_step(sealer->insq)) == SQLITE_DONE) {
+			retc = SQLITE_OK;
+			sealer->sealed++;
+		} else {
+			nxerr(sqlite3_errmsg(sealer->dbptr));
+		}
+		sqlite3_reset(sealer->insq);
+	}
+	sqlite3_finalize(readq);
+	readq = NULL;
+	sql = sqlite3_mprintf("DELETE FROM \"%w\".transactions WHERE ?1 = 0 OR year <= ?1;", schema);
+	if ((retc == SQLITE_OK) && ((retc = sqlite3_prepare_v2(sealer->dbptr, sql, -1, &readq, NULL)) == SQLITE_OK)) {
+		sqlite3_bind_int64(readq, 1, sealer->flt->year);
+		retc = (sqlite3_step(readq) == SQLITE_DONE) ? SQLITE_OK : sqlite3_errcode(sealer->dbptr);
+	}
+	sqlite3_finalize(readq);
+	sqlite3_free(sql);
+	/* an archive keeps its registry entry, the file is still where the hash chain looks first */
+	if ((retc == SQLITE_OK) && (strcmp(schema, "main") != 0)) {
+		sql = sqlite3_mprintf("UPDATE main.archives SET rows = (SELECT count(*) FROM \"%w\".transactions) WHERE ('arc' || year) = %Q;", schema, schema);
+		retc = sqlite3_exec(sealer->dbptr, sql, NULL, NULL, NULL);
+		sqlite3_free(sql);
+	}
+	return(retc);
+}
+
+/* 
+ * VACUUM every attached archive, main is left to the user. VACUUM won't run beside an
+ * unfinished statement, so the list is reset before each one and picks up after the last name
+ */
+static int
+vaultshrink(sqlite3 *dbptr) {
+	int retc;
+	char *schema;
+	sqlite3_stmt *dblist;
+	schema = NULL;
+	dblist = NULL;
+
+	if ((retc = sqlite3_prepare_v2(dbptr, "SELECT name FROM pragma_database_list WHERE name GLOB 'arc[0-9]*' AND name > ?1 ORDER BY name LIMIT 1;", -1, &dblist, NULL)) != SQLITE_OK) {
+		nxerr(sqlite3_errmsg(dbptr));
+	}
+	while ((retc == SQLITE_OK) && (sqlite3_bind_text(dblist, 1, (schema != NULL) ? schema : "", -1, SQLITE_TRANSIENT) == SQLITE_OK)
+			&& (sqlite3_step(dblist) == SQLITE_ROW)) {
+		sqlite3_free(schema);
+		schema = sqlite3_mprintf("%s", (const char *)sqlite3_column_text(dblist, 0));
+		sqlite3_reset(dblist);
+		retc = ftsvacuum(dbptr, schema);
+	}
+	sqlite3_finalize(dblist);
+	sqlite3_free(schema);
+	return(retc);
+}
+
+/* Move sealed transactions back into the ledger, tid and all, so the hash chain still matches */
+static int
+vaultunseal(sqlite3 *dbptr, const vaultflt *flt) {
+	int retc, tidlen, len;
+	uint32_t desclen;
+	uint64_t opened;
+	vaultamt amt;
+	size_t cap;
+	const char *tid;
+	char *where, *sql;
+	unsigned char packed[VAULT_BOXLEN(VAULT_AMTLEN)];
+	unsigned char *plain, *grown;
+	EVP_CIPHER_CTX *ctx;
+	sqlite3_stmt *readq, *insq;
+	readq = insq = NULL;
+	plain = NULL;
+	cap = 0;
+	opened = 0;
+	ctx = NULL;
+	where = vaultwhere(flt);
+
+	sqlite3_exec(dbptr, "PRAGMA secure_delete = ON;", NULL, NULL, NULL);
+	if ((retc = sqlite3_exec(dbptr, "BEGIN IMMEDIATE;", NULL, NULL, NULL)) != SQLITE_OK) {
+		nxerr(sqlite3_errmsg(dbptr));
+		sqlite3_free(where);
+		return(retc);
+	}
+	if (((retc = vaultderive(dbptr, false)) == SQLITE_OK) && ((ctx = vaultcipher(false)) == NULL)) {
+		retc = -1;
+	}
+	sql = sqlite3_mprintf("SELECT tid, type, abox, dbox FROM main.vault%s ORDER BY rowid;", where);
+	if ((retc == SQLITE_OK) && (((retc = sqlite3_prepare_v2(dbptr, sql, -1, &readq, NULL)) != SQLITE_OK)
+				|| ((retc = sqlite3_prepare_v2(dbptr, "INSERT INTO main.transactions (tid, year, month, day, type, amount, category, desc, fprint, dupof) "
+						"VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10);", -1, &insq, NULL)) != SQLITE_OK))) {
+		nxerr(sqlite3_errmsg(dbptr));
+	}
+	sqlite3_free(sql);
+	if (retc == SQLITE_OK) {
+		vaultbind(readq, flt);
+	}
+	while ((retc == SQLITE_OK) && (sqlite3_step(readq) == SQLITE_ROW)) {
+		tid = (const char *)sqlite3_column_text(readq, 0);
+		tidlen = sqlite3_column_bytes(readq, 0);
+		if ((size_t)sqlite3_column_bytes(readq, 3) > cap) {
+			cap = (size_t)sqlite3_column_bytes(readq, 3) + 256;
+			if ((grown = realloc(plain, cap)) == NULL) {
+				nxerr(strerror(errno));
+				retc = -1;
+				break;
+			}
+			plain = grown;
+		}
+		if ((sqlite3_column_bytes(readq, 2) != (int)sizeof(packed))
+				|| (vaultunbox(ctx, tid, tidlen, 'a', sqlite3_column_blob(readq, 2), sqlite3_column_bytes(readq, 2), packed) != VAULT_AMTLEN)
+				|| ((len = vaultunbox(ctx, tid, tidlen, 'd', sqlite3_column_blob(readq, 3), sqlite3_column_bytes(readq, 3), plain)) < 4)
+				|| ((desclen = (uint32_t)plain[0] | ((uint32_t)plain[1] << 8) | ((uint32_t)plain[2] << 16) | ((uint32_t)plain[3] << 24)) > (uint32_t)(len - 4))) {
+			fprintf(stderr, "ERR: %s [%s:%u] %s: Sealed transaction %s fails authentication\n", __progname, __FILE__, __LINE__, __func__, tid);
+			retc = -1;
+			break;
+		}
+		vaultunpack(packed, &amt);
+		sqlite3_bind_text(insq, 1, tid, tidlen, SQLITE_STATIC);
+		sqlite3_bind_int(insq, 2, amt.year);
+		sqlite3_bind_int(insq, 3, amt.month);
+		sqlite3_bind_int(insq, 4, amt.day);
+		sqlite3_bind_int64(insq, 5, sqlite3_column_int64(readq, 1));
+		sqlite3_bind_double(insq, 6, (double)amt.cents / 100.0);
+		if (amt.cat < 0) {
+			sqlite3_bind_null(insq, 7);
+		} else {
+			sqlite3_bind_int(insq, 7, amt.cat);
+		}
+		sqlite3_bind_text(insq, 8, (const char *)plain + 4, (int)desclen, SQLITE_STATIC);
+		sqlite3_bind_int64(insq, 9, (sqlite3_int64)fingerprint(amt.year, amt.month, amt.day, sqlite3_column_int(readq, 1), amt.cents, (const char *)plain + 4, desclen));
+		if ((len - 4) > (int)desclen) {
+			sqlite3_bind_text(insq, 10, (const char *)plain + 4 + desclen, len - 4 - (int)desclen, SQLITE_STATIC);
+		} else {
+			sqlite3_bind_null(insq, 10);
+		}
+		if ((retc = sqlite3_step(insq)) == SQLITE_DONE) {
+			retc = SQLITE_OK;
+			opened++;
+		} else {
+			nxerr(sqlite3_errmsg(dbptr));
+		}
+		sqlite3_reset(insq);
+	}
+	sqlite3_finalize(readq);
+	readq = NULL;
+	sql = sqlite3_mprintf("DELETE FROM main.vault%s;", where);
+	if ((retc == SQLITE_OK) && ((retc = sqlite3_prepare_v2(dbptr, sql, -1, &readq, NULL)) == SQLITE_OK)) {
+		vaultbind(readq, flt);
+		retc = (sqlite3_step(readq) == SQLITE_DONE) ? SQLITE_OK : sqlite3_errcode(dbptr);
+	}
+	sqlite3_free(sql);
+	/* the rows were chained before they were sealed, this only clears them from the queue */
+	if (retc == SQLITE_OK) {
+		chainextend(dbptr);
+	}
+	if (retc != SQLITE_OK) {
+		if (retc > 0) {
+			nxerr(sqlite3_errmsg(dbptr));
+		}
+		sqlite3_exec(dbptr, "ROLLBACK;", NULL, NULL, NULL);
+	} else if ((retc = sqlite3_exec(dbptr, "COMMIT;", NULL, NULL, NULL)) != SQLITE_OK) {
+		nxerr(sqlite3_errmsg(dbptr));
+		sqlite3_exec(dbptr, "ROLLBACK;", NULL, NULL, NULL);
+	} else {
+		fprintf(stdout, "%llu transactions opened\n", (unsigned long long)opened);
+	}
+	if (plain != NULL) {
+		explicit_bzero(plain, cap);
+	}
+	free(plain);
+	EVP_CIPHER_CTX_free(ctx);
+	sqlite3_finalize(readq);
+	sqlite3_finalize(insq);
+	sqlite3_free(where);
+	return(retc);
+}
+
+/* 
+ * count/sum/min/max over the sealed rows. Rows come off one of the token indexes already
+ * ordered by group, so groups are closed as the tokens change and only the small amount
+ * boxes are opened. The finished groups are put back in calendar order at the end
+ */
+static int
+vaultreport(sqlite3 *dbptr, const vaultflt *flt) {
+	int retc;
+	size_t ngrp, cap, i;
+	bool split;
+	vaultamt amt;
+	vaultgrp *grp, *grown;
+	const char *tid, *order;
+	char *where, *sql, label[160];
+	unsigned char prevm[VAULT_TOKLEN], prevc[VAULT_TOKLEN], packed[VAULT_BOXLEN(VAULT_AMTLEN)];
+	EVP_CIPHER_CTX *ctx;
+	sqlite3_stmt *readq, *nameq;
+	outbuf out;
+	readq = nameq = NULL;
+	grp = NULL;
+	ngrp = cap = 0;
+	ctx = NULL;
+	sql = NULL;
+	memset(prevm, 0, sizeof(prevm));
+	memset(prevc, 0, sizeof(prevc));
+
+	if (((retc = vaultderive(dbptr, false)) == SQLITE_OK) && ((ctx = vaultcipher(false)) == NULL)) {
+		retc = -1;
+	}
+	switch (flt->group) {
+		case vgcat:
+			order = " ORDER BY ctok";
+			break;
+		case vgmonth:
+			order = " ORDER BY mtok";
+			break;
+		case vgcatmonth:
+			order = " ORDER BY ctok, mtok";
+			break;
+		default:
+			order = "";
+			break;
+	}
+	if (retc == SQLITE_OK) {
+		where = vaultwhere(flt);
+		sql = sqlite3_mprintf("SELECT ctok, mtok, abox, tid FROM main.vault%s%s;", where, order);
+		sqlite3_free(where);
+		if ((retc = sqlite3_prepare_v2(dbptr, sql, -1, &readq, NULL)) != SQLITE_OK) {
+			nxerr(sqlite3_errmsg(dbptr));
+		} else {
+			vaultbind(readq, flt);
+		}
+	}
+	while ((retc == SQLITE_OK) && (sqlite3_step(readq) == SQLITE_ROW)) {
+		if ((sqlite3_column_bytes(readq, 0) != VAULT_TOKLEN) || (sqlite3_column_bytes(readq, 1) != VAULT_TOKLEN)) {
+			continue;
+		}
+		split = (ngrp == 0);
+		split = split || (((flt->group == vgcat) || (flt->group == vgcatmonth)) && (memcmp(prevc, sqlite3_column_blob(readq, 0), VAULT_TOKLEN) != 0));
+		split = split || (((flt->group == vgmonth) || (flt->group == vgcatmonth)) && (memcmp(prevm, sqlite3_column_blob(readq, 1), VAULT_TOKLEN) != 0));
+		tid = (const char *)sqlite3_column_text(readq, 3);
+		if ((sqlite3_column_bytes(readq, 2) != (int)sizeof(packed))
+				|| (vaultunbox(ctx, tid, sqlite3_column_bytes(readq, 3), 'a', sqlite3_column_blob(readq, 2), sqlite3_column_bytes(readq, 2), packed) != VAULT_AMTLEN)) {
+			fprintf(stderr, "ERR: %s [%s:%u] %s: Sealed transaction %s fails authentication\n", __progname, __FILE__, __LINE__, __func__, tid);
+			retc = -1;
+			break;
+		}
+		vaultunpack(packed, &amt);
+		if (split) {
+			if (ngrp == cap) {
+				cap = (cap == 0) ? 64 : cap * 2;
+				if ((grown = realloc(grp, cap * sizeof(vaultgrp))) == NULL) {
+					nxerr(strerror(errno));
+					retc = -1;
+					break;
+				}
+				grp = grown;
+			}
+			memset(&grp[ngrp], 0, sizeof(vaultgrp));
+			grp[ngrp].cat = ((flt->group == vgcat) || (flt->group == vgcatmonth)) ? amt.cat : 0;
+			grp[ngrp].year = ((flt->group == vgmonth) || (flt->group == vgcatmonth)) ? amt.year : 0;
+			grp[ngrp].month = ((flt->group == vgmonth) || (flt->group == vgcatmonth)) ? amt.month : 0;
+			grp[ngrp].min = grp[ngrp].max = amt.cents;
+			ngrp++;
+			memcpy(prevc, sqlite3_column_blob(readq, 0), VAULT_TOKLEN);
+			memcpy(prevm, sqlite3_column_blob(readq, 1), VAULT_TOKLEN);
+		}
+		grp[ngrp - 1].n++;
+		grp[ngrp - 1].sum += amt.cents;
+		grp[ngrp - 1].min = (amt.cents < grp[ngrp - 1].min) ? amt.cents : grp[ngrp - 1].min;
+		grp[ngrp - 1].max = (amt.cents > grp[ngrp - 1].max) ? amt.cents : grp[ngrp - 1].max;
+	}
+	if (retc == SQLITE_OK) {
+		qsort(grp, ngrp, sizeof(vaultgrp), vaultorder);
+		sqlite3_prepare_v2(dbptr, "SELECT cat FROM main.xcats WHERE key = ?1;", -1, &nameq, NULL);
+		retc = outbegin(&out, rptout, vaultcols, 5);
+	}
+	for (i = 0; (retc == SQLITE_OK) && (i < ngrp); i++) {
+		switch (flt->group) {
+			case vgcat:
+				vaultlabel(nameq, grp[i].cat, label, sizeof(label));
+				break;
+			case vgmonth:
+				snprintf(label, sizeof(label), "%04d.%02d", (int)grp[i].year, (int)grp[i].month);
+				break;
+			case vgcatmonth:
+				vaultlabel(nameq, grp[i].cat, label, sizeof(label));
+				snprintf(label + strlen(label), sizeof(label) - strlen(label), " %04d.%02d", (int)grp[i].year, (int)grp[i].month);
+				break;
+			default:
+				snprintf(label, sizeof(label), "TOTAL");
+				break;
+		}
+		outstr(&out, 0, label, -1);
+		outint(&out, 1, (int64_t)grp[i].n);
+		outdec(&out, 2, grp[i].sum, 2);
+		outdec(&out, 3, grp[i].min, 2);
+		outdec(&out, 4, grp[i].max, 2);
+		retc = outrow(&out);
+	}
+	if (retc == SQLITE_OK) {
+		retc = outend(&out);
+	}
+	if (dbg) {
+		fprintf(stderr, "DBG: %s [%s:%u] %s: %zu groups\n", __progname, __FILE__, __LINE__, __func__, ngrp);
+	}
+	free(grp);
+	EVP_CIPHER_CTX_free(ctx);
+	sqlite3_finalize(readq);
+	sqlite3_finalize(nameq);
+	sqlite3_free(sql);
+	return(retc);
+}
+
+/* Sealed transactions themselves, in the order they were sealed */
+static int
+vaultlist(sqlite3 *dbptr, const vaultflt *flt) {
+	int retc, tidlen, len;
+	uint32_t desclen;
+	size_t cap;
+	vaultamt amt;
+	const char *tid;
+	char *where, *sql, label[128];
+	unsigned char packed[VAULT_BOXLEN(VAULT_AMTLEN)];
+	unsigned char *plain, *grown;
+	EVP_CIPHER_CTX *ctx;
+	sqlite3_stmt *readq, *nameq;
+	outbuf out;
+	readq = nameq = NULL;
+	plain = NULL;
+	cap = 0;
+	ctx = NULL;
+	sql = NULL;
+
+	if (((retc = vaultderive(dbptr, false)) == SQLITE_OK) && ((ctx = vaultcipher(false)) == NULL)) {
+		retc = -1;
+	}
+	if (retc == SQLITE_OK) {
+		where = vaultwhere(flt);
+		sql = sqlite3_mprintf("SELECT tid, abox, dbox FROM main.vault%s ORDER BY rowid LIMIT ?14;", where);
+		sqlite3_free(where);
+		if ((retc = sqlite3_prepare_v2(dbptr, sql, -1, &readq, NULL)) != SQLITE_OK) {
+			nxerr(sqlite3_errmsg(dbptr));
+		} else {
+			vaultbind(readq, flt);
+			sqlite3_bind_int64(readq, 14, flt->limit);
+			sqlite3_prepare_v2(dbptr, "SELECT cat FROM main.xcats WHERE key = ?1;", -1, &nameq, NULL);
+			retc = outbegin(&out, rptout, vaultrows, 5);
+		}
+	}
+	while ((retc == SQLITE_OK) && (sqlite3_step(readq) == SQLITE_ROW)) {
+		tid = (const char *)sqlite3_column_text(readq, 0);
+		tidlen = sqlite3_column_bytes(readq, 0);
+		if ((size_t)sqlite3_column_bytes(readq, 2) > cap) {
+			cap = (size_t)sqlite3_column_bytes(readq, 2) + 256;
+			if ((grown = realloc(plain, cap)) == NULL) {
+				nxerr(strerror(errno));
+				retc = -1;
+				break;
+			}
+			plain = grown;
+		}
+		if ((sqlite3_column_bytes(readq, 1) != (int)sizeof(packed))
+				|| (vaultunbox(ctx, tid, tidlen, 'a', sqlite3_column_blob(readq, 1), sqlite3_column_bytes(readq, 1), packed) != VAULT_AMTLEN)
+				|| ((len = vaultunbox(ctx, tid, tidlen, 'd', sqlite3_column_blob(readq, 2), sqlite3_column_bytes(readq, 2), plain)) < 4)
+				|| ((desclen = (uint32_t)plain[0] | ((uint32_t)plain[1] << 8) | ((uint32_t)plain[2] << 16) | ((uint32_t)plain[3] << 24)) > (uint32_t)(len - 4))) {
+			fprintf(stderr, "ERR: %s [%s:%u] %s: Sealed transaction %s fails authentication\n", __progname, __FILE__, __LINE__, __func__, tid);
+			retc = -1;
+			break;
+		}
+		vaultunpack(packed, &amt);
+		outstr(&out, 0, tid, tidlen);
+		outdate(&out, 1, amt.year, amt.month, amt.day);
+		outdec(&out, 2, amt.cents, 2);
+		if (amt.cat < 0) {
+			outstr(&out, 3, NULL, -1);
+		} else {
+			vaultlabel(nameq, amt.cat, label, sizeof(label));
+			outstr(&out, 3, label, -1);
+		}
+		outstr(&out, 4, (const char *)plain + 4, (int)desclen);
+		retc = outrow(&out);
+	}
+	if (retc == SQLITE_OK) {
+		retc = outend(&out);
+	}
+	if (plain != NULL) {
+		explicit_bzero(plain, cap);
+	}
+	free(plain);
+	EVP_CIPHER_CTX_free(ctx);
+	sqlite3_finalize(readq);
+	sqlite3_finalize(nameq);
+	sqlite3_free(sql);
+	return(retc);
+}
+
+/* 
+ * vault seal [-y year] | open [-c category] [-y year [-m month]]
+ *     | report [-g cat|month|catmonth] [-c category] [-y year [-m month]]
+ *     | list [-c category] [-y year [-m month]] [-n limit]
+ */
+int
+vault(char **argstr, sqlite3 *dbptr) {
+	int retc;
+	const char *action, *catname;
+	vaultflt flt;
+	sqlite3_stmt *nameq;
+	retc = 0;
+	catname = NULL;
+	nameq = NULL;
+	memset(&flt, 0, sizeof(vaultflt));
+	flt.cat = -2;
+	flt.limit = -1;
+
+	if (dbg) {
+		nxentr();
+	}
+	if ((argstr == NULL) || ((action = *argstr) == NULL)) {
+		nxerr("Expected one of 'seal', 'open', 'report' or 'list'");
+		if (dbg) { nxexit(); }
+		return(-1);
+	}
+	for (argstr++; (retc == 0) && (*argstr != NULL); argstr++) {
+		if ((strcmp(*argstr, "-y") == 0) && (argstr[1] != NULL)) {
+			retc = numarg(*++argstr, &flt.year);
+		} else if ((strcmp(*argstr, "-m") == 0) && (argstr[1] != NULL)) {
+			retc = numarg(*++argstr, &flt.month);
+		} else if ((strcmp(*argstr, "-n") == 0) && (argstr[1] != NULL)) {
+			retc = numarg(*++argstr, &flt.limit);
+		} else if ((strcmp(*argstr, "-c") == 0) && (argstr[1] != NULL)) {
+			catname = *++argstr;
+		} else if ((strcmp(*argstr, "-g") == 0) && (argstr[1] != NULL)) {
+			argstr++;
+			if (strcmp(*argstr, "cat") == 0) { flt.group = vgcat; }
+			else if (strcmp(*argstr, "month") == 0) { flt.group = vgmonth; }
+			else if (strcmp(*argstr, "catmonth") == 0) { flt.group = vgcatmonth; }
+			else {
+				fprintf(stderr, "ERR: %s [%s:%u] %s: Unknown grouping %s\n", __progname, __FILE__, __LINE__, __func__, *argstr);
+				retc = -1;
+			}
+		} else {
+			fprintf(stderr, "ERR: %s [%s:%u] %s: Unexpected argument %s\n", __progname, __FILE__, __LINE__, __func__, *argstr);
+			retc = -1;
+		}
+	}
+	if ((retc == 0) && ((flt.month < 0) || (flt.month > 12) || ((flt.month > 0) && (flt.year <= 0)))) {
+		nxerr("Month has to be between 1 and 12, and comes with a year");
+		retc = -1;
+	}
+	if ((retc == 0) && (catname != NULL) && (sqlite3_prepare_v2(dbptr, "SELECT key FROM main.xcats WHERE cat = upper(?1);", -1, &nameq, NULL) == SQLITE_OK)) {
+		sqlite3_bind_text(nameq, 1, catname, -1, SQLITE_STATIC);
+		flt.cat = (sqlite3_step(nameq) == SQLITE_ROW) ? sqlite3_column_int64(nameq, 0) : -2;
+		sqlite3_finalize(nameq);
+		if (flt.cat == -2) {
+			fprintf(stderr, "ERR: %s [%s:%u] %s: No such category %s\n", __progname, __FILE__, __LINE__, __func__, catname);
+			retc = -1;
+		}
+	}
+	if (retc != 0) {
+		/* already reported */
+	} else if ((strcmp(action, "seal") == 0) && ((flt.month > 0) || (flt.cat > -2))) {
+		nxerr("Sealing goes by whole years, only -y applies");
+		retc = -1;
+	} else if (strcmp(action, "seal") == 0) {
+		retc = vaultseal(dbptr, &flt);
+	} else if (strcmp(action, "open") == 0) {
+		retc = vaultunseal(dbptr, &flt);
+	} else if (strcmp(action, "report") == 0) {
+		retc = vaultreport(dbptr, &flt);
+	} else if (strcmp(action, "list") == 0) {
+		retc = vaultlist(dbptr, &flt);
+	} else {
+		fprintf(stderr, "ERR: %s [%s:%u] %s: Unknown vault command %s\n", __progname, __FILE__, __LINE__, __func__, action);
+		retc = -1;
+	}
+	if (dbg) {
+		nxexit();
+	}
+	return(retc);
+}
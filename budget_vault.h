@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2019, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* 
+ * Declarations for the sealed ledger, transactions kept with their amount and description encrypted
+ */
+#define __EXILE_BUDGET_VAULT_H
+
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Longest key file read, anything past this is ignored */
+#define VAULT_MAXSECRET 1024
+/* PBKDF2 rounds for new vaults, paid once per run rather than per row */
+#ifndef VAULT_ROUNDS
+#define VAULT_ROUNDS 100000
+#endif
+#define VAULT_SALTLEN 16
+/* ChaCha20-Poly1305 key, nonce and tag */
+#define VAULT_KEYLEN 32
+#define VAULT_NONCELEN 12
+#define VAULT_TAGLEN 16
+/* Bytes kept of each blind token */
+#define VAULT_TOKLEN 16
+/* Packed amount box: cents, year, month, day and category */
+#define VAULT_AMTLEN 18
+#define VAULT_BOXLEN(len) (VAULT_NONCELEN + (len) + VAULT_TAGLEN)
+
+/* Decrypted contents of an amount box */
+typedef struct __vaultamt {
+	int64_t cents;
+	int32_t year, month, day;
+	int32_t cat; /* -1 when uncategorized */
+} vaultamt;
+
+int vaultopen(const char *keyfile);
+void vaultclose(void);
+int vault(char **argstr, sqlite3 *dbptr);
@@ -38,6 +38,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 /* Project specific headers */
 #ifndef __EXILE_BUDGET_H
@@ -117,3 +118,46 @@ cfree(void *buf, size_t size) {
 	buf = NULL;
 }
 
+/* 
+ * Map between hashspec values and the digest names used both in the config file
+ * and by libcrypto's EVP_get_digestbyname()
+ */
+static const struct {
+	hashspec spec;
+	const char *name;
+} hashnames[] = {
+	{ sha256, "SHA256" },
+	{ sha512, "SHA512" },
+	{ whirlpool, "whirlpool" },
+	{ shake256, "SHAKE256" },
+	{ blake2b512, "BLAKE2b512" },
+	{ sha512256, "SHA512-256" },
+	{ sha385, "SHA384" },
+	{ sha3512, "SHA3-512" },
+	{ sha3256, "SHA3-256" },
+	{ none, NULL }
+};
+
+const char *
+hashname(hashspec spec) {
+	register int i;
+
+	for (i = 0; hashnames[i].name != NULL; i++) {
+		if (hashnames[i].spec == spec) {
+			return(hashnames[i].name);
+		}
+	}
+	return(NULL);
+}
+
+hashspec
+hashparse(const char *name) {
+	register int i;
+
+	for (i = 0; (name != NULL) && (hashnames[i].name != NULL); i++) {
+		if (strcasecmp(name, hashnames[i].name) == 0) {
+			return(hashnames[i].spec);
+		}
+	}
+	return(none);
+}
@@ -82,6 +82,9 @@ typedef enum __cipherspec {
 	chacha20poly1305 = 16
 } cipherspec;
 
+/* Matches what sparseconfig() writes out */
+#define DEFAULT_HASHSPEC sha3512
+
 /* 
  * Ensure we have a dbconfig struct available for manipulation
  */
@@ -99,3 +102,5 @@ void cfree(void *buf, size_t size);
 void sparseconfig(const char *conffile);
 void checkparam(const char *confline, dbconfig *confdata);
 int parseconfig(int *fdptr, dbconfig *dbdata);
+const char *hashname(hashspec spec);
+hashspec hashparse(const char *name);
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2019, Exile Heavy Industries
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted (subject to the limitations in the disclaimer
+ * below) provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of the copyright holder nor the names of its contributors may be used
+ *   to endorse or promote products derived from this software without specific
+ *   prior written permission.
+ * 
+ * NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE GRANTED BY THIS
+ * LICENSE. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* 
+ * Build-time helper, runs budget.sql against an in-memory database and writes the
+ * serialized result out as a C array. The budget binary embeds that image so -I only
+ * has to write it to disk instead of replaying every statement in budget.sql.
+ *
+ * Usage: mktmpl budget.sql > budget_tmpl.c
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+int
+main(int ac, char **av) {
+	int fd, version;
+	struct stat sqlstat;
+	char *sql, *errmsg;
+	unsigned char *image;
+	sqlite3_int64 len, i;
+	sqlite3 *dbptr;
+	sqlite3_stmt *verq;
+	dbptr = NULL; verq = NULL; errmsg = NULL;
+	version = 0;
+
+	if (ac != 2) {
+		errx(1, "usage: mktmpl budget.sql");
+	}
+	if (((fd = open(av[1], O_RDONLY)) < 0) || (fstat(fd, &sqlstat) != 0)) {
+		err(1, "%s", av[1]);
+	}
+	/* copied out so the script is NUL terminated for sqlite3_exec() */
+	if ((sql = calloc((size_t)sqlstat.st_size + 1, sizeof(char))) == NULL) {
+		err(1, "calloc");
+	}
+	if (read(fd, sql, (size_t)sqlstat.st_size) != (ssize_t)sqlstat.st_size) {
+		err(1, "%s", av[1]);
+	}
+	close(fd);
+
+	if ((sqlite3_open(":memory:", &dbptr) != SQLITE_OK) || (sqlite3_exec(dbptr, sql, NULL, NULL, &errmsg) != SQLITE_OK)) {
+		errx(1, "%s: %s", av[1], (errmsg != NULL) ? errmsg : sqlite3_errmsg(dbptr));
+	}
+	/* drop the slack left over from building the indexes */
+	if (sqlite3_exec(dbptr, "VACUUM;", NULL, NULL, &errmsg) != SQLITE_OK) {
+		errx(1, "VACUUM: %s", errmsg);
+	}
+	/* VACUUM may renumber the implicit rowids trans_fts is keyed on */
+	if (sqlite3_exec(dbptr, "INSERT INTO trans_fts (trans_fts) VALUES ('rebuild');", NULL, NULL, &errmsg) != SQLITE_OK) {
+		errx(1, "trans_fts: %s", errmsg);
+	}
+	if ((sqlite3_prepare_v2(dbptr, "PRAGMA user_version;", -1, &verq, NULL) == SQLITE_OK) && (sqlite3_step(verq) == SQLITE_ROW)) {
+		version = sqlite3_column_int(verq, 0);
+	}
+	sqlite3_finalize(verq);
+	if ((image = sqlite3_serialize(dbptr, "main", &len, 0)) == NULL) {
+		errx(1, "Unable to serialize the template database");
+	}
+
+	printf("/* Generated by mktmpl from %s, do not edit */\n"
+			"#include <stddef.h>\n\n"
+			"const int budget_tmpl_version = %d;\n"
+			"const size_t budget_tmpl_len = %lld;\n"
+			"const unsigned char budget_tmpl[] = {", av[1], version, (long long)len);
+	for (i = 0; i < len; i++) {
+		printf("%s0x%02x,", ((i % 16) == 0) ? "\n\t" : " ", image[i]);
+	}
+	printf("\n};\n");
+
+	sqlite3_free(image);
+	sqlite3_close(dbptr);
+	free(sql);
+	return(0);
+}